@@ -0,0 +1,33 @@
+open Zookeeper
+
+(* Build against zookeeper_st.cma (make st) to use this driver. *)
+
+let watcher_fn zhandle event_type conn_state path watcher_ctx =
+  if event_type = Zookeeper.ZOO_SESSION_EVENT then
+    if conn_state = Zookeeper.ZOO_CONNECTED_STATE then
+      print_string "Connected to zookeeper service successfully.\n"
+    else if conn_state = Zookeeper.ZOO_EXPIRED_SESSION_STATE then
+      print_string "Zookeeper session expired\n"
+
+let data_completion rc value value_len stat data =
+  if rc = Zookeeper.ZOK then
+    print_string ("Get node Ok with returned value: " ^ value ^ "\n")
+  else
+    print_string "Failed to get node.\n"
+
+let rec run handle =
+  let (rc, i) = interest handle in
+  if rc <> Zookeeper.ZOK then failwith "zookeeper_interest failed";
+  let fd = i.interest_fd in
+  let rd = if i.interest_read then [fd] else [] in
+  let wr = if i.interest_write then [fd] else [] in
+  let timeout = float_of_int i.interest_timeout /. 1000. in
+  let (r, w, _) = Unix.select rd wr [] timeout in
+  ignore (process handle (r <> []) (w <> []));
+  run handle
+
+let handle = init "127.0.0.1:2181" watcher_fn 3600 {client_id = 0L; passwd=""} "hello world" 0
+
+let _ = aget handle "/example" 0 data_completion "(*aget*)"
+
+let _ = run handle
@@ -0,0 +1,345 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * Benchmarks of the binding, run by `make bench`.
+ *
+ * The micro benchmarks time the conversions between the C client's
+ * structures and OCaml values through the stubs compiled in with
+ * -DZKOCAML_BENCH. The macro benchmarks run get, set and create, both
+ * synchronously and asynchronously, against the stand-in server (started
+ * in a child process, so that neither its allocations nor its threads
+ * show up in the numbers) or against the server given with -host.
+ *
+ * Every result is printed on stdout as one JSON object per line, so that
+ * runs of different releases can be compared with diff or jq. Words per
+ * operation are those allocated on the OCaml heap, less what the harness
+ * itself allocates for the same loop.
+ **)
+
+open Zookeeper
+
+external bench_build_stat: unit -> stat = "zkocaml_bench_build_stat"
+external bench_build_strings: int -> strings = "zkocaml_bench_build_strings"
+external bench_parse_acls: acls -> int = "zkocaml_bench_parse_acls"
+external bench_error_c2ml: int -> error = "zkocaml_bench_error_c2ml"
+external bench_error_ml2c: error -> int = "zkocaml_bench_error_ml2c"
+external bench_event_c2ml: int -> event = "zkocaml_bench_event_c2ml"
+external bench_state_c2ml: int -> state = "zkocaml_bench_state_c2ml"
+external bench_perm_ml2c: perm -> int = "zkocaml_bench_perm_ml2c"
+
+let iterations = ref 1_000_000
+let ops = ref 20_000
+let window = ref 256
+let payload_size = ref 128
+let latency = ref 0.0
+let host = ref ""
+let run_micro = ref true
+let run_macro = ref true
+
+let options = [
+  "-iterations", Arg.Set_int iterations,
+  "N  Iterations of each micro benchmark (default 1000000)";
+  "-ops", Arg.Set_int ops,
+  "N  Operations of each macro benchmark (default 20000)";
+  "-window", Arg.Set_int window,
+  "N  Asynchronous requests in flight at once (default 256)";
+  "-size", Arg.Set_int payload_size,
+  "N  Bytes of data per node (default 128)";
+  "-latency", Arg.Set_float latency,
+  "MS  Latency added to every reply of the stand-in server (default 0)";
+  "-host", Arg.Set_string host,
+  "HOSTS  Benchmark against these servers instead of the stand-in";
+  "-micro", Arg.Unit (fun () -> run_macro := false),
+  " Run the micro benchmarks only";
+  "-macro", Arg.Unit (fun () -> run_micro := false),
+  " Run the macro benchmarks only";
+]
+
+(** Output *)
+
+let emit name fields =
+  let field (k, v) = Printf.sprintf "%S: %s" k v in
+  Printf.printf "{\"bench\": %S, %s}\n%!" name
+    (String.concat ", " (List.map field fields))
+
+let int n = string_of_int n
+let float f = Printf.sprintf "%.3f" f
+let string s = Printf.sprintf "%S" s
+
+let now = Unix.gettimeofday
+
+let allocated_words () =
+  let s = Gc.quick_stat () in
+  s.Gc.minor_words +. s.Gc.major_words -. s.Gc.promoted_words
+
+(** Micro benchmarks *)
+
+let measure n f =
+  for _ = 1 to n / 10 do ignore (Sys.opaque_identity (f ())) done;
+  let w0 = allocated_words () in
+  let t0 = now () in
+  for _ = 1 to n do ignore (Sys.opaque_identity (f ())) done;
+  let t1 = now () in
+  let w1 = allocated_words () in
+  ((t1 -. t0) /. float_of_int n, (w1 -. w0) /. float_of_int n)
+
+let micro_overhead = lazy (measure !iterations (fun () -> ()))
+
+let micro name ?(scale = 1) f =
+  let n = max 1 (!iterations / scale) in
+  let (base_time, base_words) = Lazy.force micro_overhead in
+  let (time, words) = measure n f in
+  emit ("micro." ^ name) [
+    "iterations", int n;
+    "ns_per_op", float (max 0.0 (time -. base_time) *. 1e9);
+    "words_per_op", float (words -. base_words);
+  ]
+
+let acl n =
+  Array.init n (fun i ->
+    {perms = 0x1f; scheme = "digest"; id = Printf.sprintf "user%d:secret" i})
+
+let micro_benchmarks () =
+  micro "build_stat" bench_build_stat;
+  List.iter (fun n ->
+    micro (Printf.sprintf "build_strings.%d" n) ~scale:(max 1 (n / 8))
+      (fun () -> bench_build_strings n))
+    [0; 16; 1024];
+  List.iter (fun n ->
+    let acls = acl n in
+    micro (Printf.sprintf "parse_acls.%d" n) ~scale:n
+      (fun () -> bench_parse_acls acls))
+    [1; 8];
+  (* ZOK heads the error table and ZSESSIONMOVED ends it. *)
+  micro "enum.error_c2ml.first" (fun () -> bench_error_c2ml 0);
+  micro "enum.error_c2ml.last" (fun () -> bench_error_c2ml (-118));
+  micro "enum.error_ml2c" (fun () -> bench_error_ml2c ZNONODE);
+  micro "enum.event_c2ml" (fun () -> bench_event_c2ml 3);
+  micro "enum.state_c2ml" (fun () -> bench_state_c2ml 3);
+  micro "enum.perm_ml2c" (fun () -> bench_perm_ml2c ZOO_PERM_ADMIN)
+
+(** Macro benchmarks *)
+
+(**
+ * Starts the stand-in server in a child process and returns its host
+ * string. The child stops when the pipe to it is closed, that is when
+ * this process exits.
+ **)
+let fork_server () =
+  let (port_r, port_w) = Unix.pipe () in
+  let (life_r, life_w) = Unix.pipe () in
+  match Unix.fork () with
+  | 0 ->
+    Unix.close port_r;
+    Unix.close life_w;
+    let config = {Zookeeper_server.default_config with
+                  Zookeeper_server.latency = !latency /. 1000.0} in
+    let server = Zookeeper_server.start ~config () in
+    let port = string_of_int (Zookeeper_server.port server) ^ "\n" in
+    ignore (Unix.write_substring port_w port 0 (String.length port));
+    Unix.close port_w;
+    ignore (try Unix.read life_r (Bytes.create 1) 0 1 with _ -> 0);
+    Zookeeper_server.stop server;
+    exit 0
+  | _ ->
+    Unix.close port_w;
+    Unix.close life_r;
+    let ic = Unix.in_channel_of_descr port_r in
+    let port = input_line ic in
+    close_in ic;
+    "127.0.0.1:" ^ port
+
+let connect hosts =
+  let m = Mutex.create () and c = Condition.create () in
+  let connected = ref false in
+  let watcher _ event state _ _ =
+    if event = ZOO_SESSION_EVENT && state = ZOO_CONNECTED_STATE then begin
+      Mutex.lock m;
+      connected := true;
+      Condition.broadcast c;
+      Mutex.unlock m
+    end in
+  let zh = init hosts watcher 10000 {client_id = 0L; passwd = ""} "bench" 0 in
+  Mutex.lock m;
+  while not !connected do Condition.wait c m done;
+  Mutex.unlock m;
+  zh
+
+let percentile sorted p =
+  let n = Array.length sorted in
+  if n = 0 then 0.0 else sorted.(min (n - 1) (n * p / 100))
+
+let report name mode n errors elapsed latencies words base_words =
+  Array.sort compare latencies;
+  emit ("macro." ^ name) [
+    "mode", string mode;
+    "ops", int n;
+    "errors", int errors;
+    "ops_per_sec", float (float_of_int n /. elapsed);
+    "p50_us", float (percentile latencies 50 *. 1e6);
+    "p99_us", float (percentile latencies 99 *. 1e6);
+    "words_per_op", float ((words -. base_words) /. float_of_int n);
+  ]
+
+(** Runs f 0 .. f (n - 1) back to back. *)
+let run_sync n f =
+  let latencies = Array.make n 0.0 in
+  let errors = ref 0 in
+  let w0 = allocated_words () in
+  let t0 = now () in
+  for i = 0 to n - 1 do
+    let start = now () in
+    if f i <> ZOK then incr errors;
+    latencies.(i) <- now () -. start
+  done;
+  let t1 = now () in
+  let w1 = allocated_words () in
+  (t1 -. t0, latencies, w1 -. w0, !errors)
+
+(**
+ * Submits f 0 .. f (n - 1), keeping at most !window of them in flight.
+ * Each f i k must start its request and arrange for k to be called with
+ * the result when it completes.
+ **)
+let run_async n f =
+  let latencies = Array.make n 0.0 in
+  let m = Mutex.create () and c = Condition.create () in
+  let in_flight = ref 0 and completed = ref 0 and errors = ref 0 in
+  let complete i start rc =
+    let elapsed = now () -. start in
+    Mutex.lock m;
+    latencies.(i) <- elapsed;
+    if rc <> ZOK then incr errors;
+    decr in_flight;
+    incr completed;
+    Condition.signal c;
+    Mutex.unlock m in
+  let w0 = allocated_words () in
+  let t0 = now () in
+  for i = 0 to n - 1 do
+    Mutex.lock m;
+    while !in_flight >= !window do Condition.wait c m done;
+    incr in_flight;
+    Mutex.unlock m;
+    let start = now () in
+    let rc = f i (complete i start) in
+    if rc <> ZOK then complete i start rc
+  done;
+  Mutex.lock m;
+  while !completed < n do Condition.wait c m done;
+  Mutex.unlock m;
+  let t1 = now () in
+  let w1 = allocated_words () in
+  (t1 -. t0, latencies, w1 -. w0, !errors)
+
+let sync_overhead = lazy (
+  let (_, _, words, _) = run_sync !ops (fun _ -> ZOK) in words)
+
+let async_overhead = lazy (
+  let (_, _, words, _) = run_async !ops (fun _ k -> k ZOK; ZOK) in words)
+
+let sync name f =
+  let base = Lazy.force sync_overhead in
+  let (elapsed, latencies, words, errors) = run_sync !ops f in
+  report name "sync" !ops errors elapsed latencies words base
+
+let async name mode f =
+  let base = Lazy.force async_overhead in
+  let (elapsed, latencies, words, errors) = run_async !ops f in
+  report name mode !ops errors elapsed latencies words base
+
+(**
+ * Drains queued completions on a thread of its own until the returned
+ * function is called.
+ **)
+let start_drainer () =
+  let fd = delivery_fd () in
+  let stop = ref false in
+  let rec loop () =
+    if not !stop then begin
+      (match Unix.select [fd] [] [] 0.1 with
+       | _ -> ignore (drain_completions 0)
+       | exception Unix.Unix_error (Unix.EINTR, _, _) -> ());
+      loop ()
+    end in
+  let thread = Thread.create loop () in
+  fun () ->
+    stop := true;
+    Thread.join thread
+
+(**
+ * The binding has no flag for plain persistent nodes, so each run works
+ * under a persistent sequential node of its own.
+ **)
+let create_root zh payload acl =
+  let (rc, root) = create zh "/zkocaml-bench-" "" acl ZOO_SEQUENCE in
+  if rc <> ZOK then failwith "cannot create the benchmark root";
+  let (rc, node) = create zh (root ^ "/node-") payload acl ZOO_SEQUENCE in
+  if rc <> ZOK then failwith "cannot create the benchmark node";
+  (root, node)
+
+let async_benchmarks zh mode root node payload acl =
+  async "get" mode (fun _ k ->
+    aget zh node 0 (fun rc _ _ _ _ -> k rc) "bench");
+  async "set" mode (fun _ k ->
+    aset zh node payload (-1) (fun rc _ _ -> k rc) "bench");
+  async "create" mode (fun _ k ->
+    acreate zh (root ^ "/async-") payload acl ZOO_SEQUENCE
+      (fun rc _ _ -> k rc) "bench")
+
+let macro_benchmarks () =
+  let hosts = if !host = "" then fork_server () else !host in
+  let zh = connect hosts in
+  let payload = String.make !payload_size 'x' in
+  let acl = [|{perms = 0x1f; scheme = "world"; id = "anyone"}|] in
+  let (root, node) = create_root zh payload acl in
+
+  sync "get" (fun _ -> let (rc, _, _) = get zh node 0 in rc);
+  sync "set" (fun _ -> set zh node payload (-1));
+  sync "create" (fun _ ->
+    fst (create zh (root ^ "/sync-") payload acl ZOO_SEQUENCE));
+
+  async_benchmarks zh "async" root node payload acl;
+
+  set_delivery_mode DELIVERY_QUEUED;
+  let stop_drainer = start_drainer () in
+  async_benchmarks zh "async_queued" root node payload acl;
+  stop_drainer ();
+  set_delivery_mode DELIVERY_DIRECT;
+
+  ignore (rmr zh root 0);
+  ignore (close zh)
+
+let () =
+  Arg.parse (Arg.align options)
+    (fun arg -> raise (Arg.Bad ("unexpected argument " ^ arg)))
+    "zkocaml_bench [options]\nRuns the benchmarks, one JSON object per line.";
+  emit "run" [
+    "ocaml", string Sys.ocaml_version;
+    "iterations", int !iterations;
+    "ops", int !ops;
+    "window", int !window;
+    "size", int !payload_size;
+    "latency_ms", float !latency;
+    "host", string (if !host = "" then "stand-in" else !host);
+  ];
+  if !run_micro then micro_benchmarks ();
+  if !run_macro then macro_benchmarks ()
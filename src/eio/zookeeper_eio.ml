@@ -0,0 +1,151 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+open Zookeeper
+
+(**
+ * Raised in the calling fiber when an operation completes with anything
+ * but ZOK, or when its request could not be submitted.
+ **)
+exception Error of error
+
+(**
+ * Whether the pump is running. There is one per process, as the queue and
+ * its notification fd are shared by every handle.
+ **)
+let running = Atomic.make false
+
+(**
+ * Forks the daemon fiber that wakes suspended callers, unless it is
+ * running already: it waits on the notification fd and drains queued
+ * completions, each of which resolves the promise its fiber is awaiting.
+ * The pump belongs to the switch of the call that forked it; once that
+ * switch is finished, the next call forks a new one.
+ **)
+let start ~sw =
+  if Atomic.compare_and_set running false true then begin
+    set_delivery_mode DELIVERY_QUEUED;
+    let fd = delivery_fd () in
+    let rec pump () =
+      Eio_unix.await_readable fd;
+      ignore (drain_completions 0);
+      pump () in
+    Eio.Fiber.fork_daemon ~sw (fun () ->
+      Fun.protect ~finally:(fun () -> Atomic.set running false) pump)
+  end
+
+let submit f =
+  if not (Atomic.get running) then
+    invalid_arg "Zookeeper_eio: no completion pump, see Zookeeper_eio.start";
+  let (p, r) = Eio.Promise.create () in
+  let rc = f r in
+  if rc <> ZOK then raise (Error rc);
+  Eio.Promise.await_exn p
+
+let resolve r rc v =
+  if rc = ZOK then Eio.Promise.resolve_ok r v
+  else Eio.Promise.resolve_error r (Error rc)
+
+let init ~sw host watcher recv_timeout cid context flags =
+  start ~sw;
+  Zookeeper.init host watcher recv_timeout cid context flags
+
+(**
+ * Zookeeper.close joins the threads of the C client, so it runs in a
+ * system thread to keep the domain, and the pump draining completions
+ * the C client may still be waiting to queue, going meanwhile.
+ **)
+let close zh =
+  let rc = Eio_unix.run_in_systhread (fun () -> Zookeeper.close zh) in
+  if rc <> ZOK then raise (Error rc)
+
+let create zh path value acl flag =
+  submit (fun r ->
+    acreate zh path value acl flag (fun rc name _ -> resolve r rc name) "")
+
+let delete ?(version = -1) zh path =
+  submit (fun r ->
+    adelete zh path version (fun rc _ -> resolve r rc ()) "")
+
+let exists_completion r rc stat _ =
+  if rc = ZNONODE then Eio.Promise.resolve_ok r None
+  else resolve r rc (Some stat)
+
+let exists ?(watch = false) zh path =
+  submit (fun r ->
+    aexists zh path (if watch then 1 else 0) (exists_completion r) "")
+
+let wexists zh path watcher =
+  submit (fun r ->
+    awexists zh path watcher "" (exists_completion r) "")
+
+let get ?(watch = false) zh path =
+  submit (fun r ->
+    aget zh path (if watch then 1 else 0)
+      (fun rc value _ stat _ -> resolve r rc (value, stat)) "")
+
+let wget zh path watcher =
+  submit (fun r ->
+    awget zh path watcher ""
+      (fun rc value _ stat _ -> resolve r rc (value, stat)) "")
+
+let set ?(version = -1) zh path value =
+  submit (fun r ->
+    aset zh path value version (fun rc stat _ -> resolve r rc stat) "")
+
+let get_children ?(watch = false) zh path =
+  submit (fun r ->
+    aget_children zh path (if watch then 1 else 0)
+      (fun rc children _ -> resolve r rc children) "")
+
+let wget_children zh path watcher =
+  submit (fun r ->
+    awget_children zh path watcher ""
+      (fun rc children _ -> resolve r rc children) "")
+
+let get_children2 ?(watch = false) zh path =
+  submit (fun r ->
+    aget_children2 zh path (if watch then 1 else 0)
+      (fun rc children stat _ -> resolve r rc (children, stat)) "")
+
+let wget_children2 zh path watcher =
+  submit (fun r ->
+    awget_children2 zh path watcher ""
+      (fun rc children stat _ -> resolve r rc (children, stat)) "")
+
+let sync zh path =
+  submit (fun r ->
+    async zh path (fun rc value _ -> resolve r rc value) "")
+
+let get_acl zh path =
+  submit (fun r ->
+    aget_acl zh path (fun rc acl stat _ -> resolve r rc (acl, stat)) "")
+
+let set_acl ?(version = -1) zh path acl =
+  submit (fun r ->
+    aset_acl zh path version acl (fun rc _ -> resolve r rc ()) "")
+
+let add_auth zh scheme cert =
+  submit (fun r ->
+    Zookeeper.add_auth zh scheme cert (fun rc _ -> resolve r rc ()) "")
+
+let multi zh ops =
+  submit (fun r ->
+    amulti zh ops (fun rc results _ -> resolve r ZOK (rc, results)) "")
@@ -0,0 +1,78 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * Direct-style ZooKeeper API for Eio.
+ *
+ * Each operation submits the matching asynchronous request and suspends
+ * the calling fiber until its completion arrives, so no domain blocks and
+ * the runtime lock is never held across a round trip. Completions are
+ * queued by the binding and drained by a daemon fiber watching the
+ * notification fd; any number of fibers may share one session.
+ * Operations raise [Error rc] when they do not complete with ZOK.
+ **)
+
+open Zookeeper
+
+exception Error of error
+
+(**
+ * Forks the completion pump under [sw], unless it is running already;
+ * implied by [init]. There is a single pump per process, owned by the
+ * switch it was forked under, which must therefore outlive every handle
+ * and every operation in progress: once it is finished, operations raise
+ * [Invalid_argument] until [start] is called again, and those suspended
+ * at that point are never resumed.
+ **)
+val start : sw:Eio.Switch.t -> unit
+
+val init :
+  sw:Eio.Switch.t ->
+  string -> watcher_callback -> int -> client_id -> string -> int -> zhandle
+
+(** Closes the handle in a system thread, without blocking the domain. *)
+val close : zhandle -> unit
+
+val create : zhandle -> string -> string -> acls -> create_flag -> string
+val delete : ?version:int -> zhandle -> string -> unit
+
+(** [None] when the node does not exist. *)
+val exists : ?watch:bool -> zhandle -> string -> stat option
+val wexists : zhandle -> string -> watcher_callback -> stat option
+
+val get : ?watch:bool -> zhandle -> string -> string * stat
+val wget : zhandle -> string -> watcher_callback -> string * stat
+val set : ?version:int -> zhandle -> string -> string -> stat
+
+val get_children : ?watch:bool -> zhandle -> string -> strings
+val wget_children : zhandle -> string -> watcher_callback -> strings
+val get_children2 : ?watch:bool -> zhandle -> string -> strings * stat
+val wget_children2 : zhandle -> string -> watcher_callback -> strings * stat
+
+val sync : zhandle -> string -> string
+val get_acl : zhandle -> string -> acls * stat
+val set_acl : ?version:int -> zhandle -> string -> acls -> unit
+val add_auth : zhandle -> string -> string -> unit
+
+(**
+ * Returns the transaction's own error code and per-op results, so a
+ * failed transaction does not raise.
+ **)
+val multi : zhandle -> op array -> error * op_result array
@@ -0,0 +1,137 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+open Zookeeper
+
+(**
+ * Raised by a promise whose operation completed with anything but ZOK,
+ * or whose request could not be submitted in the first place.
+ **)
+exception Error of error
+
+(**
+ * Switches the binding to queued delivery and hooks the notification fd
+ * into the Lwt engine, so every completion is resolved on the Lwt main
+ * loop instead of the ZooKeeper io thread. Forced by every entry point.
+ **)
+let engine = lazy begin
+  set_delivery_mode DELIVERY_QUEUED;
+  Lwt_engine.on_readable (delivery_fd ())
+    (fun _ -> ignore (drain_completions 0))
+end
+
+let start () = ignore (Lazy.force engine)
+
+let submit f =
+  start ();
+  let (p, r) = Lwt.wait () in
+  let rc = f r in
+  if rc <> ZOK then Lwt.fail (Error rc) else p
+
+let resolve r rc v =
+  if rc = ZOK then Lwt.wakeup_later r v
+  else Lwt.wakeup_later_exn r (Error rc)
+
+let init host watcher recv_timeout cid context flags =
+  start ();
+  Zookeeper.init host watcher recv_timeout cid context flags
+
+(**
+ * Zookeeper.close joins the threads of the C client, so it runs on a
+ * preemptive thread to keep the Lwt main loop, and the completions still
+ * being drained on it, going meanwhile.
+ **)
+let close zh =
+  Lwt.bind (Lwt_preemptive.detach Zookeeper.close zh) (fun rc ->
+    if rc <> ZOK then Lwt.fail (Error rc) else Lwt.return_unit)
+
+let create zh path value acl flag =
+  submit (fun r ->
+    acreate zh path value acl flag (fun rc name _ -> resolve r rc name) "")
+
+let delete ?(version = -1) zh path =
+  submit (fun r ->
+    adelete zh path version (fun rc _ -> resolve r rc ()) "")
+
+let exists_completion r rc stat _ =
+  if rc = ZNONODE then Lwt.wakeup_later r None
+  else resolve r rc (Some stat)
+
+let exists ?(watch = false) zh path =
+  submit (fun r ->
+    aexists zh path (if watch then 1 else 0) (exists_completion r) "")
+
+let wexists zh path watcher =
+  submit (fun r ->
+    awexists zh path watcher "" (exists_completion r) "")
+
+let get ?(watch = false) zh path =
+  submit (fun r ->
+    aget zh path (if watch then 1 else 0)
+      (fun rc value _ stat _ -> resolve r rc (value, stat)) "")
+
+let wget zh path watcher =
+  submit (fun r ->
+    awget zh path watcher ""
+      (fun rc value _ stat _ -> resolve r rc (value, stat)) "")
+
+let set ?(version = -1) zh path value =
+  submit (fun r ->
+    aset zh path value version (fun rc stat _ -> resolve r rc stat) "")
+
+let get_children ?(watch = false) zh path =
+  submit (fun r ->
+    aget_children zh path (if watch then 1 else 0)
+      (fun rc children _ -> resolve r rc children) "")
+
+let wget_children zh path watcher =
+  submit (fun r ->
+    awget_children zh path watcher ""
+      (fun rc children _ -> resolve r rc children) "")
+
+let get_children2 ?(watch = false) zh path =
+  submit (fun r ->
+    aget_children2 zh path (if watch then 1 else 0)
+      (fun rc children stat _ -> resolve r rc (children, stat)) "")
+
+let wget_children2 zh path watcher =
+  submit (fun r ->
+    awget_children2 zh path watcher ""
+      (fun rc children stat _ -> resolve r rc (children, stat)) "")
+
+let sync zh path =
+  submit (fun r ->
+    async zh path (fun rc value _ -> resolve r rc value) "")
+
+let get_acl zh path =
+  submit (fun r ->
+    aget_acl zh path (fun rc acl stat _ -> resolve r rc (acl, stat)) "")
+
+let set_acl ?(version = -1) zh path acl =
+  submit (fun r ->
+    aset_acl zh path version acl (fun rc _ -> resolve r rc ()) "")
+
+let add_auth zh scheme cert =
+  submit (fun r ->
+    Zookeeper.add_auth zh scheme cert (fun rc _ -> resolve r rc ()) "")
+
+let multi zh ops =
+  submit (fun r ->
+    amulti zh ops (fun rc results _ -> resolve r ZOK (rc, results)) "")
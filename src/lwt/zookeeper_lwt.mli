@@ -0,0 +1,70 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * Lwt front end to the asynchronous ZooKeeper API.
+ *
+ * Every operation returns a promise resolved on the Lwt main loop. The
+ * binding is put in queued delivery mode and its notification fd is
+ * registered with the Lwt engine, so any number of requests may be in
+ * flight without a system thread per request. A promise fails with
+ * [Error rc] when the operation does not complete with ZOK.
+ **)
+
+open Zookeeper
+
+exception Error of error
+
+(** Forces queued delivery and the Lwt engine hook; implied by [init]. *)
+val start : unit -> unit
+
+val init :
+  string -> watcher_callback -> int -> client_id -> string -> int -> zhandle
+
+(** Closes the handle without blocking the Lwt main loop. *)
+val close : zhandle -> unit Lwt.t
+
+val create : zhandle -> string -> string -> acls -> create_flag -> string Lwt.t
+val delete : ?version:int -> zhandle -> string -> unit Lwt.t
+
+(** [None] when the node does not exist. *)
+val exists : ?watch:bool -> zhandle -> string -> stat option Lwt.t
+val wexists : zhandle -> string -> watcher_callback -> stat option Lwt.t
+
+val get : ?watch:bool -> zhandle -> string -> (string * stat) Lwt.t
+val wget : zhandle -> string -> watcher_callback -> (string * stat) Lwt.t
+val set : ?version:int -> zhandle -> string -> string -> stat Lwt.t
+
+val get_children : ?watch:bool -> zhandle -> string -> strings Lwt.t
+val wget_children : zhandle -> string -> watcher_callback -> strings Lwt.t
+val get_children2 : ?watch:bool -> zhandle -> string -> (strings * stat) Lwt.t
+val wget_children2 :
+  zhandle -> string -> watcher_callback -> (strings * stat) Lwt.t
+
+val sync : zhandle -> string -> string Lwt.t
+val get_acl : zhandle -> string -> (acls * stat) Lwt.t
+val set_acl : ?version:int -> zhandle -> string -> acls -> unit Lwt.t
+val add_auth : zhandle -> string -> string -> unit Lwt.t
+
+(**
+ * Resolves with the transaction's own error code and per-op results, so
+ * a failed transaction does not fail the promise.
+ **)
+val multi : zhandle -> op array -> (error * op_result array) Lwt.t
@@ -0,0 +1,235 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+open Zookeeper
+
+let content_type = "text/plain; version=0.0.4; charset=utf-8"
+
+let op_name = function
+  | OP_CREATE -> "create"
+  | OP_DELETE -> "delete"
+  | OP_EXISTS -> "exists"
+  | OP_GET -> "get"
+  | OP_SET -> "set"
+  | OP_GET_CHILDREN -> "get_children"
+  | OP_GET_ACL -> "get_acl"
+  | OP_SET_ACL -> "set_acl"
+  | OP_SYNC -> "sync"
+  | OP_MULTI -> "multi"
+  | OP_AUTH -> "auth"
+
+let error_name = function
+  | ZOK -> "ZOK"
+  | ZSYSTEMERROR -> "ZSYSTEMERROR"
+  | ZRUNTIMEINCONSISTENCY -> "ZRUNTIMEINCONSISTENCY"
+  | ZDATAINCONSISTENCY -> "ZDATAINCONSISTENCY"
+  | ZCONNECTIONLOSS -> "ZCONNECTIONLOSS"
+  | ZMARSHALLINGERROR -> "ZMARSHALLINGERROR"
+  | ZUNIMPLEMENTED -> "ZUNIMPLEMENTED"
+  | ZOPERATIONTIMEOUT -> "ZOPERATIONTIMEOUT"
+  | ZBADARGUMENTS -> "ZBADARGUMENTS"
+  | ZINVALIDSTATE -> "ZINVALIDSTATE"
+  | ZAPIERROR -> "ZAPIERROR"
+  | ZNONODE -> "ZNONODE"
+  | ZNOAUTH -> "ZNOAUTH"
+  | ZBADVERSION -> "ZBADVERSION"
+  | ZNOCHILDRENFOREPHEMERALS -> "ZNOCHILDRENFOREPHEMERALS"
+  | ZNODEEXISTS -> "ZNODEEXISTS"
+  | ZNOTEMPTY -> "ZNOTEMPTY"
+  | ZSESSIONEXPIRED -> "ZSESSIONEXPIRED"
+  | ZINVALIDCALLBACK -> "ZINVALIDCALLBACK"
+  | ZINVALIDACL -> "ZINVALIDACL"
+  | ZAUTHFAILED -> "ZAUTHFAILED"
+  | ZCLOSING -> "ZCLOSING"
+  | ZNOTHING -> "ZNOTHING"
+  | ZSESSIONMOVED -> "ZSESSIONMOVED"
+
+let state_name = function
+  | ZOO_EXPIRED_SESSION_STATE -> "expired_session"
+  | ZOO_AUTH_FAILED_STATE -> "auth_failed"
+  | ZOO_CONNECTING_STATE -> "connecting"
+  | ZOO_ASSOCIATING_STATE -> "associating"
+  | ZOO_CONNECTED_STATE -> "connected"
+
+let header b name kind help =
+  Printf.bprintf b "# HELP %s %s\n# TYPE %s %s\n" name help name kind
+
+let seconds us = Printf.sprintf "%.6f" (float_of_int us /. 1e6)
+
+let summary b name help histogram ops =
+  header b name "summary" help;
+  Array.iter (fun m ->
+    let h = histogram m and op = op_name m.op_type in
+    List.iter (fun (q, v) ->
+      Printf.bprintf b "%s{op=\"%s\",quantile=\"%s\"} %s\n" name op q
+        (seconds v))
+      ["0.5", h.hist_p50_us; "0.9", h.hist_p90_us;
+       "0.99", h.hist_p99_us; "0.999", h.hist_p999_us];
+    Printf.bprintf b "%s_sum{op=\"%s\"} %s\n" name op (seconds h.hist_sum_us);
+    Printf.bprintf b "%s_count{op=\"%s\"} %d\n" name op h.hist_count)
+    ops
+
+let gauge b name help v =
+  header b name "gauge" help;
+  Printf.bprintf b "%s %d\n" name v
+
+let render () =
+  let ops = op_metrics () in
+  let client = client_metrics () in
+  let pool = completion_context_stats () in
+  let b = Buffer.create 8192 in
+
+  header b "zookeeper_client_requests_total" "counter"
+    "Requests submitted, synchronous and asynchronous.";
+  Array.iter (fun m ->
+    Printf.bprintf b "zookeeper_client_requests_total{op=\"%s\"} %d\n"
+      (op_name m.op_type) m.op_submitted)
+    ops;
+
+  header b "zookeeper_client_responses_total" "counter"
+    "Requests completed or refused, by error code.";
+  Array.iter (fun m ->
+    Array.iter (fun (rc, n) ->
+      Printf.bprintf b
+        "zookeeper_client_responses_total{op=\"%s\",code=\"%s\"} %d\n"
+        (op_name m.op_type) (error_name rc) n)
+      m.op_errors)
+    ops;
+
+  summary b "zookeeper_client_request_duration_seconds"
+    "Time from submission until the C client hands over the result."
+    (fun m -> m.op_service) ops;
+  summary b "zookeeper_client_callback_duration_seconds"
+    "Time from the dispatch of an asynchronous completion until its \
+     callback returns."
+    (fun m -> m.op_callback) ops;
+
+  gauge b "zookeeper_client_async_in_flight"
+    "Asynchronous requests waiting for their completion." pool.in_flight;
+  gauge b "zookeeper_client_async_in_flight_peak"
+    "Highest number of asynchronous requests in flight." pool.peak_in_flight;
+  gauge b "zookeeper_client_handles" "Open handles." client.client_handles;
+  gauge b "zookeeper_client_watch_paths"
+    "Paths watched through the open handles."
+    client.client_watches.watch_paths;
+  gauge b "zookeeper_client_watches_armed"
+    "Watches currently set at the server." client.client_watches.watch_armed;
+  gauge b "zookeeper_client_watch_subscribers"
+    "Local watchers waiting for an event."
+    client.client_watches.watch_subscribers;
+
+  header b "zookeeper_client_session_transitions_total" "counter"
+    "Session state transitions, by state reached.";
+  Array.iter (fun (state, n) ->
+    Printf.bprintf b
+      "zookeeper_client_session_transitions_total{state=\"%s\"} %d\n"
+      (state_name state) n)
+    client.client_transitions;
+
+  header b "zookeeper_client_reconnects_total" "counter"
+    "Connections re-established after the first one of a handle.";
+  Printf.bprintf b "zookeeper_client_reconnects_total %d\n"
+    client.client_reconnects;
+
+  Buffer.contents b
+
+(** HTTP listener. *)
+
+type listener = {
+  fd : Unix.file_descr;
+  bound_port : int;
+  mutable running : bool;
+}
+
+let rec has_blank_line s i =
+  match String.index_from_opt s i '\n' with
+  | None -> false
+  | Some j ->
+    (j + 1 < String.length s && s.[j + 1] = '\n')
+    || (j + 2 < String.length s && s.[j + 1] = '\r' && s.[j + 2] = '\n')
+    || has_blank_line s (j + 1)
+
+(** Reads the request head, up to the first empty line or 8 KB. *)
+let read_head fd =
+  let buf = Bytes.create 8192 in
+  let rec loop len =
+    let head = Bytes.sub_string buf 0 len in
+    if has_blank_line head 0 || len = Bytes.length buf then head
+    else match Unix.read fd buf len (Bytes.length buf - len) with
+      | 0 -> head
+      | n -> loop (len + n) in
+  loop 0
+
+let rec write_all fd s off len =
+  if len > 0 then begin
+    let n = Unix.write_substring fd s off len in
+    write_all fd s (off + n) (len - n)
+  end
+
+let respond fd =
+  let head = read_head fd in
+  let (status, ctype, body) =
+    match String.split_on_char ' ' (String.trim head) with
+    | "GET" :: target :: _
+      when target = "/metrics" || target = "/" ->
+      ("200 OK", content_type, render ())
+    | _ :: _ :: _ -> ("404 Not Found", "text/plain", "not found\n")
+    | _ -> ("400 Bad Request", "text/plain", "bad request\n") in
+  let reply = Printf.sprintf
+    "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n\
+     Connection: close\r\n\r\n%s"
+    status ctype (String.length body) body in
+  write_all fd reply 0 (String.length reply)
+
+let rec accept_loop t =
+  match Unix.accept ~cloexec:true t.fd with
+  | (fd, _) ->
+    (try
+       Unix.setsockopt_float fd Unix.SO_RCVTIMEO 5.0;
+       respond fd
+     with Unix.Unix_error _ -> ());
+    (try Unix.close fd with Unix.Unix_error _ -> ());
+    accept_loop t
+  | exception Unix.Unix_error (Unix.EINTR, _, _) -> accept_loop t
+  | exception Unix.Unix_error _ when t.running ->
+    Thread.delay 0.1;
+    accept_loop t
+  | exception Unix.Unix_error _ -> ()
+
+let serve ?(addr = Unix.inet_addr_loopback) port =
+  Sys.set_signal Sys.sigpipe Sys.Signal_ignore;
+  let fd = Unix.socket ~cloexec:true Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt fd Unix.SO_REUSEADDR true;
+  Unix.bind fd (Unix.ADDR_INET (addr, port));
+  Unix.listen fd 16;
+  let bound_port =
+    match Unix.getsockname fd with
+    | Unix.ADDR_INET (_, port) -> port
+    | Unix.ADDR_UNIX _ -> port in
+  let t = { fd; bound_port; running = true } in
+  ignore (Thread.create accept_loop t);
+  t
+
+let port t = t.bound_port
+
+let stop t =
+  t.running <- false;
+  (try Unix.shutdown t.fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ());
+  (try Unix.close t.fd with Unix.Unix_error _ -> ())
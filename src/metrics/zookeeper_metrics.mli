@@ -0,0 +1,63 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * Client-side metrics of the binding in the Prometheus text exposition
+ * format (version 0.0.4), so that every service using it exposes the same
+ * series:
+ *
+ *   zookeeper_client_requests_total{op}            counter
+ *   zookeeper_client_responses_total{op,code}      counter
+ *   zookeeper_client_request_duration_seconds{op}  summary
+ *   zookeeper_client_callback_duration_seconds{op} summary
+ *   zookeeper_client_async_in_flight               gauge
+ *   zookeeper_client_async_in_flight_peak          gauge
+ *   zookeeper_client_handles                       gauge
+ *   zookeeper_client_watch_paths                   gauge
+ *   zookeeper_client_watches_armed                 gauge
+ *   zookeeper_client_watch_subscribers             gauge
+ *   zookeeper_client_session_transitions_total{state} counter
+ *   zookeeper_client_reconnects_total              counter
+ *
+ * Request rates are the rates of the counters. The summaries carry the
+ * 0.5, 0.9, 0.99 and 0.999 quantiles since the process started, see
+ * [Zookeeper.op_metrics].
+ **)
+
+(** Content type of the exposition format. *)
+val content_type : string
+
+(** The current metrics of the process, rendered from one snapshot. *)
+val render : unit -> string
+
+type listener
+
+(**
+ * Serves [render ()] over HTTP on /metrics from a thread of its own,
+ * one scrape at a time. Listens on the loopback interface unless [addr]
+ * is given, and on any free port when the port is 0. Ignores SIGPIPE for
+ * the whole process.
+ **)
+val serve : ?addr:Unix.inet_addr -> int -> listener
+
+val port : listener -> int
+
+(** Closes the listening socket; a scrape in progress is finished. *)
+val stop : listener -> unit
@@ -0,0 +1,932 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * Each connection has a reader thread, which decodes and executes
+ * requests, and a writer thread, which sends the encoded replies once
+ * they are due. The data tree, the sessions and the watch tables are
+ * guarded by a single lock; execution is cheap, so that is no
+ * bottleneck next to the network round trip.
+ **)
+
+type config = {
+  port : int;
+  latency : float;
+  jitter : float;
+  seed : int;
+  min_session_timeout : int;
+  max_session_timeout : int;
+}
+
+let default_config = {
+  port = 0;
+  latency = 0.0;
+  jitter = 0.0;
+  seed = 42;
+  min_session_timeout = 4000;
+  max_session_timeout = 40000;
+}
+
+(** Opcodes, special xids and error codes of the wire protocol. *)
+let op_create = 1
+let op_delete = 2
+let op_exists = 3
+let op_get_data = 4
+let op_set_data = 5
+let op_get_acl = 6
+let op_set_acl = 7
+let op_get_children = 8
+let op_sync = 9
+let op_ping = 11
+let op_get_children2 = 12
+let op_check = 13
+let op_multi = 14
+let op_close_session = -11
+let op_auth = 100
+let op_set_watches = 101
+
+let xid_watcher_event = -1
+let xid_ping = -2
+let xid_auth = -4
+let xid_set_watches = -8
+
+let zok = 0
+let zruntimeinconsistency = -2
+let zunimplemented = -6
+let zbadarguments = -8
+let znonode = -101
+let zbadversion = -103
+let znochildrenforephemerals = -108
+let znodeexists = -110
+let znotempty = -111
+
+let event_created = 1
+let event_deleted = 2
+let event_changed = 3
+let event_child = 4
+
+let state_connected = 3
+
+let flag_ephemeral = 1
+let flag_sequence = 2
+
+(** Largest packet accepted from a client. *)
+let max_packet = 16 * 1024 * 1024
+
+exception Malformed
+
+(** Jute decoding. *)
+type reader = { buf : Bytes.t; mutable pos : int }
+
+let need r n =
+  if n < 0 || r.pos + n > Bytes.length r.buf then raise Malformed
+
+let read_int r =
+  need r 4;
+  let v = Int32.to_int (Bytes.get_int32_be r.buf r.pos) in
+  r.pos <- r.pos + 4;
+  v
+
+let read_long r =
+  need r 8;
+  let v = Bytes.get_int64_be r.buf r.pos in
+  r.pos <- r.pos + 8;
+  v
+
+let read_bool r =
+  need r 1;
+  let v = Bytes.get r.buf r.pos <> '\000' in
+  r.pos <- r.pos + 1;
+  v
+
+let read_buffer r =
+  let n = read_int r in
+  if n < 0 then ""
+  else begin
+    need r n;
+    let s = Bytes.sub_string r.buf r.pos n in
+    r.pos <- r.pos + n;
+    s
+  end
+
+let read_string = read_buffer
+
+let read_vector f r =
+  let n = read_int r in
+  let rec loop i acc =
+    if i >= n then List.rev acc else loop (i + 1) (f r :: acc) in
+  loop 0 []
+
+(** Jute encoding. *)
+let write_int b v = Buffer.add_int32_be b (Int32.of_int v)
+let write_long b v = Buffer.add_int64_be b v
+let write_bool b v = Buffer.add_char b (if v then '\001' else '\000')
+
+let write_buffer b s =
+  write_int b (String.length s);
+  Buffer.add_string b s
+
+let write_string = write_buffer
+
+let write_vector f b l =
+  write_int b (List.length l);
+  List.iter (f b) l
+
+type acl = { perms : int; scheme : string; id : string }
+
+let read_acl r =
+  let perms = read_int r in
+  let scheme = read_string r in
+  let id = read_string r in
+  { perms; scheme; id }
+
+let write_acl b a =
+  write_int b a.perms;
+  write_string b a.scheme;
+  write_string b a.id
+
+type node = {
+  mutable data : string;
+  mutable acl : acl list;
+  czxid : int64;
+  mutable mzxid : int64;
+  ctime : int64;
+  mutable mtime : int64;
+  mutable version : int;
+  mutable cversion : int;
+  mutable aversion : int;
+  ephemeral_owner : int64;
+  mutable pzxid : int64;
+  children : (string, unit) Hashtbl.t;
+}
+
+let write_stat b n =
+  write_long b n.czxid;
+  write_long b n.mzxid;
+  write_long b n.ctime;
+  write_long b n.mtime;
+  write_int b n.version;
+  write_int b n.cversion;
+  write_int b n.aversion;
+  write_long b n.ephemeral_owner;
+  write_int b (String.length n.data);
+  write_int b (Hashtbl.length n.children);
+  write_long b n.pzxid
+
+type conn = {
+  fd : Unix.file_descr;
+  out_lock : Mutex.t;
+  out_ready : Condition.t;
+  out : (float * string) Queue.t;
+  mutable last_due : float;
+  mutable closed : bool;
+  mutable threads : int;
+  mutable session : session option;
+}
+
+and session = {
+  sid : int64;
+  passwd : string;
+  timeout : int;
+  mutable conn : conn option;
+  mutable last_seen : float;
+  ephemerals : (string, unit) Hashtbl.t;
+}
+
+type t = {
+  config : config;
+  lock : Mutex.t;
+  nodes : (string, node) Hashtbl.t;
+  sessions : (int64, session) Hashtbl.t;
+  data_watches : (string, (int64, unit) Hashtbl.t) Hashtbl.t;
+  child_watches : (string, (int64, unit) Hashtbl.t) Hashtbl.t;
+  random : Random.State.t;
+  listen_fd : Unix.file_descr;
+  bound_port : int;
+  mutable latency : float;
+  mutable jitter : float;
+  mutable zxid : int64;
+  mutable next_sid : int64;
+  mutable running : bool;
+  mutable conns : conn list;
+  mutable request_count : int;
+}
+
+let with_lock m f =
+  Mutex.lock m;
+  match f () with
+  | v -> Mutex.unlock m; v
+  | exception e -> Mutex.unlock m; raise e
+
+let now_ms () = Int64.of_float (Unix.gettimeofday () *. 1000.0)
+
+let shutdown fd =
+  try Unix.shutdown fd Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ()
+
+(** Connections and framing. *)
+
+let frame payload =
+  let b = Buffer.create (String.length payload + 4) in
+  write_int b (String.length payload);
+  Buffer.add_string b payload;
+  Buffer.contents b
+
+(**
+ * Queue a packet on a connection, due after the configured latency. The
+ * due times of one connection never decrease, so jitter cannot reorder
+ * replies. Called with the server lock held.
+ **)
+let send t c payload =
+  let delay =
+    t.latency +.
+    (if t.jitter > 0.0 then Random.State.float t.random t.jitter else 0.0) in
+  with_lock c.out_lock (fun () ->
+    if not c.closed then begin
+      let due = Float.max c.last_due (Unix.gettimeofday () +. delay) in
+      c.last_due <- due;
+      Queue.push (due, frame payload) c.out;
+      Condition.signal c.out_ready
+    end)
+
+(** Drop one thread's hold on a connection; the last one closes it. *)
+let release c =
+  let last = with_lock c.out_lock (fun () ->
+    c.threads <- c.threads - 1;
+    c.threads = 0) in
+  if last then try Unix.close c.fd with Unix.Unix_error _ -> ()
+
+(** Stop accepting packets for a connection; queued ones still go out. *)
+let close_conn c =
+  with_lock c.out_lock (fun () ->
+    c.closed <- true;
+    Condition.signal c.out_ready)
+
+let rec write_all fd s off len =
+  if len > 0 then begin
+    let n = Unix.write_substring fd s off len in
+    write_all fd s (off + n) (len - n)
+  end
+
+let rec writer c =
+  Mutex.lock c.out_lock;
+  while Queue.is_empty c.out && not c.closed do
+    Condition.wait c.out_ready c.out_lock
+  done;
+  if Queue.is_empty c.out then begin
+    Mutex.unlock c.out_lock;
+    shutdown c.fd;
+    release c
+  end else begin
+    let (due, packet) = Queue.pop c.out in
+    Mutex.unlock c.out_lock;
+    let wait = due -. Unix.gettimeofday () in
+    if wait > 0.0 then Thread.delay wait;
+    match write_all c.fd packet 0 (String.length packet) with
+    | () -> writer c
+    | exception Unix.Unix_error _ ->
+      with_lock c.out_lock (fun () -> c.closed <- true; Queue.clear c.out);
+      shutdown c.fd;
+      release c
+  end
+
+let really_read fd buf len =
+  let rec loop off =
+    if off < len then begin
+      let n = Unix.read fd buf off (len - off) in
+      if n = 0 then raise End_of_file;
+      loop (off + n)
+    end in
+  loop 0
+
+let read_packet fd =
+  let header = Bytes.create 4 in
+  really_read fd header 4;
+  let len = Int32.to_int (Bytes.get_int32_be header 0) in
+  if len < 0 || len > max_packet then raise Malformed;
+  let buf = Bytes.create len in
+  really_read fd buf len;
+  { buf; pos = 0 }
+
+(** Watches. *)
+
+let add_watch table path sid =
+  let set =
+    match Hashtbl.find_opt table path with
+    | Some set -> set
+    | None ->
+      let set = Hashtbl.create 4 in
+      Hashtbl.replace table path set;
+      set in
+  Hashtbl.replace set sid ()
+
+let take_watches table path =
+  match Hashtbl.find_opt table path with
+  | None -> []
+  | Some set ->
+    Hashtbl.remove table path;
+    Hashtbl.fold (fun sid () acc -> sid :: acc) set []
+
+let send_event t sid etype path =
+  match Hashtbl.find_opt t.sessions sid with
+  | Some { conn = Some c; _ } ->
+    let b = Buffer.create 64 in
+    write_int b xid_watcher_event;
+    write_long b (-1L);
+    write_int b zok;
+    write_int b etype;
+    write_int b state_connected;
+    write_string b path;
+    send t c (Buffer.contents b)
+  | _ -> ()
+
+(**
+ * Fire the watches an event concerns, once per session: data watches
+ * for creation, deletion and data changes, children watches for
+ * deletion and children changes.
+ **)
+let fire t (etype, path) =
+  let sids =
+    if etype = event_child then take_watches t.child_watches path
+    else if etype = event_deleted then
+      take_watches t.data_watches path @ take_watches t.child_watches path
+    else take_watches t.data_watches path in
+  List.iter (fun sid -> send_event t sid etype path)
+    (List.sort_uniq compare sids)
+
+(** The data tree. *)
+
+let valid_path p =
+  let n = String.length p in
+  let rec clean i =
+    i >= n ||
+    (p.[i] <> '\000' && not (p.[i] = '/' && i + 1 < n && p.[i + 1] = '/') &&
+     clean (i + 1)) in
+  n > 0 && p.[0] = '/' && (n = 1 || p.[n - 1] <> '/') && clean 0
+
+let parent_of path =
+  match String.rindex path '/' with
+  | 0 -> "/"
+  | i -> String.sub path 0 i
+
+let basename path =
+  let i = String.rindex path '/' in
+  String.sub path (i + 1) (String.length path - i - 1)
+
+let new_node ~zxid ~owner data acl = {
+  data;
+  acl;
+  czxid = zxid;
+  mzxid = zxid;
+  ctime = now_ms ();
+  mtime = now_ms ();
+  version = 0;
+  cversion = 0;
+  aversion = 0;
+  ephemeral_owner = owner;
+  pzxid = zxid;
+  children = Hashtbl.create 8;
+}
+
+let next_zxid t =
+  t.zxid <- Int64.succ t.zxid;
+  t.zxid
+
+(**
+ * A change applied to the tree: how to take it back should a later op
+ * of the same multi fail, the watch events it fires once committed and
+ * the body of its reply.
+ **)
+type change = {
+  undo : unit -> unit;
+  events : (int * string) list;
+  body : Buffer.t -> unit;
+}
+
+type op =
+  | Create of string * string * acl list * int
+  | Delete of string * int
+  | Set of string * string * int
+  | Check of string * int
+
+let op_type = function
+  | Create _ -> op_create
+  | Delete _ -> op_delete
+  | Set _ -> op_set_data
+  | Check _ -> op_check
+
+let version_ok expected actual = expected = -1 || expected = actual
+
+let apply_create t session ~zxid path data acl flags =
+  let sequential = flags land flag_sequence <> 0 in
+  let ephemeral = flags land flag_ephemeral <> 0 in
+  if not (valid_path (if sequential then path ^ "0" else path)) || path = "/"
+  then Error zbadarguments
+  else
+    let parent_path = parent_of path in
+    match Hashtbl.find_opt t.nodes parent_path with
+    | None -> Error znonode
+    | Some parent when parent.ephemeral_owner <> 0L ->
+      Error znochildrenforephemerals
+    | Some parent ->
+      let path =
+        if sequential then Printf.sprintf "%s%010d" path parent.cversion
+        else path in
+      if Hashtbl.mem t.nodes path then Error znodeexists
+      else begin
+        let owner = if ephemeral then session.sid else 0L in
+        let name = basename path in
+        let cversion = parent.cversion and pzxid = parent.pzxid in
+        Hashtbl.replace t.nodes path (new_node ~zxid ~owner data acl);
+        Hashtbl.replace parent.children name ();
+        parent.cversion <- cversion + 1;
+        parent.pzxid <- zxid;
+        if ephemeral then Hashtbl.replace session.ephemerals path ();
+        Ok {
+          undo = (fun () ->
+            Hashtbl.remove t.nodes path;
+            Hashtbl.remove parent.children name;
+            parent.cversion <- cversion;
+            parent.pzxid <- pzxid;
+            Hashtbl.remove session.ephemerals path);
+          events = [ (event_created, path); (event_child, parent_path) ];
+          body = (fun b -> write_string b path);
+        }
+      end
+
+let remove_ephemeral t owner path =
+  match Hashtbl.find_opt t.sessions owner with
+  | Some s -> Hashtbl.remove s.ephemerals path
+  | None -> ()
+
+let apply_delete t ~zxid path version =
+  if not (valid_path path) || path = "/" then Error zbadarguments
+  else
+    match Hashtbl.find_opt t.nodes path with
+    | None -> Error znonode
+    | Some node when not (version_ok version node.version) -> Error zbadversion
+    | Some node when Hashtbl.length node.children > 0 -> Error znotempty
+    | Some node ->
+      let parent_path = parent_of path in
+      let parent = Hashtbl.find t.nodes parent_path in
+      let name = basename path in
+      let cversion = parent.cversion and pzxid = parent.pzxid in
+      Hashtbl.remove t.nodes path;
+      Hashtbl.remove parent.children name;
+      parent.cversion <- cversion + 1;
+      parent.pzxid <- zxid;
+      remove_ephemeral t node.ephemeral_owner path;
+      Ok {
+        undo = (fun () ->
+          Hashtbl.replace t.nodes path node;
+          Hashtbl.replace parent.children name ();
+          parent.cversion <- cversion;
+          parent.pzxid <- pzxid;
+          match Hashtbl.find_opt t.sessions node.ephemeral_owner with
+          | Some s -> Hashtbl.replace s.ephemerals path ()
+          | None -> ());
+        events = [ (event_deleted, path); (event_child, parent_path) ];
+        body = ignore;
+      }
+
+let apply_set t ~zxid path data version =
+  match Hashtbl.find_opt t.nodes path with
+  | None -> Error (if valid_path path then znonode else zbadarguments)
+  | Some node when not (version_ok version node.version) -> Error zbadversion
+  | Some node ->
+    let old_data = node.data and old_version = node.version in
+    let old_mzxid = node.mzxid and old_mtime = node.mtime in
+    node.data <- data;
+    node.version <- old_version + 1;
+    node.mzxid <- zxid;
+    node.mtime <- now_ms ();
+    Ok {
+      undo = (fun () ->
+        node.data <- old_data;
+        node.version <- old_version;
+        node.mzxid <- old_mzxid;
+        node.mtime <- old_mtime);
+      events = [ (event_changed, path) ];
+      body = (fun b -> write_stat b node);
+    }
+
+let apply_check t path version =
+  match Hashtbl.find_opt t.nodes path with
+  | None -> Error (if valid_path path then znonode else zbadarguments)
+  | Some node when not (version_ok version node.version) -> Error zbadversion
+  | Some _ -> Ok { undo = ignore; events = []; body = ignore }
+
+let apply t session ~zxid = function
+  | Create (path, data, acl, flags) ->
+    apply_create t session ~zxid path data acl flags
+  | Delete (path, version) -> apply_delete t ~zxid path version
+  | Set (path, data, version) -> apply_set t ~zxid path data version
+  | Check (path, version) -> apply_check t path version
+
+(** Run a single write op; returns the error code and reply body. *)
+let write_op t session op =
+  match apply t session ~zxid:(next_zxid t) op with
+  | Error err -> (err, "")
+  | Ok change ->
+    List.iter (fire t) change.events;
+    let b = Buffer.create 64 in
+    change.body b;
+    (zok, Buffer.contents b)
+
+let read_op r = function
+  | 1 ->
+    let path = read_string r in
+    let data = read_buffer r in
+    let acl = read_vector read_acl r in
+    Create (path, data, acl, read_int r)
+  | 2 ->
+    let path = read_string r in
+    Delete (path, read_int r)
+  | 5 ->
+    let path = read_string r in
+    let data = read_buffer r in
+    Set (path, data, read_int r)
+  | 13 ->
+    let path = read_string r in
+    Check (path, read_int r)
+  | _ -> raise Malformed
+
+let write_multi_header b typ is_done err =
+  write_int b typ;
+  write_bool b is_done;
+  write_int b err
+
+(**
+ * Run a multi atomically under one zxid. On the first failing op every
+ * earlier op is undone; the reply then reports ZOK for the ops before
+ * it and ZRUNTIMEINCONSISTENCY for the ops after it, as the Java server
+ * does.
+ **)
+let multi t session r =
+  let rec read_ops acc =
+    let typ = read_int r in
+    let is_done = read_bool r in
+    let _ = read_int r in
+    if is_done then List.rev acc else read_ops (read_op r typ :: acc) in
+  let ops = read_ops [] in
+  let zxid = next_zxid t in
+  let rec run applied = function
+    | [] -> Ok (List.rev applied)
+    | op :: rest ->
+      match apply t session ~zxid op with
+      | Ok change -> run ((op, change) :: applied) rest
+      | Error err ->
+        List.iter (fun (_, change) -> change.undo ()) applied;
+        Error (List.length applied, err) in
+  let b = Buffer.create 256 in
+  let err =
+    match run [] ops with
+    | Ok applied ->
+      List.iter (fun (_, change) -> List.iter (fire t) change.events) applied;
+      List.iter (fun (op, change) ->
+        write_multi_header b (op_type op) false zok;
+        change.body b) applied;
+      zok
+    | Error (failed, err) ->
+      List.iteri (fun i _ ->
+        let e =
+          if i < failed then zok
+          else if i = failed then err
+          else zruntimeinconsistency in
+        write_multi_header b (-1) false e;
+        write_int b e) ops;
+      err in
+  write_multi_header b (-1) true (-1);
+  (err, Buffer.contents b)
+
+let read_only_op t session op r =
+  let path = read_string r in
+  let watch = op <> op_get_acl && read_bool r in
+  let sid = session.sid in
+  let b = Buffer.create 64 in
+  match Hashtbl.find_opt t.nodes path with
+  | None ->
+    if watch && op = op_exists then add_watch t.data_watches path sid;
+    ((if valid_path path then znonode else zbadarguments), "")
+  | Some node ->
+    if op = op_exists then begin
+      if watch then add_watch t.data_watches path sid;
+      write_stat b node
+    end else if op = op_get_data then begin
+      if watch then add_watch t.data_watches path sid;
+      write_buffer b node.data;
+      write_stat b node
+    end else if op = op_get_acl then begin
+      write_vector write_acl b node.acl;
+      write_stat b node
+    end else begin
+      if watch then add_watch t.child_watches path sid;
+      let names =
+        Hashtbl.fold (fun name () acc -> name :: acc) node.children [] in
+      write_vector write_string b (List.sort compare names);
+      if op = op_get_children2 then write_stat b node
+    end;
+    (zok, Buffer.contents b)
+
+let set_acl t r =
+  let path = read_string r in
+  let acl = read_vector read_acl r in
+  let version = read_int r in
+  match Hashtbl.find_opt t.nodes path with
+  | None -> (znonode, "")
+  | Some node when not (version_ok version node.aversion) -> (zbadversion, "")
+  | Some node ->
+    ignore (next_zxid t);
+    node.acl <- acl;
+    node.aversion <- node.aversion + 1;
+    let b = Buffer.create 80 in
+    write_stat b node;
+    (zok, Buffer.contents b)
+
+(**
+ * Re-register the watches of a reconnected client, firing right away
+ * those whose node changed after relative_zxid.
+ **)
+let set_watches t session r =
+  let relative_zxid = read_long r in
+  let data = read_vector read_string r in
+  let exist = read_vector read_string r in
+  let child = read_vector read_string r in
+  let sid = session.sid in
+  List.iter (fun path ->
+    match Hashtbl.find_opt t.nodes path with
+    | None -> send_event t sid event_deleted path
+    | Some node when node.mzxid > relative_zxid ->
+      send_event t sid event_changed path
+    | Some _ -> add_watch t.data_watches path sid) data;
+  List.iter (fun path ->
+    if Hashtbl.mem t.nodes path then send_event t sid event_created path
+    else add_watch t.data_watches path sid) exist;
+  List.iter (fun path ->
+    match Hashtbl.find_opt t.nodes path with
+    | None -> send_event t sid event_deleted path
+    | Some node when node.pzxid > relative_zxid ->
+      send_event t sid event_child path
+    | Some _ -> add_watch t.child_watches path sid) child
+
+(** Sessions. *)
+
+(**
+ * Expire a session: delete its ephemeral nodes, firing their watches,
+ * and drop its connection. Called with the server lock held.
+ **)
+let expire t sid =
+  match Hashtbl.find_opt t.sessions sid with
+  | None -> ()
+  | Some session ->
+    Hashtbl.remove t.sessions sid;
+    let paths = Hashtbl.fold (fun p () acc -> p :: acc) session.ephemerals [] in
+    List.iter (fun path ->
+      ignore (write_op t session (Delete (path, -1)))) paths;
+    match session.conn with
+    | Some c -> session.conn <- None; shutdown c.fd
+    | None -> ()
+
+let expire_session t sid = with_lock t.lock (fun () -> expire t sid)
+
+let reply t c xid err body =
+  let b = Buffer.create (String.length body + 16) in
+  write_int b xid;
+  write_long b t.zxid;
+  write_int b err;
+  Buffer.add_string b body;
+  send t c (Buffer.contents b)
+
+let connect_response t c ~timeout ~sid ~passwd ~read_only =
+  let b = Buffer.create 40 in
+  write_int b 0;
+  write_int b timeout;
+  write_long b sid;
+  write_buffer b passwd;
+  if read_only then write_bool b false;
+  send t c (Buffer.contents b)
+
+(**
+ * Read the ConnectRequest of a new connection and bind it to a new or
+ * resumed session. An unknown session or a wrong password gets a zero
+ * timeout, which the client reports as an expired session.
+ **)
+let handshake t c =
+  let r = read_packet c.fd in
+  let _protocol_version = read_int r in
+  let _last_zxid_seen = read_long r in
+  let requested_timeout = read_int r in
+  let sid = read_long r in
+  let passwd = read_buffer r in
+  let read_only = r.pos < Bytes.length r.buf in
+  with_lock t.lock (fun () ->
+    let session =
+      if sid = 0L then begin
+        let passwd = String.init 16 (fun _ ->
+          Char.chr (Random.State.int t.random 256)) in
+        let timeout =
+          max t.config.min_session_timeout
+            (min t.config.max_session_timeout requested_timeout) in
+        let session = {
+          sid = t.next_sid;
+          passwd;
+          timeout;
+          conn = None;
+          last_seen = Unix.gettimeofday ();
+          ephemerals = Hashtbl.create 4;
+        } in
+        t.next_sid <- Int64.succ t.next_sid;
+        Hashtbl.replace t.sessions session.sid session;
+        Some session
+      end else
+        match Hashtbl.find_opt t.sessions sid with
+        | Some session when session.passwd = passwd -> Some session
+        | _ -> None in
+    match session with
+    | None ->
+      connect_response t c ~timeout:0 ~sid:0L ~passwd:(String.make 16 '\000')
+        ~read_only;
+      raise Exit
+    | Some session ->
+      (match session.conn with
+       | Some old when old != c -> shutdown old.fd
+       | _ -> ());
+      session.conn <- Some c;
+      session.last_seen <- Unix.gettimeofday ();
+      c.session <- Some session;
+      connect_response t c ~timeout:session.timeout ~sid:session.sid
+        ~passwd:session.passwd ~read_only)
+
+let handle t c session r =
+  let xid = read_int r in
+  let op = read_int r in
+  with_lock t.lock (fun () ->
+    t.request_count <- t.request_count + 1;
+    session.last_seen <- Unix.gettimeofday ();
+    if op = op_ping then reply t c xid_ping zok ""
+    else if op = op_auth then reply t c xid_auth zok ""
+    else if op = op_set_watches then begin
+      set_watches t session r;
+      reply t c xid_set_watches zok ""
+    end else if op = op_close_session then begin
+      session.conn <- None;
+      expire t session.sid;
+      reply t c xid zok "";
+      raise Exit
+    end else begin
+      let (err, body) =
+        if op = op_create || op = op_delete || op = op_set_data ||
+           op = op_check then write_op t session (read_op r op)
+        else if op = op_multi then multi t session r
+        else if op = op_exists || op = op_get_data || op = op_get_acl ||
+                op = op_get_children || op = op_get_children2 then
+          read_only_op t session op r
+        else if op = op_set_acl then set_acl t r
+        else if op = op_sync then begin
+          let path = read_string r in
+          let b = Buffer.create 32 in
+          write_string b path;
+          (zok, Buffer.contents b)
+        end
+        else (zunimplemented, "") in
+      reply t c xid err body
+    end)
+
+let disconnect t c =
+  with_lock t.lock (fun () ->
+    (match c.session with
+     | Some session ->
+       (match session.conn with
+        | Some current when current == c ->
+          session.conn <- None;
+          session.last_seen <- Unix.gettimeofday ()
+        | _ -> ())
+     | None -> ());
+    t.conns <- List.filter (fun other -> other != c) t.conns);
+  close_conn c;
+  release c
+
+let serve t c =
+  (try
+     handshake t c;
+     begin match c.session with
+       | None -> ()
+       | Some session ->
+         while true do handle t c session (read_packet c.fd) done
+     end
+   with
+   | Exit | End_of_file | Malformed | Unix.Unix_error _ -> ());
+  disconnect t c
+
+(**
+ * Expire sessions whose client has been silent for longer than their
+ * timeout, connected or not.
+ **)
+let rec reaper t =
+  Thread.delay 0.1;
+  let running = with_lock t.lock (fun () ->
+    let now = Unix.gettimeofday () in
+    let stale = Hashtbl.fold (fun sid session acc ->
+      if now -. session.last_seen > float_of_int session.timeout /. 1000.0
+      then sid :: acc else acc) t.sessions [] in
+    List.iter (expire t) stale;
+    t.running) in
+  if running then reaper t
+
+let rec accept_loop t =
+  match Unix.accept ~cloexec:true t.listen_fd with
+  | (fd, _) ->
+    let c = {
+      fd;
+      out_lock = Mutex.create ();
+      out_ready = Condition.create ();
+      out = Queue.create ();
+      last_due = 0.0;
+      closed = false;
+      threads = 2;
+      session = None;
+    } in
+    let accepted = with_lock t.lock (fun () ->
+      if t.running then t.conns <- c :: t.conns;
+      t.running) in
+    if accepted then begin
+      (try Unix.setsockopt fd Unix.TCP_NODELAY true
+       with Unix.Unix_error _ -> ());
+      ignore (Thread.create writer c);
+      ignore (Thread.create (serve t) c);
+      accept_loop t
+    end else Unix.close fd
+  | exception Unix.Unix_error (Unix.EINTR, _, _) -> accept_loop t
+  | exception Unix.Unix_error _ -> ()
+
+let start ?(config = default_config) () =
+  Sys.set_signal Sys.sigpipe Sys.Signal_ignore;
+  let fd = Unix.socket ~cloexec:true Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt fd Unix.SO_REUSEADDR true;
+  Unix.bind fd (Unix.ADDR_INET (Unix.inet_addr_loopback, config.port));
+  Unix.listen fd 128;
+  let bound_port =
+    match Unix.getsockname fd with
+    | Unix.ADDR_INET (_, port) -> port
+    | Unix.ADDR_UNIX _ -> config.port in
+  let t = {
+    config;
+    lock = Mutex.create ();
+    nodes = Hashtbl.create 1024;
+    sessions = Hashtbl.create 16;
+    data_watches = Hashtbl.create 64;
+    child_watches = Hashtbl.create 64;
+    random = Random.State.make [| config.seed |];
+    listen_fd = fd;
+    bound_port;
+    latency = config.latency;
+    jitter = config.jitter;
+    zxid = 0L;
+    next_sid = 0x100000000L;
+    running = true;
+    conns = [];
+    request_count = 0;
+  } in
+  Hashtbl.replace t.nodes "/" (new_node ~zxid:0L ~owner:0L "" []);
+  ignore (apply_create t
+            { sid = 0L; passwd = ""; timeout = 0; conn = None;
+              last_seen = 0.0; ephemerals = Hashtbl.create 1 }
+            ~zxid:0L "/zookeeper" "" [] 0);
+  ignore (Thread.create accept_loop t);
+  ignore (Thread.create reaper t);
+  t
+
+let stop t =
+  let conns = with_lock t.lock (fun () ->
+    t.running <- false;
+    t.conns) in
+  shutdown t.listen_fd;
+  (try Unix.close t.listen_fd with Unix.Unix_error _ -> ());
+  List.iter (fun c -> shutdown c.fd) conns
+
+let port t = t.bound_port
+
+let host t = Printf.sprintf "127.0.0.1:%d" t.bound_port
+
+let set_latency t ?(jitter = 0.0) latency =
+  with_lock t.lock (fun () ->
+    t.latency <- latency;
+    t.jitter <- jitter)
+
+let requests t = with_lock t.lock (fun () -> t.request_count)
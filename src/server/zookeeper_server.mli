@@ -0,0 +1,71 @@
+(* ZkOCaml: OCaml Binding For Apache ZooKeeper
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *)
+
+
+(**
+ * An in-process stand-in for a single ZooKeeper server, for tests and
+ * benchmarks that should not depend on a live ensemble.
+ *
+ * It listens on the loopback interface and speaks enough of the 3.4
+ * client wire protocol for the binding: sessions (with expiry and
+ * reconnection), create, delete, exists, get, set, get/set acl,
+ * children, sync, multi, auth and one-shot watches, including watch
+ * re-registration after a reconnect. ACLs are stored but not enforced,
+ * every auth is accepted and nothing is persisted.
+ *
+ * Every reply and watch event can be held back by an artificial latency
+ * plus a seeded random jitter, so that throughput and latency can be
+ * measured reproducibly. Replies to one connection always leave in
+ * order.
+ *
+ * Starting a server ignores SIGPIPE for the whole process.
+ **)
+
+type t
+
+type config = {
+  port : int;                 (** TCP port, 0 for any free port. *)
+  latency : float;            (** Seconds added to every reply. *)
+  jitter : float;             (** Up to this many more seconds, at random. *)
+  seed : int;                 (** Seed of the jitter. *)
+  min_session_timeout : int;  (** Milliseconds. *)
+  max_session_timeout : int;  (** Milliseconds. *)
+}
+
+(** Any free port, no latency, session timeouts from 4 to 40 seconds. *)
+val default_config : config
+
+val start : ?config:config -> unit -> t
+
+(** Closes the listening socket and every connection. *)
+val stop : t -> unit
+
+val port : t -> int
+
+(** The host string to hand to [Zookeeper.init]. *)
+val host : t -> string
+
+(** Changes the latency and jitter of replies sent from now on. *)
+val set_latency : t -> ?jitter:float -> float -> unit
+
+(** Number of requests handled so far, pings included. *)
+val requests : t -> int
+
+(** Expires a session as if its timeout had elapsed. *)
+val expire_session : t -> int64 -> unit
@@ -17,10 +17,20 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <caml/alloc.h>
+#include <caml/bigarray.h>
 #include <caml/callback.h>
 #include <caml/custom.h>
 #include <caml/fail.h>
@@ -33,7 +43,15 @@
 
 #include "zkocaml_stubs.h"
 
-#if 1
+/**
+ * In the single-threaded build (ZKOCAML_SINGLE_THREADED, linked against
+ * zookeeper_st) callbacks run inside zookeeper_process on the OCaml thread
+ * that drives the event loop, which already holds the runtime lock.
+ */
+#if defined(ZKOCAML_SINGLE_THREADED)
+ #define zkocaml_enter_callback() do {} while(0)
+ #define zkocaml_leave_callback() do {} while(0)
+#elif 1
  #define zkocaml_enter_callback() \
    do {\
      caml_acquire_runtime_system();\
@@ -62,9 +80,24 @@
   sizeof(v) / sizeof(v[0])
 
 #define ZKOCAML_MAX_PATH_BUFFER_SIZE 4096
+#define ZKOCAML_GET_SCRATCH_SIZE 4096
+#define ZKOCAML_COMPLETION_SLAB_SIZE 256
+#define ZKOCAML_RING_SIZE 65536
+#define ZKOCAML_TREE_DEFAULT_IN_FLIGHT 256
+#define ZKOCAML_RMR_BATCH_SIZE 64
+#define ZKOCAML_SLOW_LOG_SIZE 256
+#define ZKOCAML_HOT_DEPTH 4
+#define ZKOCAML_HOT_WIDTH 2048
+#define ZKOCAML_HOT_TOP 16
 
 static FILE *zkocaml_log_stream = NULL;
 
+/**
+ * Per-thread scratch buffer used by zoo_get/zoo_wget so that small reads
+ * need neither a malloc nor a memset.
+ */
+static __thread char zkocaml_get_scratch[ZKOCAML_GET_SCRATCH_SIZE];
+
 static const enum ZOO_ERRORS ZOO_ERRORS_TABLE[] = {
   ZOK,
   ZSYSTEMERROR,
@@ -130,16 +163,26 @@ static const ZOO_CREATE_FLAG_AUX ZOO_CREATE_FLAG_TABLE[] = {
     ZOO_SEQUENCE_AUX
 };
 
+/**
+ * The wrapper of an open handle is only released once the handle has
+ * been closed (dropping its root) and its OCaml value is unreachable.
+ */
 static void
 zkocaml_handle_struct_finalize(value ve)
 {
+  free(zkocaml_handle_struct_val(ve));
 }
 
+/**
+ * Handles compare and hash by id, which unlike handle survives the close
+ * and is never given to another handle, so that a closed handle keeps its
+ * place in a Hashtbl.
+ */
 static int
 zkocaml_handle_struct_compare(value v1, value v2)
 {
-  zkocaml_handle_t *h1 = zkocaml_handle_struct_val(v1);
-  zkocaml_handle_t *h2 = zkocaml_handle_struct_val(v2);
+  unsigned long h1 = zkocaml_handle_struct_val(v1)->id;
+  unsigned long h2 = zkocaml_handle_struct_val(v2)->id;
   if (h1 == h2) return 0;
   else if (h1 < h2) return -1;
   return 1;
@@ -148,28 +191,33 @@ zkocaml_handle_struct_compare(value v1, value v2)
 static long
 zkocaml_handle_struct_hash(value v)
 {
-  return (long) zkocaml_handle_struct_val(v);
+  return (long) zkocaml_handle_struct_val(v)->id;
 }
 
 static struct custom_operations zhandle_struct_ops = {
   "org.apache.zookeeper",
-  custom_finalize_default,
-  custom_compare_default,
-  custom_hash_default,
+  zkocaml_handle_struct_finalize,
+  zkocaml_handle_struct_compare,
+  zkocaml_handle_struct_hash,
   custom_serialize_default,
   custom_deserialize_default
 };
 
+/**
+ * Open handles, so that an event of the C client maps to the OCaml value
+ * init returned for its handle. There are only ever a few. Handle ids are
+ * handed out from zkocaml_handles_last_id, 0 being no handle.
+ */
+static pthread_mutex_t zkocaml_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static zkocaml_handle_t *zkocaml_handles = NULL;
+static unsigned long zkocaml_handles_last_id = 0;
+
 static value
-zkocaml_copy_zhandle(zhandle_t *zh)
+zkocaml_alloc_zhandle(zkocaml_handle_t *zhandle)
 {
   CAMLparam0();
   CAMLlocal1(handle);
 
-  zkocaml_handle_t *zhandle = (zkocaml_handle_t *)
-      malloc(sizeof(zkocaml_handle_t));
-  zhandle->handle = zh;
-
   handle = caml_alloc_custom(&zhandle_struct_ops,
           sizeof(zkocaml_handle_t *), 0, 1);
   zkocaml_handle_struct_val(handle) = zhandle;
@@ -177,17 +225,123 @@ zkocaml_copy_zhandle(zhandle_t *zh)
   CAMLreturn(handle);
 }
 
+/**
+ * Create the canonical OCaml value of a freshly opened handle. It stays a
+ * generational global root until zkocaml_release_zhandle.
+ */
+static value
+zkocaml_intern_zhandle(zhandle_t *zh, zkocaml_watcher_context_t *watcher)
+{
+  CAMLparam0();
+  CAMLlocal1(handle);
+
+  zkocaml_handle_t *zhandle = (zkocaml_handle_t *)
+      calloc(1, sizeof(zkocaml_handle_t));
+  zhandle->handle = zh;
+  zhandle->id = watcher->id;
+  zhandle->watcher = watcher;
+  handle = zkocaml_alloc_zhandle(zhandle);
+  zhandle->self = handle;
+  caml_register_generational_global_root(&zhandle->self);
+
+  pthread_mutex_lock(&zkocaml_handles_lock);
+  zhandle->next = zkocaml_handles;
+  zkocaml_handles = zhandle;
+  pthread_mutex_unlock(&zkocaml_handles_lock);
+
+  CAMLreturn(handle);
+}
+
+/**
+ * Return the OCaml value of the handle with the given id. For an open
+ * handle this is the value init returned, and nothing is allocated; a
+ * handle that has been closed meanwhile (an event still queued for it)
+ * gets a fresh wrapper, closed as well since zookeeper_close has freed
+ * the zhandle_t.
+ */
+static value
+zkocaml_copy_zhandle(unsigned long id)
+{
+  CAMLparam0();
+  CAMLlocal1(handle);
+
+  zkocaml_handle_t *zhandle = NULL;
+
+  pthread_mutex_lock(&zkocaml_handles_lock);
+  for (zhandle = zkocaml_handles; zhandle != NULL; zhandle = zhandle->next) {
+    if (zhandle->id == id) break;
+  }
+  pthread_mutex_unlock(&zkocaml_handles_lock);
+
+  if (zhandle != NULL) {
+    handle = zhandle->self;
+  } else {
+    zhandle = (zkocaml_handle_t *)calloc(1, sizeof(zkocaml_handle_t));
+    zhandle->id = id;
+    handle = zkocaml_alloc_zhandle(zhandle);
+  }
+
+  CAMLreturn(handle);
+}
+
+static void
+zkocaml_watcher_context_free(zkocaml_watcher_context_t *ctx)
+{
+  if (ctx == NULL) return;
+  caml_remove_generational_global_root(&ctx->watcher_callback);
+  free(ctx->watcher_ctx);
+  free(ctx);
+}
+
+/**
+ * Guards the watch tries of all handles and their subscriber lists; see
+ * the path watches below.
+ */
+static pthread_mutex_t zkocaml_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void zkocaml_watch_tree_free(struct zkocaml_watch_node_s_ *node);
+
+/**
+ * Forget a closed handle: drop the root on its value, its global
+ * watcher context and its watch trie. The wrapper itself goes with the
+ * OCaml value.
+ */
+static void
+zkocaml_release_zhandle(zkocaml_handle_t *zhandle)
+{
+  zkocaml_handle_t **link = NULL;
+
+  pthread_mutex_lock(&zkocaml_handles_lock);
+  for (link = &zkocaml_handles; *link != NULL; link = &(*link)->next) {
+    if (*link == zhandle) {
+      *link = zhandle->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&zkocaml_handles_lock);
+
+  if (zhandle->self != 0) {
+    caml_remove_generational_global_root(&zhandle->self);
+    zhandle->self = 0;
+  }
+  zkocaml_watcher_context_free(zhandle->watcher);
+  zhandle->watcher = NULL;
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  zkocaml_watch_tree_free(zhandle->watches);
+  zhandle->watches = NULL;
+  zhandle->handle = NULL;
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+}
+
 static enum ZOO_ERRORS
 zkocaml_enum_error_ml2c(value v)
 {
-  CAMLparam1(v);
   return ZOO_ERRORS_TABLE[Long_val(v)];
 }
 
 static value
 zkocaml_enum_error_c2ml(enum ZOO_ERRORS error)
 {
-  CAMLlocal1(v);
   int i = 0, index = 0;
   for (; i < zkocaml_table_len(ZOO_ERRORS_TABLE); i++) {
     if (error == ZOO_ERRORS_TABLE[i]) {
@@ -201,14 +355,12 @@ zkocaml_enum_error_c2ml(enum ZOO_ERRORS error)
 static ZooLogLevel
 zkocaml_enum_loglevel_ml2c(value v)
 {
-  CAMLparam1(v);
   return ZOO_LOG_LEVEL_TABLE[Long_val(v)];
 }
 
 static value
 zkocaml_enum_loglevel_c2ml(ZooLogLevel log_level)
 {
-  CAMLlocal1(v);
   int i = 0, index = 0;
   for (; i < zkocaml_table_len(ZOO_LOG_LEVEL_TABLE); i++) {
     if (log_level == ZOO_LOG_LEVEL_TABLE[i]) {
@@ -222,8 +374,6 @@ zkocaml_enum_loglevel_c2ml(ZooLogLevel log_level)
 static int
 zkocaml_enum_event_ml2c(value v)
 {
-  CAMLparam1(v);
-
   int event = -1;
   ZOO_EVENT_AUX event_aux = Int_val(v);
 
@@ -283,7 +433,6 @@ zkocaml_enum_event_c2ml(int event)
 static int
 zkocaml_enum_state_ml2c(value v)
 {
-  CAMLparam1(v);
   int state = -1;
   ZOO_STATE_AUX state_aux = Int_val(v);
 
@@ -311,8 +460,6 @@ zkocaml_enum_state_ml2c(value v)
 static value
 zkocaml_enum_state_c2ml(int state)
 {
-  CAMLlocal1(v);
-
   int i = 0, index = 0;
   ZOO_STATE_AUX state_aux = ZOO_EXPIRED_SESSION_STATE_AUX;
 
@@ -340,7 +487,6 @@ zkocaml_enum_state_c2ml(int state)
 static int
 zkocaml_enum_perm_ml2c(value v)
 {
-  CAMLparam1(v);
   int perm = -1;
   ZOO_PERM_AUX perm_aux = Int_val(v);
 
@@ -371,8 +517,6 @@ zkocaml_enum_perm_ml2c(value v)
 static value
 zkocaml_enum_perm_c2ml(int perm)
 {
-  CAMLlocal1(v);
-
   int i = 0, index = 0;
   ZOO_PERM_AUX perm_aux;
 
@@ -402,7 +546,6 @@ zkocaml_enum_perm_c2ml(int perm)
 static int
 zkocaml_enum_create_flag_ml2c(value v)
 {
-  CAMLparam1(v);
   int create_flag = -1;
   ZOO_CREATE_FLAG_AUX create_flag_aux = Int_val(v);
 
@@ -421,8 +564,6 @@ zkocaml_enum_create_flag_ml2c(value v)
 static value
 zkocaml_enum_create_flag_c2ml(int create_flag)
 {
-  CAMLlocal1(v);
-
   int i = 0, index = 0;
   ZOO_CREATE_FLAG_AUX create_flag_aux;
 
@@ -441,10 +582,28 @@ zkocaml_enum_create_flag_c2ml(int create_flag)
   return Val_int(index);
 }
 
+/**
+ * Copy an OCaml string out of the OCaml heap.
+ *
+ * The synchronous stubs release the runtime lock while they wait for the
+ * server, during which the GC is free to move or reclaim the original
+ * string, so every argument handed to the C client is copied first.
+ * The copy is always NUL terminated and must be released with free().
+ */
+static char *
+zkocaml_copy_string_val(value v)
+{
+  size_t len = caml_string_length(v);
+  char *s = (char *)malloc(len + 1);
+  memcpy(s, String_val(v), len);
+  s[len] = '\0';
+
+  return s;
+}
+
 static clientid_t *
 zkocaml_parse_clientid(value v)
 {
-  CAMLparam1(v);
   /**
    * client id structure.
    *
@@ -470,6 +629,7 @@ zkocaml_parse_clientid(value v)
   const char *passwd = String_val(Field(v, 1));
   size_t passwd_len = strlen(passwd);
   if (cid->client_id == 0 && passwd_len == 0) {
+      free(cid);
       return NULL;
   } else {
       memcpy(cid->passwd, passwd, (passwd_len < 15) ? passwd_len : 15);
@@ -478,11 +638,16 @@ zkocaml_parse_clientid(value v)
   return cid;
 }
 
+/**
+ * Copy an OCaml acl array into acls and return 1, or return 0 for an
+ * empty array. Nothing here allocates on the OCaml heap, so no local roots
+ * are registered: the synchronous stubs release the runtime lock right
+ * after, and a frame left linked would then point into a dead stack.
+ */
 static int
 zkocaml_parse_acls(value v, struct ACL_vector *acls)
 {
-  CAMLparam1(v);
-  CAMLlocal1(acl);
+  value acl;
 
   int i = 0, vlen = Wosize_val(v);
   if (vlen == 0) return 0;
@@ -491,7 +656,7 @@ zkocaml_parse_acls(value v, struct ACL_vector *acls)
   acls->data = (struct ACL *)calloc(acls->count, sizeof(struct ACL));
   for (; i < vlen; i++) {
       acl = Field(v, i);
-      acls->data[i].perms = Field(acl, 0);
+      acls->data[i].perms = Int_val(Field(acl, 0));
       acls->data[i].id.scheme = strdup(String_val(Field(acl, 1)));
       acls->data[i].id.id = strdup(String_val(Field(acl, 2)));
   }
@@ -502,21 +667,26 @@ zkocaml_parse_acls(value v, struct ACL_vector *acls)
 static value
 zkocaml_build_client_id_struct(const clientid_t *cid)
 {
+  CAMLparam0();
   CAMLlocal1(v);
 
   v = caml_alloc(2, 0);
   Store_field(v, 0, caml_copy_int64(cid->client_id));
   Store_field(v, 1, caml_copy_string(cid->passwd));
 
-  return v;
+  CAMLreturn(v);
 }
 
 
 static value
 zkocaml_build_stat_struct(const struct Stat *stat)
 {
+  CAMLparam0();
   CAMLlocal1(v);
 
+  static const struct Stat empty_stat;
+  if (stat == NULL) stat = &empty_stat;
+
   v = caml_alloc(11, 0);
   Store_field(v,  0, caml_copy_int64(stat->czxid));
   Store_field(v,  1, caml_copy_int64(stat->mzxid));
@@ -528,598 +698,5453 @@ zkocaml_build_stat_struct(const struct Stat *stat)
   Store_field(v,  7, caml_copy_int64(stat->ephemeralOwner));
   Store_field(v,  8, Val_int(stat->dataLength));
   Store_field(v,  9, Val_int(stat->numChildren));
-  Store_field(v, 10, Val_int(stat->pzxid));
+  Store_field(v, 10, caml_copy_int64(stat->pzxid));
+
+  CAMLreturn(v);
+}
+
+/**
+ * Build an OCaml string holding exactly len bytes of buf, NUL bytes
+ * included. A NULL buffer or a negative length (a node without data)
+ * yields the empty string.
+ */
+static value
+zkocaml_copy_buffer(const char *buf, int len)
+{
+  CAMLparam0();
+  CAMLlocal1(v);
+
+  if (buf == NULL || len < 0) len = 0;
+  v = caml_alloc_string(len);
+  if (len > 0) memcpy(Bytes_val(v), buf, len);
 
-  return v;
+  CAMLreturn(v);
 }
 
 static value
 zkocaml_build_strings_struct(const struct String_vector *strings)
 {
+  CAMLparam0();
   CAMLlocal1(v);
 
+  static const struct String_vector empty_strings;
+  if (strings == NULL) strings = &empty_strings;
+
   int i = 0;
   v = caml_alloc(strings->count, 0);
   for (; i < strings->count; i++) {
     Store_field(v, i, caml_copy_string(strings->data[i]));
   }
 
-  return v;
+  CAMLreturn(v);
 }
 
 static value
 zkocaml_build_acls_struct(const struct ACL_vector *acls)
 {
+  CAMLparam0();
   CAMLlocal2(v, acl);
 
+  static const struct ACL_vector empty_acls;
+  if (acls == NULL) acls = &empty_acls;
+
   int i = 0;
   v = caml_alloc(acls->count, 0);
   for (; i < acls->count; i++) {
     acl = caml_alloc(3, 0);
-    Store_field(acl, 0, acls->data[i].perms);
+    Store_field(acl, 0, Val_int(acls->data[i].perms));
     Store_field(acl, 1, caml_copy_string(acls->data[i].id.scheme));
     Store_field(acl, 2, caml_copy_string(acls->data[i].id.id));
 
     Store_field(v, i, acl);
   }
 
-  return v;
+  CAMLreturn(v);
 }
 
-static void
-watcher_dispatch(zhandle_t *zh,
-                 int type,
-                 int state,
-                 const char *path,
-                 void *watcher_ctx)
+/**
+ * Read the data of a node into a buffer sized from the node itself.
+ *
+ * The first attempt reads into the calling thread's scratch buffer. If
+ * the returned stat reports a value larger than that, the read is retried
+ * with a heap buffer of exactly stat.dataLength bytes (again, should the
+ * node have grown in between). Only the first attempt sets the watch.
+ * Failing to allocate that buffer returns ZSYSTEMERROR.
+ *
+ * Must be called with the runtime lock released. On return *buffer is
+ * either the scratch buffer or heap memory, so release it with
+ * zkocaml_release_get_buffer().
+ */
+static int
+zkocaml_get_sized(zhandle_t *zh,
+                  const char *path,
+                  int watch,
+                  watcher_fn watcher,
+                  void *watcher_ctx,
+                  char **buffer,
+                  int *buffer_len,
+                  struct Stat *stat)
 {
-  zkocaml_enter_callback();
-
-  CAMLlocal1(watcher_callback);
-  CAMLlocal5(local_zh, local_type, local_state,
-             local_path, local_watcher_ctx);
-  CAMLlocalN(args, 5);
+  int rc;
+  int capacity = ZKOCAML_GET_SCRATCH_SIZE;
+  char *data = zkocaml_get_scratch;
 
-  zkocaml_watcher_context_t *ctx =
-    (zkocaml_watcher_context_t* )(watcher_ctx);
-  watcher_callback = ctx->watcher_callback;
-  local_zh = zkocaml_copy_zhandle(zh);
-  local_type = zkocaml_enum_event_c2ml(type);
-  local_state = zkocaml_enum_state_c2ml(state);
-  local_path = caml_copy_string(path);
-  local_watcher_ctx = caml_copy_string(ctx->watcher_ctx);
+  *buffer_len = capacity;
+  if (watcher != NULL) {
+    rc = zoo_wget(zh, path, watcher, watcher_ctx, data, buffer_len, stat);
+  } else {
+    rc = zoo_get(zh, path, watch, data, buffer_len, stat);
+  }
 
-  Store_field(args, 0, local_zh);
-  Store_field(args, 1, local_type);
-  Store_field(args, 2, local_state);
-  Store_field(args, 3, local_path);
-  Store_field(args, 4, local_watcher_ctx);
+  while (rc == ZOK && stat->dataLength > capacity) {
+    char *grown = NULL;
+
+    capacity = stat->dataLength;
+    if (data == zkocaml_get_scratch) data = NULL;
+    grown = (char *)realloc(data, capacity);
+    if (grown == NULL) {
+      free(data);
+      *buffer = NULL;
+      *buffer_len = 0;
+      return ZSYSTEMERROR;
+    }
+    data = grown;
+    *buffer_len = capacity;
+    rc = zoo_get(zh, path, 0, data, buffer_len, stat);
+  }
 
-  callbackN(watcher_callback, 5, args);
+  *buffer = data;
+  return rc;
+}
 
-  zkocaml_leave_callback();
+static void
+zkocaml_release_get_buffer(char *buffer)
+{
+  if (buffer != zkocaml_get_scratch) free(buffer);
 }
 
 /**
- * The completion callbacks (from asynchronous calls) are
- * implemented similarly.
+ * A multi request converted from an OCaml op array.
+ *
+ * The C client fills in the results, the created paths and the stats of
+ * set operations when the reply arrives, so for zoo_amulti the structure
+ * must outlive the call and is released once the completion has been
+ * delivered. tags holds the constructor of each op, for decoding.
  */
+typedef struct zkocaml_multi_s_ {
+  int count;
+  int *tags;
+  zoo_op_t *ops;
+  zoo_op_result_t *results;
+  char **paths;
+  char **values;
+  char **path_buffers;
+  struct ACL_vector *acls;
+  struct Stat *stats;
+} zkocaml_multi_t;
+
+#define ZKOCAML_OP_CREATE 0
+#define ZKOCAML_OP_DELETE 1
+#define ZKOCAML_OP_SET    2
+#define ZKOCAML_OP_CHECK  3
 
 /**
- * Called when an asynchronous call that returns void completes and
- * dispatches user provided callback
+ * Results the C client never filled in (the request failed before it
+ * reached the server) are reported with the error of the whole request.
  */
-static void
-void_completion_dispatch(int rc, const void *data)
-{
-  zkocaml_enter_callback();
+#define ZKOCAML_MULTI_RESULT_UNSET INT_MIN
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal2(local_rc, local_data);
+/**
+ * Convert an OCaml op array into a zkocaml_multi_t, copying every path,
+ * value and ACL out of the OCaml heap. Must be called with the runtime
+ * lock held; release the result with zkocaml_multi_free().
+ */
+static zkocaml_multi_t *
+zkocaml_parse_multi_ops(value ops)
+{
+  CAMLparam1(ops);
+  CAMLlocal1(op);
+
+  int i = 0, count = Wosize_val(ops);
+  int slots = count > 0 ? count : 1;
+  zkocaml_multi_t *multi = (zkocaml_multi_t *)
+    calloc(1, sizeof(zkocaml_multi_t));
+  multi->count = count;
+  multi->tags = (int *)calloc(slots, sizeof(int));
+  multi->ops = (zoo_op_t *)calloc(slots, sizeof(zoo_op_t));
+  multi->results = (zoo_op_result_t *)calloc(slots, sizeof(zoo_op_result_t));
+  multi->paths = (char **)calloc(slots, sizeof(char *));
+  multi->values = (char **)calloc(slots, sizeof(char *));
+  multi->path_buffers = (char **)calloc(slots, sizeof(char *));
+  multi->acls = (struct ACL_vector *)
+    calloc(slots, sizeof(struct ACL_vector));
+  multi->stats = (struct Stat *)calloc(slots, sizeof(struct Stat));
+
+  for (; i < count; i++) {
+    op = Field(ops, i);
+    multi->tags[i] = Tag_val(op);
+    multi->paths[i] = zkocaml_copy_string_val(Field(op, 0));
+    multi->results[i].err = ZKOCAML_MULTI_RESULT_UNSET;
+
+    switch (multi->tags[i]) {
+    case ZKOCAML_OP_CREATE:
+      multi->values[i] = zkocaml_copy_string_val(Field(op, 1));
+      if (zkocaml_parse_acls(Field(op, 2), &multi->acls[i]) == 0) {
+        multi->acls[i] = ZOO_OPEN_ACL_UNSAFE;
+      }
+      multi->path_buffers[i] = (char *)
+        calloc(ZKOCAML_MAX_PATH_BUFFER_SIZE, sizeof(char));
+      zoo_create_op_init(&multi->ops[i],
+                         multi->paths[i],
+                         multi->values[i],
+                         caml_string_length(Field(op, 1)),
+                         &multi->acls[i],
+                         zkocaml_enum_create_flag_ml2c(Field(op, 3)),
+                         multi->path_buffers[i],
+                         ZKOCAML_MAX_PATH_BUFFER_SIZE);
+      break;
+    case ZKOCAML_OP_DELETE:
+      zoo_delete_op_init(&multi->ops[i],
+                         multi->paths[i],
+                         Int_val(Field(op, 1)));
+      break;
+    case ZKOCAML_OP_SET:
+      multi->values[i] = zkocaml_copy_string_val(Field(op, 1));
+      zoo_set_op_init(&multi->ops[i],
+                      multi->paths[i],
+                      multi->values[i],
+                      caml_string_length(Field(op, 1)),
+                      Int_val(Field(op, 2)),
+                      &multi->stats[i]);
+      break;
+    case ZKOCAML_OP_CHECK:
+      zoo_check_op_init(&multi->ops[i],
+                        multi->paths[i],
+                        Int_val(Field(op, 1)));
+      break;
+    }
+  }
 
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_data = caml_copy_string(ctx->data);
+  CAMLreturnT(zkocaml_multi_t *, multi);
+}
 
-  callback2(completion_callback, local_rc, local_data);
+static void
+zkocaml_multi_free(zkocaml_multi_t *multi)
+{
+  int i = 0;
 
-  zkocaml_leave_callback();
+  for (; i < multi->count; i++) {
+    free(multi->paths[i]);
+    free(multi->values[i]);
+    free(multi->path_buffers[i]);
+    if (multi->acls[i].data != ZOO_OPEN_ACL_UNSAFE.data) {
+      deallocate_ACL_vector(&multi->acls[i]);
+    }
+  }
+  free(multi->tags);
+  free(multi->ops);
+  free(multi->results);
+  free(multi->paths);
+  free(multi->values);
+  free(multi->path_buffers);
+  free(multi->acls);
+  free(multi->stats);
+  free(multi);
 }
 
 /**
- * Called when an asynchronous call that returns a stat structure
- * completes and dispatches user provided callback
+ * Decode the per-op results of a multi request into an OCaml op_result
+ * array, whose constructors mirror the op constructors one for one.
  */
-static void
-stat_completion_dispatch(int rc,
-                         const struct Stat *stat,
-                         const void *data)
+static value
+zkocaml_build_multi_results(const zkocaml_multi_t *multi, int rc)
 {
-  zkocaml_enter_callback();
-
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_stat, local_data);
-
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+  CAMLparam0();
+  CAMLlocal3(v, result, field);
 
-  callback3(completion_callback, local_rc, local_stat, local_data);
+  int i = 0;
+  v = caml_alloc(multi->count, 0);
+  for (; i < multi->count; i++) {
+    int err = multi->results[i].err;
+    if (err == ZKOCAML_MULTI_RESULT_UNSET) err = rc;
+
+    switch (multi->tags[i]) {
+    case ZKOCAML_OP_CREATE:
+      result = caml_alloc(2, ZKOCAML_OP_CREATE);
+      field = zkocaml_enum_error_c2ml(err);
+      Store_field(result, 0, field);
+      field = caml_copy_string(err == ZOK ? multi->path_buffers[i] : "");
+      Store_field(result, 1, field);
+      break;
+    case ZKOCAML_OP_SET:
+      result = caml_alloc(2, ZKOCAML_OP_SET);
+      field = zkocaml_enum_error_c2ml(err);
+      Store_field(result, 0, field);
+      field = zkocaml_build_stat_struct(err == ZOK ? &multi->stats[i] : NULL);
+      Store_field(result, 1, field);
+      break;
+    default:
+      result = caml_alloc(1, multi->tags[i]);
+      field = zkocaml_enum_error_c2ml(err);
+      Store_field(result, 0, field);
+      break;
+    }
+    Store_field(v, i, result);
+  }
 
-  zkocaml_leave_callback();
+  CAMLreturn(v);
 }
+
 /**
- * Called when an asynchronous call that returns a stat structure and
- * some untyped data completes and dispatches user provided
- * callback (used by aget)
+ * Per-operation accounting.
+ *
+ * Every request is counted under its operation type and under the error
+ * code it completed with, and its latency is recorded into two histograms:
+ *
+ *   service:  from the call of the stub until the C client hands over the
+ *             result, that is the time spent in the server and in the C
+ *             client's queues;
+ *   callback: from the dispatch of an asynchronous completion until its
+ *             OCaml callback returns, that is the wait for the runtime
+ *             lock (or in the delivery queue) plus the callback itself.
+ *             Synchronous calls record none.
+ *
+ * The histograms are HDR-style: latencies in microseconds are bucketed by
+ * power of two, and each power of two is split into
+ * ZKOCAML_HIST_SUB_BUCKETS linear sub-buckets, so every value is known to
+ * within 1/16th. Counters are bumped with relaxed atomic additions, so
+ * recording takes no lock and a snapshot can be taken under traffic, at
+ * the price of counters that may be a few operations apart.
  */
-static void
-data_completion_dispatch(int rc,
-                         const char *val,
-                         int val_len,
-                         const struct Stat *stat,
-                         const void *data)
+#define ZKOCAML_HIST_SUB_BITS 4
+#define ZKOCAML_HIST_SUB_BUCKETS (1 << ZKOCAML_HIST_SUB_BITS)
+#define ZKOCAML_HIST_MAX_BITS 36
+#define ZKOCAML_HIST_BUCKETS \
+  ((ZKOCAML_HIST_MAX_BITS - ZKOCAML_HIST_SUB_BITS + 1) \
+   * ZKOCAML_HIST_SUB_BUCKETS)
+#define ZKOCAML_ERROR_CODES 128
+
+typedef enum zkocaml_op_type_e_ {
+  ZKOCAML_OP_TYPE_CREATE,
+  ZKOCAML_OP_TYPE_DELETE,
+  ZKOCAML_OP_TYPE_EXISTS,
+  ZKOCAML_OP_TYPE_GET,
+  ZKOCAML_OP_TYPE_SET,
+  ZKOCAML_OP_TYPE_GET_CHILDREN,
+  ZKOCAML_OP_TYPE_GET_ACL,
+  ZKOCAML_OP_TYPE_SET_ACL,
+  ZKOCAML_OP_TYPE_SYNC,
+  ZKOCAML_OP_TYPE_MULTI,
+  ZKOCAML_OP_TYPE_AUTH,
+  ZKOCAML_OP_TYPES
+} zkocaml_op_type_t;
+
+typedef struct zkocaml_histogram_s_ {
+  unsigned long count;
+  unsigned long sum;
+  unsigned long max;
+  unsigned long buckets[ZKOCAML_HIST_BUCKETS];
+} zkocaml_histogram_t;
+
+typedef struct zkocaml_op_metrics_s_ {
+  unsigned long submitted;
+  unsigned long completed;
+  unsigned long errors[ZKOCAML_ERROR_CODES];
+  zkocaml_histogram_t service;
+  zkocaml_histogram_t callback;
+} zkocaml_op_metrics_t;
+
+static zkocaml_op_metrics_t zkocaml_ops[ZKOCAML_OP_TYPES];
+
+static int64_t
+zkocaml_clock_us(void)
 {
-  zkocaml_enter_callback();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal5(local_rc, local_val, local_val_len, local_stat, local_data);
-  CAMLlocalN(args, 5);
+static int
+zkocaml_hist_index(unsigned long us)
+{
+  int msb = 0;
 
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_val = caml_copy_string(val);
-  local_val_len = Val_int(val_len);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+  if (us < ZKOCAML_HIST_SUB_BUCKETS) return (int)us;
+  msb = 63 - __builtin_clzll(us);
+  if (msb >= ZKOCAML_HIST_MAX_BITS) return ZKOCAML_HIST_BUCKETS - 1;
+
+  return (msb - ZKOCAML_HIST_SUB_BITS + 1) * ZKOCAML_HIST_SUB_BUCKETS
+    + (int)((us >> (msb - ZKOCAML_HIST_SUB_BITS))
+            & (ZKOCAML_HIST_SUB_BUCKETS - 1));
+}
 
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_val);
-  Store_field(args, 2, local_val_len);
-  Store_field(args, 3, local_stat);
-  Store_field(args, 4, local_data);
+/**
+ * The largest value, in microseconds, that falls into the given bucket.
+ */
+static unsigned long
+zkocaml_hist_bucket_max(int index)
+{
+  int group = index / ZKOCAML_HIST_SUB_BUCKETS;
+  unsigned long sub = index % ZKOCAML_HIST_SUB_BUCKETS;
 
-  callbackN(completion_callback, 5, args);
+  if (group == 0) return sub;
+  return ((ZKOCAML_HIST_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
 
-  zkocaml_leave_callback();
+static void
+zkocaml_hist_record(zkocaml_histogram_t *hist, int64_t us)
+{
+  unsigned long v = us > 0 ? (unsigned long)us : 0;
+  unsigned long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&hist->buckets[zkocaml_hist_index(v)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, v, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  while (v > max &&
+         !__atomic_compare_exchange_n(&hist->max, &max, v, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
 /**
- * Called when an asynchronous call that returns a list of strings
- * completes and dispatches user provided callback.
+ * Slow-operation log.
+ *
+ * Every request whose service latency reaches the threshold set for its
+ * op type is copied into a ring of the last ZKOCAML_SLOW_LOG_SIZE such
+ * requests, with its path (truncated to ZKOCAML_SLOW_PATH_SIZE - 1
+ * bytes), the number of data bytes sent or received, the error code, its
+ * wall-clock start and its service latency. A threshold of 0 disables the
+ * log for that op type, and all of them are 0 initially.
+ *
+ * Writers claim a slot with one atomic increment and publish it with a
+ * per-slot sequence number, seqlock style: the slot holds 2 * n + 1 while
+ * the n-th slow request is written and 2 * n + 2 once it is complete. A
+ * reader keeps a slot only when it saw the expected even number both
+ * before and after copying it, so neither side ever waits on the other,
+ * and entries overwritten during a read are simply missed.
+ */
+typedef struct zkocaml_slow_op_s_ {
+  unsigned long seq;
+  int op;
+  int rc;
+  long size;
+  int64_t started_us;
+  int64_t service_us;
+  char path[ZKOCAML_SLOW_PATH_SIZE];
+} zkocaml_slow_op_t;
+
+static int64_t zkocaml_slow_thresholds[ZKOCAML_OP_TYPES];
+static int zkocaml_slow_enabled = 0;
+static zkocaml_slow_op_t zkocaml_slow_log[ZKOCAML_SLOW_LOG_SIZE];
+static unsigned long zkocaml_slow_next = 0;
+
+/**
+ * Copy path into a slow-log path buffer, truncating it. NULL stands for
+ * requests without a path, such as multi and auth.
  */
 static void
-strings_completion_dispatch(int rc,
-                            const struct String_vector *strings,
-                            const void *data)
+zkocaml_slow_copy_path(char *buffer, const char *path)
 {
-  zkocaml_enter_callback();
+  size_t len = path == NULL ? 0 : strlen(path);
 
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_strings, local_data);
+  if (len >= ZKOCAML_SLOW_PATH_SIZE) len = ZKOCAML_SLOW_PATH_SIZE - 1;
+  if (len > 0) memcpy(buffer, path, len);
+  buffer[len] = '\0';
+}
 
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_strings = zkocaml_build_strings_struct(strings);
-  local_data = caml_copy_string(ctx->data);
+static void
+zkocaml_slow_record(zkocaml_op_type_t op,
+                    int64_t started,
+                    int64_t now,
+                    int rc,
+                    const char *path,
+                    long size)
+{
+  struct timespec ts;
+  unsigned long n = __atomic_fetch_add(&zkocaml_slow_next, 1,
+                                       __ATOMIC_RELAXED);
+  zkocaml_slow_op_t *slot = &zkocaml_slow_log[n % ZKOCAML_SLOW_LOG_SIZE];
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->op = op;
+  slot->rc = rc;
+  slot->size = size > 0 ? size : 0;
+  slot->service_us = now - started;
+  slot->started_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+    - slot->service_us;
+  zkocaml_slow_copy_path(slot->path, path);
+  __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+}
 
-  callback3(completion_callback, local_rc, local_strings, local_data);
+/**
+ * Copy the slow-log entries still in the ring, oldest first, into
+ * entries (of ZKOCAML_SLOW_LOG_SIZE slots) and return their number.
+ */
+static int
+zkocaml_slow_snapshot(zkocaml_slow_op_t *entries)
+{
+  int count = 0;
+  unsigned long last = __atomic_load_n(&zkocaml_slow_next, __ATOMIC_ACQUIRE);
+  unsigned long n = last > ZKOCAML_SLOW_LOG_SIZE
+    ? last - ZKOCAML_SLOW_LOG_SIZE : 0;
+
+  for (; n < last; n++) {
+    zkocaml_slow_op_t *slot = &zkocaml_slow_log[n % ZKOCAML_SLOW_LOG_SIZE];
+    unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != 2 * n + 2) continue;
+    memcpy(&entries[count], slot, sizeof(zkocaml_slow_op_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue;
+    entries[count].path[ZKOCAML_SLOW_PATH_SIZE - 1] = '\0';
+    count++;
+  }
 
-  zkocaml_leave_callback();
+  return count;
 }
 
 /**
- * Called when an asynchronous call that returns a list of strings
- * and a stat structure completes and dispatches user provided callback.
+ * Hot-path tracking.
+ *
+ * While it is on, every get, exists and get_children request counts as a
+ * read of its path and every set as a write, once the request completes.
+ * Each of the two trackers counts paths (truncated like in the
+ * slow-operation log) in a count-min sketch of ZKOCAML_HOT_DEPTH rows of
+ * ZKOCAML_HOT_WIDTH counters, and keeps the ZKOCAML_HOT_TOP paths with
+ * the highest estimates in a min-heap.
+ *
+ * Counting is a few relaxed atomic additions. Only a path whose estimate
+ * beats the smallest one in a full heap (the floor) goes on to update the
+ * heap, and it skips the update when another thread holds the heap, so
+ * the request path never waits. Estimates never undercount, and
+ * overcount by at most a fraction e / ZKOCAML_HOT_WIDTH of all the
+ * counted requests with high probability.
  */
+typedef struct zkocaml_hot_entry_s_ {
+  unsigned long count;
+  uint64_t hash;
+  char path[ZKOCAML_SLOW_PATH_SIZE];
+} zkocaml_hot_entry_t;
+
+typedef struct zkocaml_hot_tracker_s_ {
+  unsigned long sketch[ZKOCAML_HOT_DEPTH][ZKOCAML_HOT_WIDTH];
+  unsigned long floor;
+  pthread_mutex_t lock;
+  int size;
+  zkocaml_hot_entry_t top[ZKOCAML_HOT_TOP];
+} zkocaml_hot_tracker_t;
+
+#define ZKOCAML_HOT_READS  0
+#define ZKOCAML_HOT_WRITES 1
+
+static int zkocaml_hot_enabled = 0;
+static zkocaml_hot_tracker_t zkocaml_hot[2] = {
+  { .lock = PTHREAD_MUTEX_INITIALIZER },
+  { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
 static void
-strings_stat_completion_dispatch(int rc,
-                                 const struct String_vector *strings,
-                                 const struct Stat *stat,
-                                 const void *data)
+zkocaml_hot_swap(zkocaml_hot_tracker_t *tracker, int i, int j)
 {
-  zkocaml_enter_callback();
-
-  CAMLlocal1(completion_callback);
-  CAMLlocal4(local_rc, local_strings, local_stat, local_data);
-  CAMLlocalN(args, 4);
-
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_strings = zkocaml_build_strings_struct(strings);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
+  zkocaml_hot_entry_t tmp = tracker->top[i];
+  tracker->top[i] = tracker->top[j];
+  tracker->top[j] = tmp;
+}
 
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_strings);
-  Store_field(args, 2, local_stat);
-  Store_field(args, 3, local_data);
+static void
+zkocaml_hot_sift_up(zkocaml_hot_tracker_t *tracker, int i)
+{
+  while (i > 0 && tracker->top[(i - 1) / 2].count > tracker->top[i].count) {
+    zkocaml_hot_swap(tracker, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
 
-  callbackN(completion_callback, 4, args);
+static void
+zkocaml_hot_sift_down(zkocaml_hot_tracker_t *tracker, int i)
+{
+  for (;;) {
+    int least = i, child = 2 * i + 1;
 
-  zkocaml_leave_callback();
+    if (child < tracker->size &&
+        tracker->top[child].count < tracker->top[least].count) {
+      least = child;
+    }
+    child++;
+    if (child < tracker->size &&
+        tracker->top[child].count < tracker->top[least].count) {
+      least = child;
+    }
+    if (least == i) return;
+    zkocaml_hot_swap(tracker, i, least);
+    i = least;
+  }
 }
 
 /**
- * Called when an asynchronous call that returns a single string
- * completes and dispatches user provided callback.
+ * Offer a path with its new estimate to the heap of a tracker, whose lock
+ * is held: refresh its entry, or add it while the heap is not full, or
+ * let it replace the coldest entry when it beats it.
  */
 static void
-string_completion_dispatch(int rc,
-                           const char *val,
-                           const void *data)
+zkocaml_hot_offer(zkocaml_hot_tracker_t *tracker,
+                  uint64_t hash,
+                  const char *path,
+                  size_t len,
+                  unsigned long count)
 {
-  zkocaml_enter_callback();
-
-  CAMLlocal1(completion_callback);
-  CAMLlocal3(local_rc, local_val, local_data);
+  int i = 0;
 
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  if (val != NULL) local_val = caml_copy_string(val);
-  local_data = caml_copy_string(ctx->data);
+  for (; i < tracker->size; i++) {
+    zkocaml_hot_entry_t *entry = &tracker->top[i];
+    if (entry->hash == hash && strncmp(entry->path, path, len) == 0 &&
+        entry->path[len] == '\0') {
+      if (count > entry->count) {
+        entry->count = count;
+        zkocaml_hot_sift_down(tracker, i);
+      }
+      goto out;
+    }
+  }
 
-  callback3(completion_callback, local_rc, local_val, local_data);
+  if (tracker->size < ZKOCAML_HOT_TOP) {
+    i = tracker->size++;
+  } else if (count > tracker->top[0].count) {
+    i = 0;
+  } else {
+    goto out;
+  }
+  tracker->top[i].count = count;
+  tracker->top[i].hash = hash;
+  memcpy(tracker->top[i].path, path, len);
+  tracker->top[i].path[len] = '\0';
+  if (i == 0) {
+    zkocaml_hot_sift_down(tracker, 0);
+  } else {
+    zkocaml_hot_sift_up(tracker, i);
+  }
 
-  zkocaml_leave_callback();
+out:
+  __atomic_store_n(&tracker->floor,
+                   tracker->size == ZKOCAML_HOT_TOP ? tracker->top[0].count
+                   : 0,
+                   __ATOMIC_RELAXED);
 }
 
 /**
- * Called when an asynchronous call that returns a list of ACLs
- * completes and dispatches user provided callback.
+ * Count one request of the given op type on path, if the op type is
+ * tracked.
  */
 static void
-acl_completion_dispatch(int rc,
-                        struct ACL_vector *acl,
-                        struct Stat *stat,
-                        const void *data)
+zkocaml_hot_touch(zkocaml_op_type_t op, const char *path)
 {
-  zkocaml_enter_callback();
-
-  CAMLlocal1(completion_callback);
-  CAMLlocal4(local_rc, local_acl, local_stat, local_data);
-  CAMLlocalN(args, 4);
-
-  zkocaml_completion_context_t *ctx =
-    (zkocaml_completion_context_t *)data;
-  completion_callback = ctx->completion_callback;
-  local_rc = zkocaml_enum_error_c2ml(rc);
-  local_acl = zkocaml_build_acls_struct(acl);
-  local_stat = zkocaml_build_stat_struct(stat);
-  local_data = caml_copy_string(ctx->data);
-
-  Store_field(args, 0, local_rc);
-  Store_field(args, 1, local_acl);
-  Store_field(args, 2, local_stat);
-  Store_field(args, 3, local_data);
+  int d = 0;
+  size_t i = 0, len = 0;
+  uint64_t hash = 14695981039346656037ull;
+  unsigned long count = ULONG_MAX;
+  zkocaml_hot_tracker_t *tracker = NULL;
+
+  switch (op) {
+  case ZKOCAML_OP_TYPE_GET:
+  case ZKOCAML_OP_TYPE_EXISTS:
+  case ZKOCAML_OP_TYPE_GET_CHILDREN:
+    tracker = &zkocaml_hot[ZKOCAML_HOT_READS];
+    break;
+  case ZKOCAML_OP_TYPE_SET:
+    tracker = &zkocaml_hot[ZKOCAML_HOT_WRITES];
+    break;
+  default:
+    return;
+  }
+  if (path == NULL || path[0] == '\0') return;
 
-  callbackN(completion_callback, 4, args);
+  len = strnlen(path, ZKOCAML_SLOW_PATH_SIZE - 1);
+  for (; i < len; i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 1099511628211ull;
+  }
+  for (; d < ZKOCAML_HOT_DEPTH; d++) {
+    uint32_t slot = ((uint32_t)hash + d * (uint32_t)((hash >> 32) | 1))
+      & (ZKOCAML_HOT_WIDTH - 1);
+    unsigned long n = __atomic_add_fetch(&tracker->sketch[d][slot], 1,
+                                         __ATOMIC_RELAXED);
+    if (n < count) count = n;
+  }
 
-  zkocaml_leave_callback();
+  if (count <= __atomic_load_n(&tracker->floor, __ATOMIC_RELAXED)) return;
+  if (pthread_mutex_trylock(&tracker->lock) != 0) return;
+  zkocaml_hot_offer(tracker, hash, path, len, count);
+  pthread_mutex_unlock(&tracker->lock);
 }
 
 /**
- * Create a handle to used communicate with zookeeper.
- *
- * This method creates a new handle and a zookeeper session that corresponds
- * to that handle. Session establishment is asynchronous, meaning that the
- * session should not be considered established until (and unless) an
- * event of state ZOO_CONNECTED_STATE is received.
- *
- * @host Comma separated host:port pairs, each corresponding to a zk
- *   server. e.g. "127.0.0.1:3000,127.0.0.1:3001,127.0.0.1:3002"
- *
- * @watcher_callback The global watcher callback function. When notifications are
- *   triggered this function will be invoked.
- *
- * @clientid The id of a previously established session that this
- *   client will be reconnecting to. Pass 0 if not reconnecting to a previous
- *   session. Clients can access the session id of an established, valid,
- *   connection by calling zoo_client_id. If the session corresponding to
- *   the specified clientid has expired, or if the clientid is invalid for 
- *   any reason, the returned zhandle_t will be invalid -- the zhandle_t
- *   state will indicate the reason for failure (typically
- *   ZOO_EXPIRED_SESSION_STATE).
- *
- * @context The handback object that will be associated with this instance 
- *   of zhandle_t. Application can access it (for example, in the watcher
- *   callback) using zoo_get_context. The object is not used by zookeeper
- *   internally and can be null.
- *
- * @flags Reserved for future use. Should be set to zero.
- *
- * @return A pointer to the opaque zhandle structure. If it fails to create
- * a new zhandle the function returns NULL and the errno variable indicates
- * the reason.
+ * Count the submission of a request and return its start time, to be
+ * handed to zkocaml_op_end once the C client returns its result.
  */
-
-CAMLprim value
-zkocaml_init_native(value host,
-                    value watcher_callback,
-                    value recv_timeout,
-                    value clientid,
-                    value context,
-                    value flag)
+static int64_t
+zkocaml_op_begin(zkocaml_op_type_t op)
 {
-  CAMLparam5(host, watcher_callback, recv_timeout, clientid, context);
-  CAMLxparam1(flag);
-  CAMLlocal1(zh);
-
-  const char *local_host = String_val(host);
-  int local_recv_timeout = Long_val(recv_timeout);
-  clientid_t *cid = NULL;
-
-  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  ctx->watcher_ctx = String_val(context);
-  ctx->watcher_callback = watcher_callback;
+  __atomic_fetch_add(&zkocaml_ops[op].submitted, 1, __ATOMIC_RELAXED);
+  return zkocaml_clock_us();
+}
 
-  cid = zkocaml_parse_clientid(clientid);
-  zhandle_t *handle = zookeeper_init(local_host,
-          watcher_dispatch, local_recv_timeout, cid, ctx, 0);
+/**
+ * Count the completion of a request on path with the given error code,
+ * record its service latency, log it when it is slow (size being the
+ * number of data bytes sent or received), count it against its path when
+ * hot-path tracking is on, and return the current time.
+ */
+static int64_t
+zkocaml_op_end(zkocaml_op_type_t op,
+               int64_t started,
+               int rc,
+               const char *path,
+               long size)
+{
+  zkocaml_op_metrics_t *metrics = &zkocaml_ops[op];
+  int64_t now = zkocaml_clock_us();
+  int64_t threshold = __atomic_load_n(&zkocaml_slow_thresholds[op],
+                                      __ATOMIC_RELAXED);
+
+  if (rc > 0 || rc <= -ZKOCAML_ERROR_CODES) rc = ZSYSTEMERROR;
+  __atomic_fetch_add(&metrics->errors[-rc], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&metrics->completed, 1, __ATOMIC_RELAXED);
+  zkocaml_hist_record(&metrics->service, now - started);
+  if (__builtin_expect(threshold > 0, 0) && now - started >= threshold) {
+    zkocaml_slow_record(op, started, now, rc, path, size);
+  }
+  if (__builtin_expect(zkocaml_hot_enabled, 0)) zkocaml_hot_touch(op, path);
 
-  zh = zkocaml_copy_zhandle(handle);
-  CAMLreturn(zh);
+  return now;
 }
 
-CAMLprim value
-zkocaml_init_bytecode(value *argv, int argn)
+/**
+ * Record the time since dispatch as the callback latency of a completion
+ * whose OCaml callback just returned.
+ */
+static void
+zkocaml_op_returned(zkocaml_op_type_t op, int64_t dispatched)
 {
-  return zkocaml_init_native(argv[0], argv[1], argv[2],
-                             argv[3], argv[4], argv[5]);
+  zkocaml_hist_record(&zkocaml_ops[op].callback,
+                      zkocaml_clock_us() - dispatched);
 }
 
 /**
- * Close the zookeeper handle and free up any resources.
- *
- * After this call, the client session will no longer be valid. The function
- * will flush any outstanding send requests before return. As a result it may
- * block.
- *
- * This method should only be called only once on a zookeeper handle. Calling
- * twice will cause undefined (and probably undesirable behavior). Calling any other
- * zookeeper method after calling close is undefined behaviour and should be avoided.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @return a result code. Regardless of the error code returned, the zhandle
- * will be destroyed and all resources freed.
- *   ZOK - success
- *   ZBADARGUMENTS - invalid input parameters
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
- *   ZOPERATIONTIMEOUT - failed to flush the buffers within the specified timeout.
- *   ZCONNECTIONLOSS - a network error occured while attempting to send request to server
- *   ZSYSTEMERROR -- a system (OS) error occured; it's worth checking errno to get details
+ * Tracing hooks.
+ *
+ * Once hooks are set, every request opens a span when it is submitted and
+ * closes it when its completion is dispatched, or when the call returns
+ * for a synchronous request. trace_start receives a fresh span id, the op
+ * type, the path and the size of the data sent; trace_end the same span
+ * id, the error code, the mzxid of the returned stat (0 without one) and
+ * the size of the data received. Both run with the runtime lock held, the
+ * end hook before the completion callback, and exceptions they raise are
+ * dropped.
+ *
+ * Without hooks, opening a span costs a test of zkocaml_trace_enabled and
+ * closing one a test of the span id, which is then 0.
  */
-CAMLprim value
-zkocaml_close(value zh)
+static int zkocaml_trace_enabled = 0;
+static value zkocaml_trace_hooks = Val_unit;
+static unsigned long zkocaml_trace_next_span = 0;
+
+static long
+zkocaml_trace_open(zkocaml_op_type_t op, value path, long size)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  CAMLparam1(path);
+  CAMLlocalN(args, 4);
 
-  zkocaml_handle_t *zhandle = NULL;
-  zhandle = zkocaml_handle_struct_val(zh);
-  int rc = zookeeper_close(zhandle->handle);
-  if (zkocaml_log_stream == NULL) fclose(zkocaml_log_stream);
-  result = Val_int(rc);
+  long span = (long)__atomic_add_fetch(&zkocaml_trace_next_span, 1,
+                                       __ATOMIC_RELAXED);
+  args[0] = Val_long(span);
+  args[1] = Val_int(op);
+  args[2] = path == Val_unit ? caml_alloc_string(0) : path;
+  args[3] = Val_long(size);
+  caml_callbackN_exn(Field(zkocaml_trace_hooks, 0), 4, args);
 
-  CAMLreturn(result);
+  CAMLreturnT(long, span);
 }
 
-/**
- * Return the client session id, only valid if the connections
- * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE)
- */
-CAMLprim value
-zkocaml_client_id(value zh)
+static void
+zkocaml_trace_close(long span, int rc, const struct Stat *stat, long size)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  CAMLparam0();
+  CAMLlocalN(args, 4);
 
-  zkocaml_handle_t *zhandle = NULL;
-  zhandle = zkocaml_handle_struct_val(zh);
-  const clientid_t *cid = zoo_client_id(zhandle->handle);
-  result = zkocaml_build_client_id_struct(cid);
+  args[0] = Val_long(span);
+  args[1] = zkocaml_enum_error_c2ml(rc);
+  args[2] = caml_copy_int64(rc == ZOK && stat != NULL ? stat->mzxid : 0);
+  args[3] = Val_long(rc == ZOK && size > 0 ? size : 0);
+  caml_callbackN_exn(Field(zkocaml_trace_hooks, 1), 4, args);
 
-  CAMLreturn(result);
+  CAMLreturn0;
 }
 
 /**
- * Return the timeout for this session, only valid if the connections
- * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE). This
- * value may change after a server re-connect.
+ * Open a span for a request on path (Val_unit for none) sending size
+ * bytes, and return its id, or 0 when tracing is off. Must be called with
+ * the runtime lock held, before any pointer into the OCaml heap is taken.
  */
-CAMLprim value
-zkocaml_recv_timeout(value zh)
+static inline long
+zkocaml_trace_start(zkocaml_op_type_t op, value path, long size)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
-
-  zkocaml_handle_t *zhandle = NULL;
-  zhandle = zkocaml_handle_struct_val(zh);
-  int recv_timeout = zoo_recv_timeout(zhandle->handle);
-  result = Val_int(recv_timeout);
-
-  CAMLreturn(result);
+  if (__builtin_expect(zkocaml_trace_enabled, 0)) {
+    return zkocaml_trace_open(op, path, size);
+  }
+  return 0;
 }
 
 /**
- * Return the context for this handle.
+ * Close the span opened by zkocaml_trace_start. Must be called with the
+ * runtime lock held, once no pointer into the OCaml heap is in use.
  */
-CAMLprim value
-zkocaml_get_context(value zh)
+static inline void
+zkocaml_trace_end(long span, int rc, const struct Stat *stat, long size)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
-
-  zkocaml_handle_t *zhandle = NULL;
-  zhandle = zkocaml_handle_struct_val(zh);
-  const char *context = zoo_get_context(zhandle->handle);
-  result = caml_copy_string(context);
-
-  CAMLreturn(result);
+  if (__builtin_expect(span != 0, 0) && zkocaml_trace_enabled) {
+    zkocaml_trace_close(span, rc, stat, size);
+  }
 }
 
 /**
- * Set the context for this handle.
+ * Completion contexts are carved out of slabs of
+ * ZKOCAML_COMPLETION_SLAB_SIZE entries and recycled through a free list,
+ * so a steady stream of asynchronous requests runs in constant memory.
+ * Slabs are never returned to the system.
  */
-CAMLprim value
-zkocaml_set_context(value zh, value context)
-{
-  CAMLparam2(zh, context);
+static pthread_mutex_t zkocaml_completion_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static zkocaml_completion_context_t *zkocaml_completion_free_list = NULL;
+static long zkocaml_completion_in_flight = 0;
+static long zkocaml_completion_peak_in_flight = 0;
+static long zkocaml_completion_pooled = 0;
 
-  zkocaml_handle_t *zhandle = NULL;
-  zhandle = zkocaml_handle_struct_val(zh);
-  char *local_context = String_val(context);
-  zoo_set_context(zhandle->handle, local_context);
+/**
+ * Take a completion context from the pool for an asynchronous request.
+ *
+ * The user data string is copied into the context (inline when short) and
+ * the completion callback is registered as a generational global root, so
+ * both stay valid until the completion is dispatched. The request is
+ * counted as submitted under op, span is the one opened for it by
+ * zkocaml_trace_start, and path and size (the number of data bytes sent)
+ * are kept for the slow-operation log and hot-path tracking while either
+ * is on. Must be called with the runtime lock held.
+ */
+static zkocaml_completion_context_t *
+zkocaml_completion_context_new(zkocaml_op_type_t op,
+                               long span,
+                               const char *path,
+                               long size,
+                               value completion,
+                               value data)
+{
+  int i = 0;
+  zkocaml_completion_context_t *ctx = NULL;
+
+  pthread_mutex_lock(&zkocaml_completion_pool_lock);
+  if (zkocaml_completion_free_list == NULL) {
+    zkocaml_completion_context_t *slab = (zkocaml_completion_context_t *)
+      calloc(ZKOCAML_COMPLETION_SLAB_SIZE,
+             sizeof(zkocaml_completion_context_t));
+    for (; i < ZKOCAML_COMPLETION_SLAB_SIZE; i++) {
+      slab[i].next = zkocaml_completion_free_list;
+      zkocaml_completion_free_list = &slab[i];
+    }
+    zkocaml_completion_pooled += ZKOCAML_COMPLETION_SLAB_SIZE;
+  }
+  ctx = zkocaml_completion_free_list;
+  zkocaml_completion_free_list = ctx->next;
+  zkocaml_completion_in_flight++;
+  if (zkocaml_completion_in_flight > zkocaml_completion_peak_in_flight) {
+    zkocaml_completion_peak_in_flight = zkocaml_completion_in_flight;
+  }
+  pthread_mutex_unlock(&zkocaml_completion_pool_lock);
+
+  ctx->next = NULL;
+  ctx->payload = NULL;
+  ctx->op = op;
+  ctx->started = zkocaml_op_begin(op);
+  ctx->dispatched = 0;
+  ctx->span = span;
+  ctx->size = size;
+  if (zkocaml_slow_enabled || zkocaml_hot_enabled) {
+    zkocaml_slow_copy_path(ctx->path, path);
+  } else {
+    ctx->path[0] = '\0';
+  }
+  ctx->data_len = caml_string_length(data);
+  if (ctx->data_len < ZKOCAML_COMPLETION_INLINE_DATA_SIZE) {
+    ctx->data = ctx->inline_data;
+  } else {
+    ctx->data = malloc(ctx->data_len + 1);
+  }
+  memcpy(ctx->data, String_val(data), ctx->data_len);
+  ((char *)ctx->data)[ctx->data_len] = '\0';
+  ctx->completion_callback = completion;
+  caml_register_generational_global_root(&ctx->completion_callback);
 
-  CAMLreturn(Val_unit);
+  return ctx;
 }
 
 /**
- * Set a watcher function
- * @return previous watcher function
+ * Return a completion context to the pool once the callback of its
+ * completion has returned, or right away when the request could not be
+ * submitted (see zkocaml_completion_context_abort). Must be called with
+ * the runtime lock held.
  */
-CAMLprim value
-zkocaml_set_watcher(value zh, value watcher_callback)
+static void
+zkocaml_completion_context_release(zkocaml_completion_context_t *ctx)
 {
-  CAMLparam2(zh, watcher_callback);
-  // TODO: implement this later.
-  CAMLreturn(Val_unit);
+  if (ctx->dispatched != 0) zkocaml_op_returned(ctx->op, ctx->dispatched);
+  caml_remove_generational_global_root(&ctx->completion_callback);
+  if (ctx->data != ctx->inline_data) free(ctx->data);
+  ctx->data = NULL;
+
+  pthread_mutex_lock(&zkocaml_completion_pool_lock);
+  ctx->next = zkocaml_completion_free_list;
+  zkocaml_completion_free_list = ctx;
+  zkocaml_completion_in_flight--;
+  pthread_mutex_unlock(&zkocaml_completion_pool_lock);
 }
 
 /**
- * Returns the socket address for the current connection
- *
- * @return socket address of the connected host or NULL on failure, only valid if the
- * connection is current connected
+ * Release the context of a request the C client refused to submit,
+ * counting it as completed with the refusal code.
  */
-CAMLprim value
-zkocaml_get_connected_host(value zh)
+static void
+zkocaml_completion_context_abort(zkocaml_completion_context_t *ctx, int rc)
 {
-  CAMLparam1(zh);
-  // TODO: implement this later.
-  CAMLreturn(Val_unit);
+  zkocaml_op_end(ctx->op, ctx->started, rc, ctx->path, ctx->size);
+  zkocaml_trace_end(ctx->span, rc, NULL, 0);
+  zkocaml_completion_context_release(ctx);
 }
 
 /**
- * Get the state of the zookeeper connection.
- *
- * The return value will be one of the state consts.
+ * Count the completion of an asynchronous request, which received size
+ * data bytes, as soon as the C client dispatches it. Called first thing
+ * by every *_completion_dispatch.
  */
-CAMLprim value
-zkocaml_state(value zh)
+static void
+zkocaml_completion_dispatched(const void *data, int rc, long size)
+{
+  zkocaml_completion_context_t *ctx = (zkocaml_completion_context_t *)data;
+  ctx->dispatched = zkocaml_op_end(ctx->op, ctx->started, rc, ctx->path,
+                                   ctx->size + size);
+}
+
+/**
+ * Completions and watch events are handed to OCaml in one of two ways.
+ *
+ * In ZKOCAML_DELIVERY_DIRECT mode (the default) the C client thread that
+ * received the reply acquires the runtime lock and runs the OCaml callback
+ * itself, once per reply.
+ *
+ * In ZKOCAML_DELIVERY_QUEUED mode the C client thread copies the raw
+ * result into a zkocaml_event_t, pushes it onto a lock-free ring and
+ * signals the delivery fd. An OCaml thread watching that fd then calls
+ * zkocaml_drain_completions, which converts and dispatches every pending
+ * event while holding the runtime lock only once for the whole batch.
+ */
+#define ZKOCAML_DELIVERY_DIRECT 0
+#define ZKOCAML_DELIVERY_QUEUED 1
+
+static volatile int zkocaml_delivery_mode = ZKOCAML_DELIVERY_DIRECT;
+
+typedef enum zkocaml_event_kind_e_ {
+  ZKOCAML_EVENT_WATCHER,
+  ZKOCAML_EVENT_VOID,
+  ZKOCAML_EVENT_STAT,
+  ZKOCAML_EVENT_DATA,
+  ZKOCAML_EVENT_STRINGS,
+  ZKOCAML_EVENT_STRINGS_STAT,
+  ZKOCAML_EVENT_STRING,
+  ZKOCAML_EVENT_ACL,
+  ZKOCAML_EVENT_MULTI,
+  ZKOCAML_EVENT_CHILDREN_DIFF,
+  ZKOCAML_EVENT_WATCH_FANOUT,
+  ZKOCAML_EVENT_WATCH_LISTING,
+  ZKOCAML_EVENT_RELEASE_WATCHERS
+} zkocaml_event_kind_t;
+
+/**
+ * A completion or watch event captured on the C client thread, holding
+ * private copies of everything the C client only lends for the duration
+ * of the callback.
+ */
+typedef struct zkocaml_event_s_ {
+  zkocaml_event_kind_t kind;
+  int rc;
+  int type;
+  int state;
+  zhandle_t *zh;
+  void *ctx;
+  char *val;
+  int val_len;
+  int has_stat;
+  struct Stat stat;
+  struct String_vector strings;
+  struct String_vector strings_extra;
+  struct ACL_vector acl;
+  void *payload;
+} zkocaml_event_t;
+
+/**
+ * Bounded multi-producer ring of pending events (one sequence number per
+ * cell, as in Dmitry Vyukov's bounded MPMC queue). Producers are the C
+ * client threads of every open handle; the consumer is whichever OCaml
+ * thread drains the queue.
+ */
+typedef struct zkocaml_ring_cell_s_ {
+  size_t seq;
+  zkocaml_event_t *event;
+} zkocaml_ring_cell_t;
+
+static zkocaml_ring_cell_t zkocaml_ring[ZKOCAML_RING_SIZE];
+static size_t zkocaml_ring_enqueue_pos = 0;
+static size_t zkocaml_ring_dequeue_pos = 0;
+static int zkocaml_ring_signalled = 0;
+static int zkocaml_delivery_fds[2] = { -1, -1 };
+static pthread_once_t zkocaml_delivery_once = PTHREAD_ONCE_INIT;
+
+static void
+zkocaml_delivery_init(void)
+{
+  size_t i = 0;
+  for (; i < ZKOCAML_RING_SIZE; i++) {
+    zkocaml_ring[i].seq = i;
+    zkocaml_ring[i].event = NULL;
+  }
+
+#ifdef __linux__
+  zkocaml_delivery_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  zkocaml_delivery_fds[1] = zkocaml_delivery_fds[0];
+#else
+  if (pipe(zkocaml_delivery_fds) == 0) {
+    fcntl(zkocaml_delivery_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(zkocaml_delivery_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(zkocaml_delivery_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(zkocaml_delivery_fds[1], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+}
+
+static int
+zkocaml_ring_push(zkocaml_event_t *event)
+{
+  zkocaml_ring_cell_t *cell;
+  size_t pos = __atomic_load_n(&zkocaml_ring_enqueue_pos, __ATOMIC_RELAXED);
+
+  for (;;) {
+    cell = &zkocaml_ring[pos & (ZKOCAML_RING_SIZE - 1)];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&zkocaml_ring_enqueue_pos, &pos,
+                                      pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&zkocaml_ring_enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->event = event;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static zkocaml_event_t *
+zkocaml_ring_pop(void)
+{
+  zkocaml_ring_cell_t *cell;
+  zkocaml_event_t *event;
+  size_t pos = __atomic_load_n(&zkocaml_ring_dequeue_pos, __ATOMIC_RELAXED);
+
+  for (;;) {
+    cell = &zkocaml_ring[pos & (ZKOCAML_RING_SIZE - 1)];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&zkocaml_ring_dequeue_pos, &pos,
+                                      pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (dif < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&zkocaml_ring_dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  event = cell->event;
+  __atomic_store_n(&cell->seq, pos + ZKOCAML_RING_SIZE, __ATOMIC_RELEASE);
+  return event;
+}
+
+/**
+ * Whether an event is waiting to be popped. Only the consumer may ask.
+ */
+static int
+zkocaml_ring_pending(void)
+{
+  size_t pos = __atomic_load_n(&zkocaml_ring_dequeue_pos, __ATOMIC_RELAXED);
+  zkocaml_ring_cell_t *cell = &zkocaml_ring[pos & (ZKOCAML_RING_SIZE - 1)];
+  return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/**
+ * Wake up the delivery fd, unless it has already been signalled and not
+ * drained since.
+ */
+static void
+zkocaml_delivery_signal(void)
+{
+  if (__atomic_exchange_n(&zkocaml_ring_signalled, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+#ifdef __linux__
+  uint64_t one = 1;
+  ssize_t n = write(zkocaml_delivery_fds[1], &one, sizeof(one));
+#else
+  char one = 1;
+  ssize_t n = write(zkocaml_delivery_fds[1], &one, sizeof(one));
+#endif
+  (void)n;
+}
+
+static void
+zkocaml_delivery_clear(void)
+{
+  __atomic_store_n(&zkocaml_ring_signalled, 0, __ATOMIC_RELEASE);
+#ifdef __linux__
+  uint64_t count;
+  ssize_t n = read(zkocaml_delivery_fds[0], &count, sizeof(count));
+#else
+  char buf[64];
+  ssize_t n;
+  while ((n = read(zkocaml_delivery_fds[0], buf, sizeof(buf))) > 0);
+#endif
+  (void)n;
+}
+
+/**
+ * Queue an event for zkocaml_drain_completions. When the ring is full the
+ * C client thread backs off until OCaml has drained some of it, which
+ * keeps events in order and throttles the C client instead of dropping
+ * replies.
+ */
+static void
+zkocaml_event_enqueue(zkocaml_event_t *event)
+{
+  while (!zkocaml_ring_push(event)) {
+    zkocaml_delivery_signal();
+    usleep(100);
+  }
+  zkocaml_delivery_signal();
+}
+
+static zkocaml_event_t *
+zkocaml_event_new(zkocaml_event_kind_t kind, int rc, const void *ctx)
+{
+  zkocaml_event_t *event = (zkocaml_event_t *)
+    calloc(1, sizeof(zkocaml_event_t));
+  event->kind = kind;
+  event->rc = rc;
+  event->ctx = (void *)ctx;
+  return event;
+}
+
+static void
+zkocaml_event_copy_val(zkocaml_event_t *event, const char *val, int val_len)
+{
+  if (val == NULL) return;
+  if (val_len < 0) val_len = strlen(val);
+  event->val = (char *)malloc(val_len + 1);
+  memcpy(event->val, val, val_len);
+  event->val[val_len] = '\0';
+  event->val_len = val_len;
+}
+
+static void
+zkocaml_event_copy_stat(zkocaml_event_t *event, const struct Stat *stat)
+{
+  if (stat == NULL) return;
+  event->stat = *stat;
+  event->has_stat = 1;
+}
+
+/**
+ * Deep copy a String_vector the C client only lends for the duration of
+ * a callback. Release the copy with deallocate_String_vector().
+ */
+static void
+zkocaml_copy_string_vector(struct String_vector *dst,
+                           const struct String_vector *src)
+{
+  int i = 0;
+  if (src == NULL || src->count <= 0) return;
+  dst->count = src->count;
+  dst->data = (char **)calloc(src->count, sizeof(char *));
+  for (; i < src->count; i++) {
+    dst->data[i] = strdup(src->data[i]);
+  }
+}
+
+static void
+zkocaml_event_copy_strings(zkocaml_event_t *event,
+                           const struct String_vector *strings)
+{
+  zkocaml_copy_string_vector(&event->strings, strings);
+}
+
+static void
+zkocaml_event_copy_acl(zkocaml_event_t *event, const struct ACL_vector *acl)
+{
+  int i = 0;
+  if (acl == NULL || acl->count <= 0) return;
+  event->acl.count = acl->count;
+  event->acl.data = (struct ACL *)calloc(acl->count, sizeof(struct ACL));
+  for (; i < acl->count; i++) {
+    event->acl.data[i].perms = acl->data[i].perms;
+    event->acl.data[i].id.scheme = strdup(acl->data[i].id.scheme);
+    event->acl.data[i].id.id = strdup(acl->data[i].id.id);
+  }
+}
+
+static void
+zkocaml_event_free(zkocaml_event_t *event)
+{
+  free(event->val);
+  deallocate_String_vector(&event->strings);
+  deallocate_String_vector(&event->strings_extra);
+  deallocate_ACL_vector(&event->acl);
+  free(event);
+}
+
+/**
+ * Raise again the exception a user callback raised, given the exception
+ * result a *_deliver function returned for it.
+ */
+static void
+zkocaml_reraise(value result)
+{
+  if (Is_exception_result(result)) caml_raise(Extract_exception(result));
+}
+
+/**
+ * The *_deliver functions convert a result to OCaml values and run the
+ * user callback. They are called with the runtime lock held, either from
+ * the matching *_dispatch function or from zkocaml_drain_completions.
+ * They release what the request held even if the callback raises, and
+ * return its result, which may be an exception result for the caller to
+ * raise again with zkocaml_reraise once it is done with the event.
+ */
+static value
+watcher_deliver(zhandle_t *zh,
+                int type,
+                int state,
+                const char *path,
+                void *watcher_ctx)
+{
+  CAMLparam0();
+  CAMLlocal1(watcher_callback);
+  CAMLlocal5(local_zh, local_type, local_state,
+             local_path, local_watcher_ctx);
+  CAMLlocalN(args, 5);
+  value result;
+
+  zkocaml_watcher_context_t *ctx =
+    (zkocaml_watcher_context_t* )(watcher_ctx);
+  watcher_callback = ctx->watcher_callback;
+  local_zh = zkocaml_copy_zhandle(ctx->id);
+  local_type = zkocaml_enum_event_c2ml(type);
+  local_state = zkocaml_enum_state_c2ml(state);
+  local_path = caml_copy_string(path != NULL ? path : "");
+  local_watcher_ctx = caml_copy_string(ctx->watcher_ctx);
+
+  args[0] = local_zh;
+  args[1] = local_type;
+  args[2] = local_state;
+  args[3] = local_path;
+  args[4] = local_watcher_ctx;
+
+  result = caml_callbackN_exn(watcher_callback, 5, args);
+
+  CAMLreturnT(value, result);
+}
+
+/**
+ * Session state transitions seen by the global watchers of all handles,
+ * indexed like ZOO_STATE_TABLE, and reconnects, that is every
+ * ZOO_CONNECTED_STATE of a handle after its first.
+ */
+static unsigned long
+zkocaml_session_transitions[zkocaml_table_len(ZOO_STATE_TABLE)];
+static unsigned long zkocaml_session_reconnects = 0;
+
+static void
+zkocaml_session_event(zkocaml_watcher_context_t *ctx, int state)
+{
+  int index = -1;
+
+  if (state == ZOO_EXPIRED_SESSION_STATE) {
+    index = ZOO_EXPIRED_SESSION_STATE_AUX;
+  } else if (state == ZOO_AUTH_FAILED_STATE) {
+    index = ZOO_AUTH_FAILED_STATE_AUX;
+  } else if (state == ZOO_CONNECTING_STATE) {
+    index = ZOO_CONNECTING_STATE_AUX;
+  } else if (state == ZOO_ASSOCIATING_STATE) {
+    index = ZOO_ASSOCIATING_STATE_AUX;
+  } else if (state == ZOO_CONNECTED_STATE) {
+    index = ZOO_CONNECTED_STATE_AUX;
+    if (__atomic_fetch_add(&ctx->connects, 1, __ATOMIC_RELAXED) > 0) {
+      __atomic_fetch_add(&zkocaml_session_reconnects, 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (index >= 0) {
+    __atomic_fetch_add(&zkocaml_session_transitions[index], 1,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+static void
+watcher_dispatch(zhandle_t *zh,
+                 int type,
+                 int state,
+                 const char *path,
+                 void *watcher_ctx)
+{
+  if (type == ZOO_SESSION_EVENT) {
+    zkocaml_session_event((zkocaml_watcher_context_t *)watcher_ctx, state);
+  }
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_WATCHER, 0, watcher_ctx);
+    event->zh = zh;
+    event->type = type;
+    event->state = state;
+    zkocaml_event_copy_val(event, path, -1);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(watcher_deliver(zh, type, state, path, watcher_ctx));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Path watches are multiplexed through one trie per handle. Each node of
+ * the trie holds a slot per watch kind, and every slot is registered with
+ * the C client under a single (watch_fanout_dispatch, slot) pair, so the
+ * server holds at most one watch per (path, kind) however many local
+ * subscribers there are. When the watch fires, the event is fanned out to
+ * all subscribers of the slot and the watch is re-armed once if any of
+ * them remain.
+ *
+ * Persistent and recursive watches (add_watch) hang off trie nodes
+ * instead of slots and keep the slots they need armed, see
+ * zkocaml_add_watch.
+ *
+ * The tries and the subscriber lists are only touched with
+ * zkocaml_watch_lock held, as on OCaml 5 every domain has a runtime lock
+ * of its own; the C client thread only clears a slot's armed flag and
+ * maintains the pending counts. The lock is never held across an OCaml
+ * allocation or callback, so that a domain waiting for it never holds up
+ * a collection. A node is freed once it is deleted at the server and
+ * nothing local refers to it any more, see zkocaml_watch_prune; the
+ * others are kept until the handle is closed.
+ */
+#define ZKOCAML_WATCH_DATA 0
+#define ZKOCAML_WATCH_CHILD 1
+#define ZKOCAML_WATCH_KINDS 2
+
+struct zkocaml_watch_slot_s_;
+
+/**
+ * A local watcher. Subscribers of a slot (slot set) see every event of
+ * that slot; one-shot ones are detached as soon as the slot fires, as a
+ * plain ZooKeeper watcher would be. Persistent watchers (node set) see
+ * the changes of their node, or of their whole subtree when recursive.
+ * All but one-shot subscribers stay until unsubscribed or until the
+ * handle is closed.
+ *
+ * References are held by the slot or node while attached, by an OCaml
+ * subscription value, by a read still settling the subscriber and by a
+ * fan-out in progress.
+ */
+typedef struct zkocaml_watch_subscriber_s_ {
+  value callback;
+  char *ctx;
+  int once;
+  int recursive;
+  int refs;
+  int arming;
+  int nonode_watched;
+  struct zkocaml_watch_slot_s_ *slot;
+  struct zkocaml_watch_node_s_ *node;
+  struct zkocaml_watch_subscriber_s_ *next;
+} zkocaml_watch_subscriber_t;
+
+typedef struct zkocaml_watch_slot_s_ {
+  struct zkocaml_watch_node_s_ *node;
+  int kind;
+  int armed;
+  int count;
+  zkocaml_watch_subscriber_t *subscribers;
+} zkocaml_watch_slot_t;
+
+/**
+ * A path of the trie. persistent counts the non-recursive persistent
+ * watchers of the node itself, recursive the recursive watchers of the
+ * node and all its ancestors. exists is the last known existence of the
+ * node, used to report each creation under a recursive watch only once.
+ * pending counts the requests and queued events of the C client that
+ * still point at the node or its slots. id is the id of the handle.
+ */
+typedef struct zkocaml_watch_node_s_ {
+  zhandle_t *zh;
+  unsigned long id;
+  char *path;
+  const char *name;
+  size_t name_len;
+  int persistent;
+  int recursive;
+  int exists;
+  int pending;
+  zkocaml_watch_subscriber_t *watchers;
+  struct zkocaml_watch_node_s_ *parent;
+  struct zkocaml_watch_node_s_ *children;
+  struct zkocaml_watch_node_s_ *sibling;
+  zkocaml_watch_slot_t slots[ZKOCAML_WATCH_KINDS];
+} zkocaml_watch_node_t;
+
+/**
+ * Create the root of a trie (parent NULL) or a child of parent.
+ */
+static zkocaml_watch_node_t *
+zkocaml_watch_node_new(zhandle_t *zh,
+                       unsigned long id,
+                       zkocaml_watch_node_t *parent,
+                       const char *name,
+                       size_t name_len)
+{
+  int kind = 0;
+  size_t prefix_len = parent == NULL || parent->parent == NULL ?
+    0 : strlen(parent->path);
+  zkocaml_watch_node_t *node = (zkocaml_watch_node_t *)
+    calloc(1, sizeof(zkocaml_watch_node_t));
+
+  node->zh = zh;
+  node->id = id;
+  node->parent = parent;
+  node->path = (char *)malloc(prefix_len + name_len + 2);
+  if (prefix_len > 0) memcpy(node->path, parent->path, prefix_len);
+  node->path[prefix_len] = '/';
+  memcpy(node->path + prefix_len + 1, name, name_len);
+  node->path[prefix_len + 1 + name_len] = '\0';
+  node->name = node->path + prefix_len + 1;
+  node->name_len = name_len;
+  if (parent != NULL) {
+    node->recursive = parent->recursive;
+    node->sibling = parent->children;
+    parent->children = node;
+  }
+  for (; kind < ZKOCAML_WATCH_KINDS; kind++) {
+    node->slots[kind].node = node;
+    node->slots[kind].kind = kind;
+  }
+  return node;
+}
+
+static zkocaml_watch_node_t *
+zkocaml_watch_child(zkocaml_watch_node_t *node,
+                    const char *name,
+                    size_t name_len,
+                    int create)
+{
+  zkocaml_watch_node_t *child = node->children;
+
+  while (child != NULL &&
+         (child->name_len != name_len ||
+          memcmp(child->name, name, name_len) != 0)) {
+    child = child->sibling;
+  }
+  if (child == NULL && create) {
+    child = zkocaml_watch_node_new(node->zh, node->id, node, name, name_len);
+  }
+  return child;
+}
+
+/**
+ * Find the trie node of a path, creating it and its ancestors when
+ * create is set. Returns NULL for a path the server would reject as
+ * malformed, or for a missing node when create is not set.
+ */
+static zkocaml_watch_node_t *
+zkocaml_watch_lookup(zkocaml_handle_t *zhandle, const char *path, int create)
+{
+  const char *segment = path + 1;
+  zkocaml_watch_node_t *node = NULL;
+
+  if (path[0] != '/') return NULL;
+  if (zhandle->watches == NULL) {
+    if (!create) return NULL;
+    zhandle->watches = zkocaml_watch_node_new(zhandle->handle, zhandle->id,
+                                              NULL, "", 0);
+  }
+  node = zhandle->watches;
+  if (*segment == '\0') return node;
+
+  while (node != NULL) {
+    const char *end = strchr(segment, '/');
+    size_t len = end != NULL ? (size_t)(end - segment) : strlen(segment);
+
+    if (len == 0) return NULL;
+    node = zkocaml_watch_child(node, segment, len, create);
+    if (end == NULL) break;
+    segment = end + 1;
+  }
+  return node;
+}
+
+/**
+ * Add delta to the recursive watch count of a node and its subtree.
+ */
+static void
+zkocaml_watch_add_recursive(zkocaml_watch_node_t *node, int delta)
+{
+  zkocaml_watch_node_t *child = node->children;
+
+  node->recursive += delta;
+  for (; child != NULL; child = child->sibling) {
+    zkocaml_watch_add_recursive(child, delta);
+  }
+}
+
+/**
+ * Subscriber references are counted atomically, as subscription values
+ * drop theirs from the finalizer, without zkocaml_watch_lock.
+ */
+static void
+zkocaml_watch_subscriber_ref(zkocaml_watch_subscriber_t *sub)
+{
+  __atomic_add_fetch(&sub->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+zkocaml_watch_subscriber_unref(zkocaml_watch_subscriber_t *sub)
+{
+  if (__atomic_sub_fetch(&sub->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+  caml_remove_generational_global_root(&sub->callback);
+  free(sub->ctx);
+  free(sub);
+}
+
+static zkocaml_watch_subscriber_t *
+zkocaml_watch_subscriber_new(value callback, value ctx)
+{
+  zkocaml_watch_subscriber_t *sub = (zkocaml_watch_subscriber_t *)
+    calloc(1, sizeof(zkocaml_watch_subscriber_t));
+
+  sub->callback = callback;
+  caml_register_generational_global_root(&sub->callback);
+  sub->ctx = zkocaml_copy_string_val(ctx);
+  sub->refs = 1;
+  return sub;
+}
+
+/**
+ * Unlink the subscriber *link points at from its slot or node and drop
+ * the reference the slot or node held.
+ */
+static void
+zkocaml_watch_unlink(zkocaml_watch_subscriber_t **link)
+{
+  zkocaml_watch_subscriber_t *sub = *link;
+
+  *link = sub->next;
+  if (sub->slot != NULL) sub->slot->count--;
+  sub->slot = NULL;
+  sub->node = NULL;
+  sub->next = NULL;
+  zkocaml_watch_subscriber_unref(sub);
+}
+
+static void
+zkocaml_watch_detach(zkocaml_watch_subscriber_t *sub)
+{
+  zkocaml_watch_node_t *node = sub->node;
+  zkocaml_watch_subscriber_t **link = NULL;
+
+  if (sub->slot != NULL) {
+    link = &sub->slot->subscribers;
+  } else if (node != NULL) {
+    if (sub->recursive) zkocaml_watch_add_recursive(node, -1);
+    else node->persistent--;
+    link = &node->watchers;
+  } else {
+    return;
+  }
+  while (*link != sub) link = &(*link)->next;
+  zkocaml_watch_unlink(link);
+}
+
+/**
+ * Release the trie of a closed handle. Subscribers still attached are
+ * detached, so that unsubscribing them later is harmless.
+ */
+static void
+zkocaml_watch_tree_free(zkocaml_watch_node_t *node)
+{
+  int kind = 0;
+
+  while (node != NULL) {
+    zkocaml_watch_node_t *sibling = node->sibling;
+    zkocaml_watch_tree_free(node->children);
+    for (kind = 0; kind < ZKOCAML_WATCH_KINDS; kind++) {
+      while (node->slots[kind].subscribers != NULL) {
+        zkocaml_watch_unlink(&node->slots[kind].subscribers);
+      }
+    }
+    while (node->watchers != NULL) zkocaml_watch_unlink(&node->watchers);
+    free(node->path);
+    free(node);
+    node = sibling;
+  }
+}
+
+/**
+ * Take the right to arm a slot. Only the caller that flips the armed flag
+ * sends a watching request; everyone else reads without a watch.
+ */
+static int
+zkocaml_watch_claim(zkocaml_watch_slot_t *slot)
+{
+  int expected = 0;
+  return __atomic_compare_exchange_n(&slot->armed, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void
+zkocaml_watch_disarm(zkocaml_watch_slot_t *slot)
+{
+  __atomic_store_n(&slot->armed, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Whether a slot should have a watch at the server.
+ */
+static int
+zkocaml_watch_wanted(zkocaml_watch_slot_t *slot)
+{
+  return slot->subscribers != NULL ||
+         slot->node->persistent > 0 ||
+         slot->node->recursive > 0;
+}
+
+/**
+ * Whether anything attached to the node itself, rather than a recursive
+ * watch of an ancestor, wants to hear about it.
+ */
+static int
+zkocaml_watch_own(zkocaml_watch_node_t *node)
+{
+  return node->watchers != NULL ||
+         node->slots[ZKOCAML_WATCH_DATA].subscribers != NULL ||
+         node->slots[ZKOCAML_WATCH_CHILD].subscribers != NULL;
+}
+
+static void
+zkocaml_watch_pin(zkocaml_watch_node_t *node)
+{
+  __atomic_add_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+static void
+zkocaml_watch_unpin(zkocaml_watch_node_t *node)
+{
+  __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Free a node known not to exist that nothing refers to any more: no
+ * subscriber, no children in the trie, no watch at the server and no
+ * request or event in flight. Its ancestors follow while the same holds
+ * for them. Without this, every node deleted under a recursive watch
+ * would stay in the trie until the handle is closed.
+ */
+static void
+zkocaml_watch_prune(zkocaml_watch_node_t *node)
+{
+  while (node->parent != NULL &&
+         !node->exists &&
+         node->children == NULL &&
+         !zkocaml_watch_own(node) &&
+         !__atomic_load_n(&node->slots[ZKOCAML_WATCH_DATA].armed,
+                          __ATOMIC_ACQUIRE) &&
+         !__atomic_load_n(&node->slots[ZKOCAML_WATCH_CHILD].armed,
+                          __ATOMIC_ACQUIRE) &&
+         __atomic_load_n(&node->pending, __ATOMIC_ACQUIRE) == 0) {
+    zkocaml_watch_node_t *parent = node->parent;
+    zkocaml_watch_node_t **link = &parent->children;
+
+    while (*link != node) link = &(*link)->sibling;
+    *link = node->sibling;
+    free(node->path);
+    free(node);
+    node = parent;
+  }
+}
+
+static void watch_fanout_dispatch(zhandle_t *zh, int type, int state,
+                                  const char *path, void *watcher_ctx);
+
+/**
+ * Completions of the requests that re-arm a slot on their own. They run
+ * on the C client thread and only record a failure to set the watch.
+ */
+static void
+watch_arm_stat_completion(int rc, const struct Stat *stat, const void *data)
+{
+  zkocaml_watch_slot_t *slot = (zkocaml_watch_slot_t *)data;
+
+  if (rc != ZOK && rc != ZNONODE) zkocaml_watch_disarm(slot);
+  zkocaml_watch_unpin(slot->node);
+}
+
+static void
+watch_arm_strings_completion(int rc,
+                             const struct String_vector *strings,
+                             const void *data)
+{
+  zkocaml_watch_slot_t *slot = (zkocaml_watch_slot_t *)data;
+
+  if (rc != ZOK) zkocaml_watch_disarm(slot);
+  zkocaml_watch_unpin(slot->node);
+}
+
+/**
+ * A children listing of a node under a recursive watch, used to find the
+ * nodes the recursive watch must cover. A quiet listing covers an
+ * existing subtree when the watch is added and reports nothing; the
+ * others report every child they find for the first time as created.
+ */
+typedef struct zkocaml_watch_listing_s_ {
+  zkocaml_watch_slot_t *slot;
+  int quiet;
+  int arming;
+} zkocaml_watch_listing_t;
+
+static void
+watch_listing_completion(int rc,
+                         const struct String_vector *strings,
+                         const void *data);
+
+/**
+ * List the children of the children slot of a node, setting the slot's
+ * watch as well when arming is set.
+ */
+static int
+zkocaml_watch_list(zkocaml_watch_slot_t *slot, int quiet, int arming)
+{
+  int rc;
+  zkocaml_watch_node_t *node = slot->node;
+  zkocaml_watch_listing_t *listing = (zkocaml_watch_listing_t *)
+    malloc(sizeof(zkocaml_watch_listing_t));
+
+  listing->slot = slot;
+  listing->quiet = quiet;
+  listing->arming = arming;
+  zkocaml_watch_pin(node);
+  if (arming) {
+    rc = zoo_awget_children(node->zh, node->path, watch_fanout_dispatch, slot,
+                            watch_listing_completion, listing);
+  } else {
+    rc = zoo_aget_children(node->zh, node->path, 0,
+                           watch_listing_completion, listing);
+  }
+  if (rc != ZOK) {
+    if (arming) zkocaml_watch_disarm(slot);
+    zkocaml_watch_unpin(node);
+    free(listing);
+  }
+  return rc;
+}
+
+/**
+ * Make sure a slot that is wanted has a watch at the server. Data slots
+ * are armed with exists, which also watches a node that does not exist
+ * yet; children slots can only be armed on an existing node, and list
+ * the children of nodes under a recursive watch on the way.
+ */
+static int
+zkocaml_watch_arm(zkocaml_watch_slot_t *slot)
+{
+  int rc = ZOK;
+  zkocaml_watch_node_t *node = slot->node;
+
+  if (!zkocaml_watch_wanted(slot) || !zkocaml_watch_claim(slot)) return ZOK;
+  if (slot->kind == ZKOCAML_WATCH_CHILD && node->recursive > 0) {
+    return zkocaml_watch_list(slot, 0, 1);
+  }
+  zkocaml_watch_pin(node);
+  if (slot->kind == ZKOCAML_WATCH_DATA) {
+    rc = zoo_awexists(node->zh, node->path, watch_fanout_dispatch, slot,
+                      watch_arm_stat_completion, slot);
+  } else {
+    rc = zoo_awget_children(node->zh, node->path, watch_fanout_dispatch, slot,
+                            watch_arm_strings_completion, slot);
+  }
+  if (rc != ZOK) {
+    zkocaml_watch_disarm(slot);
+    zkocaml_watch_unpin(node);
+  }
+  return rc;
+}
+
+/**
+ * Bring a node under a recursive watch: arm both of its slots and list
+ * its children, whether or not the children slot was armed already.
+ */
+static int
+zkocaml_watch_cover(zkocaml_watch_node_t *node, int quiet)
+{
+  zkocaml_watch_slot_t *slot = &node->slots[ZKOCAML_WATCH_CHILD];
+  int rc = zkocaml_watch_arm(&node->slots[ZKOCAML_WATCH_DATA]);
+  int list_rc = zkocaml_watch_list(slot, quiet, zkocaml_watch_claim(slot));
+
+  return rc != ZOK ? rc : list_rc;
+}
+
+static zkocaml_watch_subscriber_t *
+zkocaml_watch_subscribe_slot(zkocaml_watch_slot_t *slot,
+                             value callback,
+                             value ctx,
+                             int once)
+{
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_subscriber_new(callback, ctx);
+
+  sub->once = once;
+  sub->slot = slot;
+  sub->next = slot->subscribers;
+  slot->subscribers = sub;
+  slot->count++;
+  return sub;
+}
+
+/**
+ * Subscribe the watcher of a w* read to its (path, kind) slot. The read
+ * carries the watch itself only when sub->arming is set; otherwise the
+ * slot is already armed and the read goes out without a watch. Returns
+ * NULL for a malformed path, which the read then reports, and for a
+ * closed handle, whose trie is gone and which the read fails with
+ * ZINVALIDSTATE.
+ *
+ * nonode_watched tells whether a ZNONODE reply still leaves a watch, as
+ * it does for exists. The caller holds a reference until
+ * zkocaml_watch_settle.
+ */
+static zkocaml_watch_subscriber_t *
+zkocaml_watch_begin(zkocaml_handle_t *zhandle,
+                    const char *path,
+                    int kind,
+                    value callback,
+                    value ctx,
+                    int nonode_watched)
+{
+  zkocaml_watch_node_t *node = NULL;
+  zkocaml_watch_subscriber_t *sub = NULL;
+
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  if (zhandle->handle != NULL) node = zkocaml_watch_lookup(zhandle, path, 1);
+  if (node != NULL) {
+    sub = zkocaml_watch_subscribe_slot(&node->slots[kind], callback, ctx, 1);
+    zkocaml_watch_subscriber_ref(sub);
+    sub->nonode_watched = nonode_watched;
+    sub->arming = zkocaml_watch_claim(sub->slot);
+  }
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  return sub;
+}
+
+/**
+ * Settle a subscriber once its read has returned rc. A read that set no
+ * watch detaches the subscriber, as the C client would never have called
+ * it, and a failed arming read hands the slot back so that the remaining
+ * subscribers get a watch of their own.
+ */
+static void
+zkocaml_watch_settle(zkocaml_watch_subscriber_t *sub, int rc)
+{
+  zkocaml_watch_slot_t *slot = NULL;
+
+  if (sub == NULL) return;
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  slot = sub->slot;
+  if (slot != NULL && rc != ZOK && !(rc == ZNONODE && sub->nonode_watched)) {
+    if (sub->arming) zkocaml_watch_disarm(slot);
+    zkocaml_watch_detach(sub);
+    zkocaml_watch_arm(slot);
+  }
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  zkocaml_watch_subscriber_unref(sub);
+}
+
+static void
+zkocaml_completion_settle_watch(zkocaml_completion_context_t *ctx, int rc)
+{
+  zkocaml_watch_settle((zkocaml_watch_subscriber_t *)ctx->payload, rc);
+  ctx->payload = NULL;
+}
+
+/**
+ * The watchers one event is delivered to, each holding a reference for
+ * the duration of the fan-out.
+ */
+typedef struct zkocaml_watch_batch_s_ {
+  zkocaml_watch_subscriber_t **subs;
+  int count;
+  int capacity;
+} zkocaml_watch_batch_t;
+
+static void
+zkocaml_watch_batch_add(zkocaml_watch_batch_t *batch,
+                        zkocaml_watch_subscriber_t *sub)
+{
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity > 0 ? 2 * batch->capacity : 8;
+    batch->subs = (zkocaml_watch_subscriber_t **)
+      realloc(batch->subs,
+              batch->capacity * sizeof(zkocaml_watch_subscriber_t *));
+  }
+  zkocaml_watch_subscriber_ref(sub);
+  batch->subs[batch->count++] = sub;
+}
+
+/**
+ * Add the persistent watchers an event of a slot of node concerns: data
+ * events go to the watchers of the node and to the recursive watchers
+ * of its ancestors, children events only to the non-recursive watchers
+ * of the node, as with ZooKeeper 3.6.
+ */
+static void
+zkocaml_watch_batch_add_persistent(zkocaml_watch_batch_t *batch,
+                                   zkocaml_watch_node_t *node,
+                                   int kind,
+                                   int type)
+{
+  zkocaml_watch_node_t *n = node;
+  zkocaml_watch_subscriber_t *sub = NULL;
+
+  if (kind == ZKOCAML_WATCH_CHILD) {
+    if (type != ZOO_CHILD_EVENT) return;
+    for (sub = node->watchers; sub != NULL; sub = sub->next) {
+      if (!sub->recursive) zkocaml_watch_batch_add(batch, sub);
+    }
+    return;
+  }
+  for (; n != NULL; n = n->parent) {
+    for (sub = n->watchers; sub != NULL; sub = sub->next) {
+      if (n == node || sub->recursive) zkocaml_watch_batch_add(batch, sub);
+    }
+  }
+}
+
+/**
+ * Run every watcher of a batch with one event and release the batch.
+ * A watcher unsubscribed by an earlier callback of the same batch is
+ * skipped; one-shot subscribers detached by the event itself are not.
+ * A watcher that raises stops the batch, which is released all the same,
+ * and its exception result is returned.
+ */
+static value
+zkocaml_watch_batch_run(zkocaml_watch_batch_t *batch,
+                        unsigned long id,
+                        int type,
+                        int state,
+                        const char *path)
+{
+  CAMLparam0();
+  CAMLlocal5(local_zh, local_type, local_state,
+             local_path, local_watcher_ctx);
+  CAMLlocalN(args, 5);
+  value result = Val_unit;
+
+  int i = 0;
+
+  if (batch->count > 0) {
+    local_zh = zkocaml_copy_zhandle(id);
+    local_type = zkocaml_enum_event_c2ml(type);
+    local_state = zkocaml_enum_state_c2ml(state);
+    local_path = caml_copy_string(path != NULL ? path : "");
+  }
+  for (; i < batch->count; i++) {
+    zkocaml_watch_subscriber_t *sub = batch->subs[i];
+    int detached;
+    pthread_mutex_lock(&zkocaml_watch_lock);
+    detached = sub->slot == NULL && sub->node == NULL && !sub->once;
+    pthread_mutex_unlock(&zkocaml_watch_lock);
+    if (detached) continue;
+    local_watcher_ctx = caml_copy_string(sub->ctx);
+    args[0] = local_zh;
+    args[1] = local_type;
+    args[2] = local_state;
+    args[3] = local_path;
+    args[4] = local_watcher_ctx;
+    result = caml_callbackN_exn(sub->callback, 5, args);
+    if (Is_exception_result(result)) break;
+  }
+  for (i = 0; i < batch->count; i++) {
+    zkocaml_watch_subscriber_unref(batch->subs[i]);
+  }
+  free(batch->subs);
+
+  CAMLreturnT(value, result);
+}
+
+/**
+ * Runs every watcher concerned by one event of a slot, returning the
+ * result of the batch. Subscribers that come or go during the fan-out
+ * only take effect from the next event.
+ *
+ * Data events also keep the existence of the node up to date, so that a
+ * creation already reported from a children listing is not reported to
+ * persistent watchers a second time.
+ *
+ * A deleted node is watched again only when something of its own still
+ * wants it: under a recursive watch alone, its re-creation is found from
+ * the children listing of its parent instead, and the node is pruned.
+ */
+static value
+watch_fanout_deliver(zhandle_t *zh,
+                     int type,
+                     int state,
+                     const char *path,
+                     zkocaml_watch_slot_t *slot)
+{
+  int fired = type != ZOO_SESSION_EVENT || state == ZOO_EXPIRED_SESSION_STATE;
+  int notify = 0;
+  zkocaml_watch_node_t *node = slot->node;
+  unsigned long id = node->id;
+  zkocaml_watch_batch_t batch = { NULL, 0, 0 };
+  zkocaml_watch_subscriber_t **link = &slot->subscribers;
+
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  while (*link != NULL) {
+    zkocaml_watch_subscriber_t *sub = *link;
+    zkocaml_watch_batch_add(&batch, sub);
+    if (fired && sub->once) zkocaml_watch_unlink(link);
+    else link = &sub->next;
+  }
+  if (fired && type != ZOO_SESSION_EVENT &&
+      (type != ZOO_DELETED_EVENT ||
+       (slot->kind == ZKOCAML_WATCH_DATA && zkocaml_watch_own(node)))) {
+    zkocaml_watch_arm(slot);
+  }
+
+  if (slot->kind == ZKOCAML_WATCH_CHILD) {
+    notify = type == ZOO_CHILD_EVENT;
+  } else if (type == ZOO_CREATED_EVENT) {
+    notify = !node->exists;
+    node->exists = 1;
+    zkocaml_watch_arm(&node->slots[ZKOCAML_WATCH_CHILD]);
+  } else if (type == ZOO_DELETED_EVENT || type == ZOO_CHANGED_EVENT) {
+    notify = 1;
+    node->exists = type == ZOO_CHANGED_EVENT;
+  }
+  if (notify) {
+    zkocaml_watch_batch_add_persistent(&batch, node, slot->kind, type);
+  }
+
+  zkocaml_watch_unpin(node);
+  if (type == ZOO_DELETED_EVENT) zkocaml_watch_prune(node);
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+
+  return zkocaml_watch_batch_run(&batch, id, type, state, path);
+}
+
+/**
+ * The watcher every slot is registered with. Runs on the C client thread.
+ */
+static void
+watch_fanout_dispatch(zhandle_t *zh,
+                      int type,
+                      int state,
+                      const char *path,
+                      void *watcher_ctx)
+{
+  zkocaml_watch_slot_t *slot = (zkocaml_watch_slot_t *)watcher_ctx;
+
+  zkocaml_watch_pin(slot->node);
+  if (type != ZOO_SESSION_EVENT || state == ZOO_EXPIRED_SESSION_STATE) {
+    zkocaml_watch_disarm(slot);
+  }
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_WATCH_FANOUT, 0, slot);
+    event->zh = zh;
+    event->type = type;
+    event->state = state;
+    zkocaml_event_copy_val(event, path, -1);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(watch_fanout_deliver(zh, type, state, path, slot));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Takes in the children of a node under a recursive watch. Children seen
+ * for the first time are covered in turn and, unless the listing is
+ * quiet, reported as created to the recursive watchers above them. Drops
+ * the hold the listing had on the node, even when a watcher raises, which
+ * stops the listing.
+ */
+static value
+watch_listing_deliver(zkocaml_watch_node_t *node,
+                      const struct String_vector *strings,
+                      int quiet)
+{
+  int i = 0;
+  zhandle_t *zh = node->zh;
+  unsigned long id = node->id;
+  value result = Val_unit;
+
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  for (; i < strings->count && node->recursive > 0; i++) {
+    const char *name = strings->data[i];
+    zkocaml_watch_node_t *child =
+      zkocaml_watch_child(node, name, strlen(name), 1);
+    int created = !child->exists;
+    zkocaml_watch_batch_t batch = { NULL, 0, 0 };
+    char *path = NULL;
+
+    if (!quiet && !created) continue;
+    child->exists = 1;
+    zkocaml_watch_cover(child, quiet);
+    if (quiet) continue;
+    zkocaml_watch_batch_add_persistent(&batch, child, ZKOCAML_WATCH_DATA,
+                                       ZOO_CREATED_EVENT);
+    path = strdup(child->path);
+    pthread_mutex_unlock(&zkocaml_watch_lock);
+    result = zkocaml_watch_batch_run(&batch, id, ZOO_CREATED_EVENT,
+                                     zoo_state(zh), path);
+    free(path);
+    pthread_mutex_lock(&zkocaml_watch_lock);
+    if (Is_exception_result(result)) break;
+  }
+  zkocaml_watch_unpin(node);
+  zkocaml_watch_prune(node);
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  return result;
+}
+
+static void
+watch_listing_completion(int rc,
+                         const struct String_vector *strings,
+                         const void *data)
+{
+  zkocaml_watch_listing_t *listing = (zkocaml_watch_listing_t *)data;
+  zkocaml_watch_node_t *node = listing->slot->node;
+  int quiet = listing->quiet;
+
+  if (rc != ZOK && listing->arming) zkocaml_watch_disarm(listing->slot);
+  free(listing);
+  if (rc != ZOK || strings == NULL || strings->count == 0) {
+    zkocaml_watch_unpin(node);
+    return;
+  }
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_WATCH_LISTING, ZOK, node);
+    event->type = quiet;
+    zkocaml_event_copy_strings(event, strings);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(watch_listing_deliver(node, strings, quiet));
+  zkocaml_leave_callback();
+}
+
+#define zkocaml_watch_subscription_val(v) \
+  (*((zkocaml_watch_subscriber_t **) Data_custom_val(v)))
+
+static void
+zkocaml_watch_subscription_finalize(value v)
+{
+  zkocaml_watch_subscriber_unref(zkocaml_watch_subscription_val(v));
+}
+
+static struct custom_operations zkocaml_watch_subscription_ops = {
+  "org.apache.zookeeper.watch_subscription",
+  zkocaml_watch_subscription_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+/**
+ * Wrap a subscriber in a subscription value, which takes over a reference
+ * the caller took while it held zkocaml_watch_lock.
+ */
+static value
+zkocaml_copy_watch_subscription(zkocaml_watch_subscriber_t *sub)
+{
+  CAMLparam0();
+  CAMLlocal1(v);
+
+  v = caml_alloc_custom(&zkocaml_watch_subscription_ops,
+                        sizeof(zkocaml_watch_subscriber_t *), 0, 1);
+  zkocaml_watch_subscription_val(v) = sub;
+
+  CAMLreturn(v);
+}
+
+static int
+zkocaml_enum_watch_kind_ml2c(value v)
+{
+  return Int_val(v) == 0 ? ZKOCAML_WATCH_DATA : ZKOCAML_WATCH_CHILD;
+}
+
+/**
+ * Find or create the trie node of path, raising Invalid_argument fn for a
+ * closed handle or a malformed path. Returns with zkocaml_watch_lock held.
+ */
+static zkocaml_watch_node_t *
+zkocaml_watch_node_val(value zh, value path, const char *fn)
+{
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  zkocaml_watch_node_t *node = NULL;
+
+  if (zhandle->handle == NULL) caml_invalid_argument(fn);
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  node = zkocaml_watch_lookup(zhandle, String_val(path), 1);
+  if (node == NULL) {
+    pthread_mutex_unlock(&zkocaml_watch_lock);
+    caml_invalid_argument(fn);
+  }
+  return node;
+}
+
+/**
+ * Subscribes a watcher to the data or children watch of a path until it
+ * is unsubscribed or the handle is closed.
+ *
+ * The watcher is called for every event of the watch, and the watch is
+ * re-armed at the server after each one. Subscribing to a slot that is
+ * already armed sends nothing to the server. A children watch can only
+ * be armed while the node exists.
+ *
+ * @return the error of submitting the arming request, if one was needed,
+ * and the subscription.
+ */
+CAMLprim value
+zkocaml_watch_subscribe(value zh,
+                        value path,
+                        value kind,
+                        value watcher_callback,
+                        value watcher_ctx)
+{
+  CAMLparam5(zh, path, kind, watcher_callback, watcher_ctx);
+  CAMLlocal3(result, error, subscription);
+
+  zkocaml_watch_node_t *node =
+    zkocaml_watch_node_val(zh, path, "Zookeeper.watch_subscribe");
+  zkocaml_watch_subscriber_t *sub = zkocaml_watch_subscribe_slot(
+      &node->slots[zkocaml_enum_watch_kind_ml2c(kind)],
+      watcher_callback, watcher_ctx, 0);
+  int rc = zkocaml_watch_arm(sub->slot);
+
+  zkocaml_watch_subscriber_ref(sub);
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  subscription = zkocaml_copy_watch_subscription(sub);
+  error = zkocaml_enum_error_c2ml(rc);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, subscription);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Adds a persistent watch on a path, in the manner of ZooKeeper 3.6
+ * addWatch.
+ *
+ * A ZOO_ADD_WATCH_PERSISTENT watcher is called for every creation,
+ * deletion and data change of the node and every change to its children,
+ * and is not removed when it fires. A ZOO_ADD_WATCH_PERSISTENT_RECURSIVE
+ * watcher is called for every creation, deletion and data change of the
+ * node and of all its descendants, without children events.
+ *
+ * The C client this binds does not have addWatch, so both are emulated
+ * on top of the watch multiplexer: the slots the watch needs are kept
+ * armed, and a recursive watch lists the children of every node it
+ * covers to find new nodes, which it reports as created. Registering a
+ * recursive watch therefore reads the whole subtree once.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the node to watch. It does not need to exist.
+ *
+ * @mode ZOO_ADD_WATCH_PERSISTENT or ZOO_ADD_WATCH_PERSISTENT_RECURSIVE.
+ *
+ * @watcher_callback called for every event the watch covers.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ *
+ * @return the error of submitting the first request that failed to be
+ * submitted, and the subscription. Remove the watch with
+ * watch_unsubscribe or remove_watches.
+ */
+CAMLprim value
+zkocaml_add_watch(value zh,
+                  value path,
+                  value mode,
+                  value watcher_callback,
+                  value watcher_ctx)
+{
+  CAMLparam5(zh, path, mode, watcher_callback, watcher_ctx);
+  CAMLlocal3(result, error, subscription);
+
+  zkocaml_watch_node_t *node =
+    zkocaml_watch_node_val(zh, path, "Zookeeper.add_watch");
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_subscriber_new(watcher_callback, watcher_ctx);
+  int rc = ZOK, child_rc = ZOK;
+
+  sub->recursive = Int_val(mode) == 1;
+  sub->node = node;
+  sub->next = node->watchers;
+  node->watchers = sub;
+  if (sub->recursive) {
+    zkocaml_watch_add_recursive(node, 1);
+    rc = zkocaml_watch_cover(node, 1);
+  } else {
+    node->persistent++;
+    rc = zkocaml_watch_arm(&node->slots[ZKOCAML_WATCH_DATA]);
+    child_rc = zkocaml_watch_arm(&node->slots[ZKOCAML_WATCH_CHILD]);
+    if (rc == ZOK) rc = child_rc;
+  }
+
+  zkocaml_watch_subscriber_ref(sub);
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  subscription = zkocaml_copy_watch_subscription(sub);
+  error = zkocaml_enum_error_c2ml(rc);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, subscription);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Removes every persistent and recursive watch added on a path.
+ *
+ * The server watches stay until they next fire and are then only
+ * re-armed if other watchers still need them.
+ *
+ * @return ZOK, or ZNOTHING when no watch was added on the path.
+ */
+CAMLprim value
+zkocaml_remove_watches(value zh, value path)
+{
+  CAMLparam2(zh, path);
+
+  zkocaml_watch_node_t *node = NULL;
+  int rc;
+
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  node = zkocaml_watch_lookup(zkocaml_handle_struct_val(zh),
+                              String_val(path), 0);
+  rc = node != NULL && node->watchers != NULL ? ZOK : ZNOTHING;
+  while (node != NULL && node->watchers != NULL) {
+    zkocaml_watch_detach(node->watchers);
+  }
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+}
+
+/**
+ * Stops calling a subscriber. The server watch stays until it next fires
+ * and is then only re-armed if other subscribers remain.
+ */
+CAMLprim value
+zkocaml_watch_unsubscribe(value subscription)
+{
+  CAMLparam1(subscription);
+
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  zkocaml_watch_detach(zkocaml_watch_subscription_val(subscription));
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+
+  CAMLreturn(Val_unit);
+}
+
+static void
+zkocaml_watch_count(zkocaml_watch_node_t *node, long *counts)
+{
+  int kind = 0;
+  zkocaml_watch_subscriber_t *sub = NULL;
+
+  for (; node != NULL; node = node->sibling) {
+    counts[0]++;
+    for (kind = 0; kind < ZKOCAML_WATCH_KINDS; kind++) {
+      if (__atomic_load_n(&node->slots[kind].armed, __ATOMIC_ACQUIRE)) {
+        counts[1]++;
+      }
+      counts[2] += node->slots[kind].count;
+    }
+    for (sub = node->watchers; sub != NULL; sub = sub->next) counts[2]++;
+    zkocaml_watch_count(node->children, counts);
+  }
+}
+
+/**
+ * Returns the number of paths in the watch trie of a handle, of watches
+ * armed at the server and of local watchers.
+ */
+CAMLprim value
+zkocaml_watch_stats(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  long counts[3] = { 0, 0, 0 };
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  zkocaml_watch_count(zkocaml_handle_struct_val(zh)->watches, counts);
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, Val_long(counts[0]));
+  Store_field(result, 1, Val_long(counts[1]));
+  Store_field(result, 2, Val_long(counts[2]));
+
+  CAMLreturn(result);
+}
+
+/**
+ * Returns the client-wide counters that are not per operation: the number
+ * of open handles, the session state transitions and reconnects seen so
+ * far, and the watch counters of zkocaml_watch_stats summed over all open
+ * handles.
+ */
+CAMLprim value
+zkocaml_client_metrics(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal4(result, transitions, transition, watches);
+
+  long handles = 0, counts[3] = { 0, 0, 0 };
+  int i = 0;
+  zkocaml_handle_t *zhandle = NULL;
+
+  pthread_mutex_lock(&zkocaml_handles_lock);
+  pthread_mutex_lock(&zkocaml_watch_lock);
+  for (zhandle = zkocaml_handles; zhandle != NULL; zhandle = zhandle->next) {
+    handles++;
+    zkocaml_watch_count(zhandle->watches, counts);
+  }
+  pthread_mutex_unlock(&zkocaml_watch_lock);
+  pthread_mutex_unlock(&zkocaml_handles_lock);
+
+  transitions = caml_alloc(zkocaml_table_len(ZOO_STATE_TABLE), 0);
+  for (; i < zkocaml_table_len(ZOO_STATE_TABLE); i++) {
+    transition = caml_alloc(2, 0);
+    Store_field(transition, 0, Val_int(i));
+    Store_field(transition, 1,
+                Val_long(__atomic_load_n(&zkocaml_session_transitions[i],
+                                         __ATOMIC_RELAXED)));
+    Store_field(transitions, i, transition);
+  }
+
+  watches = caml_alloc(3, 0);
+  Store_field(watches, 0, Val_long(counts[0]));
+  Store_field(watches, 1, Val_long(counts[1]));
+  Store_field(watches, 2, Val_long(counts[2]));
+
+  result = caml_alloc(4, 0);
+  Store_field(result, 0, Val_long(handles));
+  Store_field(result, 1, transitions);
+  Store_field(result, 2,
+              Val_long(__atomic_load_n(&zkocaml_session_reconnects,
+                                       __ATOMIC_RELAXED)));
+  Store_field(result, 3, watches);
+
+  CAMLreturn(result);
+}
+
+/**
+ * The completion callbacks (from asynchronous calls) are
+ * implemented similarly.
+ */
+
+/**
+ * Called when an asynchronous call that returns void completes and
+ * dispatches user provided callback
+ */
+static value
+void_completion_deliver(int rc, const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal2(local_rc, local_data);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, NULL, 0);
+  completion_callback = ctx->completion_callback;
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  result = caml_callback2_exn(completion_callback, local_rc, local_data);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+void_completion_dispatch(int rc, const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_enqueue(zkocaml_event_new(ZKOCAML_EVENT_VOID, rc, data));
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(void_completion_deliver(rc, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a stat structure
+ * completes and dispatches user provided callback
+ */
+static value
+stat_completion_deliver(int rc,
+                        const struct Stat *stat,
+                        const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_stat, local_data);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, stat, 0);
+  completion_callback = ctx->completion_callback;
+  zkocaml_completion_settle_watch(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  result = caml_callback3_exn(completion_callback, local_rc, local_stat,
+                              local_data);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+stat_completion_dispatch(int rc,
+                         const struct Stat *stat,
+                         const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event = zkocaml_event_new(ZKOCAML_EVENT_STAT, rc, data);
+    zkocaml_event_copy_stat(event, stat);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(stat_completion_deliver(rc, stat, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a stat structure and
+ * some untyped data completes and dispatches user provided
+ * callback (used by aget)
+ */
+static value
+data_completion_deliver(int rc,
+                        const char *val,
+                        int val_len,
+                        const struct Stat *stat,
+                        const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal5(local_rc, local_val, local_val_len, local_stat, local_data);
+  CAMLlocalN(args, 5);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, stat, val_len);
+  completion_callback = ctx->completion_callback;
+  zkocaml_completion_settle_watch(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_val = zkocaml_copy_buffer(val, val_len);
+  local_val_len = Val_int(val_len);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  args[0] = local_rc;
+  args[1] = local_val;
+  args[2] = local_val_len;
+  args[3] = local_stat;
+  args[4] = local_data;
+
+  result = caml_callbackN_exn(completion_callback, 5, args);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+data_completion_dispatch(int rc,
+                         const char *val,
+                         int val_len,
+                         const struct Stat *stat,
+                         const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, rc == ZOK ? val_len : 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event = zkocaml_event_new(ZKOCAML_EVENT_DATA, rc, data);
+    zkocaml_event_copy_val(event, val, val_len < 0 ? 0 : val_len);
+    event->val_len = val_len;
+    zkocaml_event_copy_stat(event, stat);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(data_completion_deliver(rc, val, val_len, stat, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of strings
+ * completes and dispatches user provided callback.
+ */
+static value
+strings_completion_deliver(int rc,
+                           const struct String_vector *strings,
+                           const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_strings, local_data);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, NULL, 0);
+  completion_callback = ctx->completion_callback;
+  zkocaml_completion_settle_watch(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_strings = zkocaml_build_strings_struct(strings);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  result = caml_callback3_exn(completion_callback, local_rc, local_strings,
+                              local_data);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+strings_completion_dispatch(int rc,
+                            const struct String_vector *strings,
+                            const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_STRINGS, rc, data);
+    zkocaml_event_copy_strings(event, strings);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(strings_completion_deliver(rc, strings, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of strings
+ * and a stat structure completes and dispatches user provided callback.
+ */
+static value
+strings_stat_completion_deliver(int rc,
+                                const struct String_vector *strings,
+                                const struct Stat *stat,
+                                const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal4(local_rc, local_strings, local_stat, local_data);
+  CAMLlocalN(args, 4);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, stat, 0);
+  completion_callback = ctx->completion_callback;
+  zkocaml_completion_settle_watch(ctx, rc);
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_strings = zkocaml_build_strings_struct(strings);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  args[0] = local_rc;
+  args[1] = local_strings;
+  args[2] = local_stat;
+  args[3] = local_data;
+
+  result = caml_callbackN_exn(completion_callback, 4, args);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+strings_stat_completion_dispatch(int rc,
+                                 const struct String_vector *strings,
+                                 const struct Stat *stat,
+                                 const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_STRINGS_STAT, rc, data);
+    zkocaml_event_copy_strings(event, strings);
+    zkocaml_event_copy_stat(event, stat);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(strings_stat_completion_deliver(rc, strings, stat, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a single string
+ * completes and dispatches user provided callback.
+ */
+static value
+string_completion_deliver(int rc,
+                          const char *val,
+                          const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_val, local_data);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, NULL, 0);
+  completion_callback = ctx->completion_callback;
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_val = caml_copy_string(val != NULL ? val : "");
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  result = caml_callback3_exn(completion_callback, local_rc, local_val,
+                              local_data);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+string_completion_dispatch(int rc,
+                           const char *val,
+                           const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_STRING, rc, data);
+    zkocaml_event_copy_val(event, val, -1);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(string_completion_deliver(rc, val, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when an asynchronous call that returns a list of ACLs
+ * completes and dispatches user provided callback.
+ */
+static value
+acl_completion_deliver(int rc,
+                       struct ACL_vector *acl,
+                       struct Stat *stat,
+                       const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal4(local_rc, local_acl, local_stat, local_data);
+  CAMLlocalN(args, 4);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_trace_end(ctx->span, rc, stat, 0);
+  completion_callback = ctx->completion_callback;
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_acl = zkocaml_build_acls_struct(acl);
+  local_stat = zkocaml_build_stat_struct(stat);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+
+  args[0] = local_rc;
+  args[1] = local_acl;
+  args[2] = local_stat;
+  args[3] = local_data;
+
+  result = caml_callbackN_exn(completion_callback, 4, args);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+acl_completion_dispatch(int rc,
+                        struct ACL_vector *acl,
+                        struct Stat *stat,
+                        const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event = zkocaml_event_new(ZKOCAML_EVENT_ACL, rc, data);
+    zkocaml_event_copy_acl(event, acl);
+    zkocaml_event_copy_stat(event, stat);
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(acl_completion_deliver(rc, acl, stat, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Called when a multi request completes. The per-op results live in the
+ * zkocaml_multi_t carried by the completion context, which the C client
+ * has finished writing by now, so queuing only needs the return code.
+ */
+static value
+multi_completion_deliver(int rc, const void *data)
+{
+  CAMLparam0();
+  CAMLlocal1(completion_callback);
+  CAMLlocal3(local_rc, local_results, local_data);
+  value result;
+
+  zkocaml_completion_context_t *ctx =
+    (zkocaml_completion_context_t *)data;
+  zkocaml_multi_t *multi = (zkocaml_multi_t *)ctx->payload;
+  zkocaml_trace_end(ctx->span, rc, NULL, 0);
+  completion_callback = ctx->completion_callback;
+  local_rc = zkocaml_enum_error_c2ml(rc);
+  local_results = zkocaml_build_multi_results(multi, rc);
+  local_data = zkocaml_copy_buffer(ctx->data, ctx->data_len);
+  zkocaml_multi_free(multi);
+  ctx->payload = NULL;
+
+  result = caml_callback3_exn(completion_callback, local_rc, local_results,
+                              local_data);
+  zkocaml_completion_context_release(ctx);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+multi_completion_dispatch(int rc, const void *data)
+{
+  zkocaml_completion_dispatched(data, rc, 0);
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_enqueue(zkocaml_event_new(ZKOCAML_EVENT_MULTI, rc, data));
+    return;
+  }
+
+  zkocaml_enter_callback();
+  zkocaml_reraise(multi_completion_deliver(rc, data));
+  zkocaml_leave_callback();
+}
+
+/**
+ * Maintained children sets.
+ *
+ * A children set follows the child list of one node. Its internal C
+ * watcher re-arms the watch and fetches the new list with
+ * aget_children whenever a ZOO_CHILD_EVENT arrives. The completion sorts
+ * the list, computes the added and removed names against the previous
+ * list with a sorted merge, and hands only that diff to the subscriber,
+ * along with a snapshot of the whole list.
+ *
+ * Snapshots are immutable, sorted and reference counted. An OCaml
+ * snapshot value is a custom block sharing the C array, so passing one
+ * to the subscriber costs a single small allocation whatever the number
+ * of children.
+ *
+ * A set is reference counted as well: one reference belongs to its OCaml
+ * value until it is finalized, one to the C client while a watch or a
+ * refresh is outstanding, and one to each diff waiting in the delivery
+ * queue.
+ */
+typedef struct zkocaml_children_snapshot_s_ {
+  int refs;
+  int count;
+  char **names;
+} zkocaml_children_snapshot_t;
+
+typedef struct zkocaml_children_set_s_ {
+  pthread_mutex_t lock;
+  int refs;
+  int closed;
+  zhandle_t *zh;
+  char *path;
+  value callback;
+  zkocaml_children_snapshot_t *current;
+} zkocaml_children_set_t;
+
+#define zkocaml_children_snapshot_val(v) \
+  (*(zkocaml_children_snapshot_t **)Data_custom_val(v))
+
+#define zkocaml_children_set_val(v) \
+  (*(zkocaml_children_set_t **)Data_custom_val(v))
+
+static int
+zkocaml_compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Build a sorted snapshot from a child list the C client lends. A NULL
+ * list gives an empty snapshot. The caller owns the only reference.
+ */
+static zkocaml_children_snapshot_t *
+zkocaml_children_snapshot_new(const struct String_vector *strings)
+{
+  int i = 0;
+  zkocaml_children_snapshot_t *snapshot = (zkocaml_children_snapshot_t *)
+    calloc(1, sizeof(zkocaml_children_snapshot_t));
+
+  snapshot->refs = 1;
+  if (strings != NULL && strings->count > 0) {
+    snapshot->count = strings->count;
+    snapshot->names = (char **)malloc(strings->count * sizeof(char *));
+    for (; i < strings->count; i++) {
+      snapshot->names[i] = strdup(strings->data[i]);
+    }
+    qsort(snapshot->names, snapshot->count, sizeof(char *),
+          zkocaml_compare_names);
+  }
+  return snapshot;
+}
+
+static void
+zkocaml_children_snapshot_ref(zkocaml_children_snapshot_t *snapshot)
+{
+  __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+zkocaml_children_snapshot_unref(zkocaml_children_snapshot_t *snapshot)
+{
+  int i = 0;
+
+  if (snapshot == NULL) return;
+  if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+  for (; i < snapshot->count; i++) free(snapshot->names[i]);
+  free(snapshot->names);
+  free(snapshot);
+}
+
+static void
+zkocaml_children_snapshot_finalize(value v)
+{
+  zkocaml_children_snapshot_unref(zkocaml_children_snapshot_val(v));
+}
+
+static struct custom_operations zkocaml_children_snapshot_ops = {
+  "org.apache.zookeeper.children_snapshot",
+  zkocaml_children_snapshot_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static void zkocaml_children_set_finalize(value v);
+
+static struct custom_operations zkocaml_children_set_ops = {
+  "org.apache.zookeeper.children_set",
+  zkocaml_children_set_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+/**
+ * Wrap a snapshot reference in an OCaml value, which takes it over.
+ */
+static value
+zkocaml_copy_children_snapshot(zkocaml_children_snapshot_t *snapshot)
+{
+  CAMLparam0();
+  CAMLlocal1(v);
+
+  v = caml_alloc_custom(&zkocaml_children_snapshot_ops,
+                        sizeof(zkocaml_children_snapshot_t *), 0, 1);
+  zkocaml_children_snapshot_val(v) = snapshot;
+
+  CAMLreturn(v);
+}
+
+/**
+ * Compute the names added and removed between two sorted snapshots with
+ * a single merge pass. The result vectors are heap copies.
+ */
+static void
+zkocaml_children_diff(const zkocaml_children_snapshot_t *before,
+                      const zkocaml_children_snapshot_t *after,
+                      struct String_vector *added,
+                      struct String_vector *removed)
+{
+  int i = 0, j = 0;
+
+  added->count = 0;
+  added->data = after->count > 0 ?
+    (char **)malloc(after->count * sizeof(char *)) : NULL;
+  removed->count = 0;
+  removed->data = before->count > 0 ?
+    (char **)malloc(before->count * sizeof(char *)) : NULL;
+
+  while (i < before->count || j < after->count) {
+    int c = i == before->count ? 1 :
+            j == after->count ? -1 :
+            strcmp(before->names[i], after->names[j]);
+    if (c < 0) {
+      removed->data[removed->count++] = strdup(before->names[i++]);
+    } else if (c > 0) {
+      added->data[added->count++] = strdup(after->names[j++]);
+    } else {
+      i++;
+      j++;
+    }
+  }
+}
+
+static void
+zkocaml_children_set_ref(zkocaml_children_set_t *set)
+{
+  pthread_mutex_lock(&set->lock);
+  set->refs++;
+  pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Drop a reference to a set. The callback root is released when the set
+ * is closed or finalized, so the last reference may be dropped on any
+ * thread.
+ */
+static void
+zkocaml_children_set_unref(zkocaml_children_set_t *set)
+{
+  pthread_mutex_lock(&set->lock);
+  int refs = --set->refs;
+  pthread_mutex_unlock(&set->lock);
+  if (refs > 0) return;
+
+  zkocaml_children_snapshot_unref(set->current);
+  free(set->path);
+  pthread_mutex_destroy(&set->lock);
+  free(set);
+}
+
+/**
+ * Runs the subscriber of a set with one diff, unless the set has been
+ * closed meanwhile, and drops the references the diff carried.
+ */
+static value
+children_diff_deliver(zkocaml_children_set_t *set,
+                      const struct String_vector *added,
+                      const struct String_vector *removed,
+                      zkocaml_children_snapshot_t *snapshot)
+{
+  CAMLparam0();
+  CAMLlocal3(local_snapshot, local_added, local_removed);
+  value result = Val_unit;
+
+  if (set->closed) {
+    zkocaml_children_snapshot_unref(snapshot);
+  } else {
+    local_snapshot = zkocaml_copy_children_snapshot(snapshot);
+    local_added = zkocaml_build_strings_struct(added);
+    local_removed = zkocaml_build_strings_struct(removed);
+    result = caml_callback3_exn(set->callback, local_snapshot, local_added,
+                                local_removed);
+  }
+  zkocaml_children_set_unref(set);
+
+  CAMLreturnT(value, result);
+}
+
+static void
+children_diff_dispatch(zkocaml_children_set_t *set,
+                       struct String_vector *added,
+                       struct String_vector *removed,
+                       zkocaml_children_snapshot_t *snapshot)
+{
+  value result;
+
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_CHILDREN_DIFF, ZOK, set);
+    event->strings = *added;
+    event->strings_extra = *removed;
+    event->payload = snapshot;
+    zkocaml_event_enqueue(event);
+    return;
+  }
+
+  zkocaml_enter_callback();
+  result = children_diff_deliver(set, added, removed, snapshot);
+  deallocate_String_vector(added);
+  deallocate_String_vector(removed);
+  zkocaml_reraise(result);
+  zkocaml_leave_callback();
+}
+
+static void children_watcher(zhandle_t *zh, int type, int state,
+                             const char *path, void *watcher_ctx);
+
+/**
+ * Completion of the read that re-arms a set's watch. The C client's
+ * reference moves on to the new watch when the read succeeds; a missing
+ * node empties the set, and any other failure leaves the set at its last
+ * known list without a watch.
+ */
+static void
+children_refresh_completion(int rc,
+                            const struct String_vector *strings,
+                            const void *data)
+{
+  zkocaml_children_set_t *set = (zkocaml_children_set_t *)data;
+
+  if (rc == ZOK || rc == ZNONODE) {
+    struct String_vector added, removed;
+    zkocaml_children_snapshot_t *snapshot =
+      zkocaml_children_snapshot_new(rc == ZOK ? strings : NULL);
+
+    pthread_mutex_lock(&set->lock);
+    zkocaml_children_snapshot_t *before = set->current;
+    set->current = snapshot;
+    pthread_mutex_unlock(&set->lock);
+
+    zkocaml_children_diff(before, snapshot, &added, &removed);
+    zkocaml_children_snapshot_unref(before);
+    if (added.count > 0 || removed.count > 0) {
+      zkocaml_children_snapshot_ref(snapshot);
+      zkocaml_children_set_ref(set);
+      children_diff_dispatch(set, &added, &removed, snapshot);
+    } else {
+      deallocate_String_vector(&added);
+      deallocate_String_vector(&removed);
+    }
+  }
+
+  if (rc != ZOK) zkocaml_children_set_unref(set);
+}
+
+/**
+ * Watcher of a children set. Runs on the C client thread.
+ */
+static void
+children_watcher(zhandle_t *zh,
+                 int type,
+                 int state,
+                 const char *path,
+                 void *watcher_ctx)
+{
+  zkocaml_children_set_t *set = (zkocaml_children_set_t *)watcher_ctx;
+
+  if (type == ZOO_SESSION_EVENT) {
+    if (state == ZOO_EXPIRED_SESSION_STATE) zkocaml_children_set_unref(set);
+    return;
+  }
+
+  pthread_mutex_lock(&set->lock);
+  int closed = set->closed;
+  pthread_mutex_unlock(&set->lock);
+  if (closed) {
+    zkocaml_children_set_unref(set);
+    return;
+  }
+
+  int rc = zoo_awget_children(zh, set->path, children_watcher, set,
+                              children_refresh_completion, set);
+  if (rc != ZOK) zkocaml_children_set_unref(set);
+}
+
+/**
+ * Returns the current children of a set as a snapshot.
+ */
+CAMLprim value
+zkocaml_children_snapshot(value set_value)
+{
+  CAMLparam1(set_value);
+  CAMLlocal1(result);
+
+  zkocaml_children_set_t *set = zkocaml_children_set_val(set_value);
+
+  pthread_mutex_lock(&set->lock);
+  zkocaml_children_snapshot_t *snapshot = set->current;
+  zkocaml_children_snapshot_ref(snapshot);
+  pthread_mutex_unlock(&set->lock);
+  result = zkocaml_copy_children_snapshot(snapshot);
+
+  CAMLreturn(result);
+}
+
+static void
+zkocaml_children_set_close(zkocaml_children_set_t *set)
+{
+  pthread_mutex_lock(&set->lock);
+  int closed = set->closed;
+  set->closed = 1;
+  pthread_mutex_unlock(&set->lock);
+  if (!closed) caml_remove_generational_global_root(&set->callback);
+}
+
+static void
+zkocaml_children_set_finalize(value v)
+{
+  zkocaml_children_set_t *set = zkocaml_children_set_val(v);
+
+  zkocaml_children_set_close(set);
+  zkocaml_children_set_unref(set);
+}
+
+/**
+ * Stops delivering diffs for a set. The watch left at the server, if
+ * any, is dropped when it next fires. The last snapshot stays readable.
+ */
+CAMLprim value
+zkocaml_children_close(value set_value)
+{
+  CAMLparam1(set_value);
+
+  zkocaml_children_set_close(zkocaml_children_set_val(set_value));
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Number of children in a snapshot.
+ */
+CAMLprim value
+zkocaml_children_snapshot_length(value snapshot)
+{
+  return Val_int(zkocaml_children_snapshot_val(snapshot)->count);
+}
+
+/**
+ * The i-th child of a snapshot, in byte order.
+ */
+CAMLprim value
+zkocaml_children_snapshot_get(value snapshot, value index)
+{
+  CAMLparam2(snapshot, index);
+
+  zkocaml_children_snapshot_t *s = zkocaml_children_snapshot_val(snapshot);
+  int i = Int_val(index);
+  if (i < 0 || i >= s->count) {
+    caml_invalid_argument("Zookeeper.children_snapshot_get");
+  }
+
+  CAMLreturn(caml_copy_string(s->names[i]));
+}
+
+/**
+ * Whether a snapshot contains a child, by binary search.
+ */
+CAMLprim value
+zkocaml_children_snapshot_mem(value snapshot, value name)
+{
+  zkocaml_children_snapshot_t *s = zkocaml_children_snapshot_val(snapshot);
+  const char *local_name = String_val(name);
+  int low = 0, high = s->count - 1;
+
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    int c = strcmp(s->names[mid], local_name);
+    if (c == 0) return Val_true;
+    if (c < 0) low = mid + 1;
+    else high = mid - 1;
+  }
+  return Val_false;
+}
+
+/**
+ * All children of a snapshot as a freshly allocated array.
+ */
+CAMLprim value
+zkocaml_children_snapshot_to_array(value snapshot)
+{
+  CAMLparam1(snapshot);
+  CAMLlocal1(result);
+
+  zkocaml_children_snapshot_t *s = zkocaml_children_snapshot_val(snapshot);
+  struct String_vector strings = { s->count, s->names };
+  result = zkocaml_build_strings_struct(&strings);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Hand one queued event to its *_deliver function, returning the result
+ * of the user callback it ran, if any.
+ */
+static value
+zkocaml_event_deliver(zkocaml_event_t *event)
+{
+  const struct Stat *stat = event->has_stat ? &event->stat : NULL;
+
+  switch (event->kind) {
+  case ZKOCAML_EVENT_WATCHER:
+    return watcher_deliver(event->zh, event->type, event->state,
+                           event->val, event->ctx);
+  case ZKOCAML_EVENT_VOID:
+    return void_completion_deliver(event->rc, event->ctx);
+  case ZKOCAML_EVENT_STAT:
+    return stat_completion_deliver(event->rc, stat, event->ctx);
+  case ZKOCAML_EVENT_DATA:
+    return data_completion_deliver(event->rc, event->val, event->val_len,
+                                   stat, event->ctx);
+  case ZKOCAML_EVENT_STRINGS:
+    return strings_completion_deliver(event->rc, &event->strings, event->ctx);
+  case ZKOCAML_EVENT_STRINGS_STAT:
+    return strings_stat_completion_deliver(event->rc, &event->strings,
+                                           stat, event->ctx);
+  case ZKOCAML_EVENT_STRING:
+    return string_completion_deliver(event->rc, event->val, event->ctx);
+  case ZKOCAML_EVENT_ACL:
+    return acl_completion_deliver(event->rc, &event->acl,
+                                  (struct Stat *)stat, event->ctx);
+  case ZKOCAML_EVENT_MULTI:
+    return multi_completion_deliver(event->rc, event->ctx);
+  case ZKOCAML_EVENT_CHILDREN_DIFF:
+    return children_diff_deliver(event->ctx, &event->strings,
+                                 &event->strings_extra, event->payload);
+  case ZKOCAML_EVENT_WATCH_FANOUT:
+    return watch_fanout_deliver(event->zh, event->type, event->state,
+                                event->val, event->ctx);
+  case ZKOCAML_EVENT_WATCH_LISTING:
+    return watch_listing_deliver(event->ctx, &event->strings, event->type);
+  case ZKOCAML_EVENT_RELEASE_WATCHERS:
+    zkocaml_watcher_context_free(event->ctx);
+    pthread_mutex_lock(&zkocaml_watch_lock);
+    zkocaml_watch_tree_free(event->payload);
+    pthread_mutex_unlock(&zkocaml_watch_lock);
+    break;
+  }
+  return Val_unit;
+}
+
+/**
+ * Create a handle to used communicate with zookeeper.
+ *
+ * This method creates a new handle and a zookeeper session that corresponds
+ * to that handle. Session establishment is asynchronous, meaning that the
+ * session should not be considered established until (and unless) an
+ * event of state ZOO_CONNECTED_STATE is received.
+ *
+ * @host Comma separated host:port pairs, each corresponding to a zk
+ *   server. e.g. "127.0.0.1:3000,127.0.0.1:3001,127.0.0.1:3002"
+ *
+ * @watcher_callback The global watcher callback function. When notifications are
+ *   triggered this function will be invoked.
+ *
+ * @clientid The id of a previously established session that this
+ *   client will be reconnecting to. Pass 0 if not reconnecting to a previous
+ *   session. Clients can access the session id of an established, valid,
+ *   connection by calling zoo_client_id. If the session corresponding to
+ *   the specified clientid has expired, or if the clientid is invalid for 
+ *   any reason, the returned zhandle_t will be invalid -- the zhandle_t
+ *   state will indicate the reason for failure (typically
+ *   ZOO_EXPIRED_SESSION_STATE).
+ *
+ * @context The handback object that will be associated with this instance 
+ *   of zhandle_t. Application can access it (for example, in the watcher
+ *   callback) using zoo_get_context. The object is not used by zookeeper
+ *   internally and can be null.
+ *
+ * @flags Reserved for future use. Should be set to zero.
+ *
+ * @return A pointer to the opaque zhandle structure. If it fails to create
+ * a new zhandle the function returns NULL and the errno variable indicates
+ * the reason.
+ */
+
+CAMLprim value
+zkocaml_init_native(value host,
+                    value watcher_callback,
+                    value recv_timeout,
+                    value clientid,
+                    value context,
+                    value flag)
+{
+  CAMLparam5(host, watcher_callback, recv_timeout, clientid, context);
+  CAMLxparam1(flag);
+  CAMLlocal1(zh);
+
+  const char *local_host = String_val(host);
+  int local_recv_timeout = Long_val(recv_timeout);
+  clientid_t *cid = NULL;
+
+  zkocaml_watcher_context_t *ctx = (zkocaml_watcher_context_t *)
+      malloc(sizeof(zkocaml_watcher_context_t));
+  ctx->watcher_ctx = zkocaml_copy_string_val(context);
+  ctx->watcher_callback = watcher_callback;
+  ctx->connects = 0;
+  ctx->id = __atomic_add_fetch(&zkocaml_handles_last_id, 1, __ATOMIC_RELAXED);
+  caml_register_generational_global_root(&ctx->watcher_callback);
+
+  cid = zkocaml_parse_clientid(clientid);
+  zhandle_t *handle = zookeeper_init(local_host,
+          watcher_dispatch, local_recv_timeout, cid, ctx, 0);
+  free(cid);
+
+  if (handle == NULL) {
+    zkocaml_watcher_context_free(ctx);
+    zh = zkocaml_copy_zhandle(0);
+  } else {
+    zh = zkocaml_intern_zhandle(handle, ctx);
+  }
+  CAMLreturn(zh);
+}
+
+CAMLprim value
+zkocaml_init_bytecode(value *argv, int argn)
+{
+  return zkocaml_init_native(argv[0], argv[1], argv[2],
+                             argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Close the zookeeper handle and free up any resources.
+ *
+ * After this call, the client session will no longer be valid. The function
+ * will flush any outstanding send requests before return. As a result it may
+ * block.
+ *
+ * This method should only be called only once on a zookeeper handle. Calling
+ * twice will cause undefined (and probably undesirable behavior). Calling any other
+ * zookeeper method after calling close is undefined behaviour and should be avoided.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @return a result code. Regardless of the error code returned, the zhandle
+ * will be destroyed and all resources freed.
+ *   ZOK - success
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ *   ZOPERATIONTIMEOUT - failed to flush the buffers within the specified timeout.
+ *   ZCONNECTIONLOSS - a network error occured while attempting to send request to server
+ *   ZSYSTEMERROR -- a system (OS) error occured; it's worth checking errno to get details
+ */
+CAMLprim value
+zkocaml_close(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_handle_t *zhandle = NULL;
+  zhandle = zkocaml_handle_struct_val(zh);
+
+#if defined(ZKOCAML_SINGLE_THREADED)
+  /* Pending completions are called back from here with ZCLOSING. */
+  int rc = zookeeper_close(zhandle->handle);
+#else
+  caml_enter_blocking_section();
+  int rc = zookeeper_close(zhandle->handle);
+  caml_leave_blocking_section();
+#endif
+
+  /* Events of this handle still queued need its watchers. */
+  if (zkocaml_delivery_mode == ZKOCAML_DELIVERY_QUEUED) {
+    zkocaml_event_t *event =
+      zkocaml_event_new(ZKOCAML_EVENT_RELEASE_WATCHERS, ZOK, zhandle->watcher);
+    pthread_mutex_lock(&zkocaml_watch_lock);
+    event->payload = zhandle->watches;
+    zhandle->watches = NULL;
+    pthread_mutex_unlock(&zkocaml_watch_lock);
+    zkocaml_event_enqueue(event);
+    zhandle->watcher = NULL;
+  }
+  zkocaml_release_zhandle(zhandle);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return the client session id, only valid if the connections
+ * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE)
+ */
+CAMLprim value
+zkocaml_client_id(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_handle_t *zhandle = NULL;
+  zhandle = zkocaml_handle_struct_val(zh);
+  const clientid_t *cid = zoo_client_id(zhandle->handle);
+  result = zkocaml_build_client_id_struct(cid);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return the timeout for this session, only valid if the connections
+ * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE). This
+ * value may change after a server re-connect.
+ */
+CAMLprim value
+zkocaml_recv_timeout(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_handle_t *zhandle = NULL;
+  zhandle = zkocaml_handle_struct_val(zh);
+  int recv_timeout = zoo_recv_timeout(zhandle->handle);
+  result = Val_int(recv_timeout);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return the context for this handle.
+ */
+CAMLprim value
+zkocaml_get_context(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_handle_t *zhandle = NULL;
+  zhandle = zkocaml_handle_struct_val(zh);
+  result = caml_copy_string(zhandle->watcher != NULL ?
+                            zhandle->watcher->watcher_ctx : "");
+
+  CAMLreturn(result);
+}
+
+/**
+ * Set the context for this handle.
+ */
+CAMLprim value
+zkocaml_set_context(value zh, value context)
+{
+  CAMLparam2(zh, context);
+
+  zkocaml_handle_t *zhandle = NULL;
+  zhandle = zkocaml_handle_struct_val(zh);
+  if (zhandle->watcher != NULL) {
+    free(zhandle->watcher->watcher_ctx);
+    zhandle->watcher->watcher_ctx = zkocaml_copy_string_val(context);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Set a watcher function
+ * @return previous watcher function
+ */
+CAMLprim value
+zkocaml_set_watcher(value zh, value watcher_callback)
+{
+  CAMLparam2(zh, watcher_callback);
+  // TODO: implement this later.
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Returns the socket address for the current connection
+ *
+ * @return socket address of the connected host or NULL on failure, only valid if the
+ * connection is current connected
+ */
+CAMLprim value
+zkocaml_get_connected_host(value zh)
+{
+  CAMLparam1(zh);
+  // TODO: implement this later.
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Get the state of the zookeeper connection.
+ *
+ * The return value will be one of the state consts.
+ */
+CAMLprim value
+zkocaml_state(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(state);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  state = zoo_state(zhandle->handle);
+
+  CAMLreturn(state);
+}
+
+/**
+ * Create a node.
+ *
+ * This method will create a node in ZooKeeper. A node can only be created if
+ * it does not already exists. The Create Flags affect the creation of nodes.
+ * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
+ * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
+ * monotonically increasing sequence number is appended to the path name. The
+ * sequence number is always fixed length of 10 digits, 0 padded.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path The name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @value The data to be stored in the node.
+ *
+ * @acl The initial ACL of the node. The ACL must not be null or empty.
+ *
+ * @flags this parameter can be set to 0 for normal create or an OR
+ * of the Create Flags
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the parent node does not exist.
+ *   ZNODEEXISTS the node already exists
+ *   ZNOAUTH the client does not have permission.
+ *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
+ *
+ * @data The data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_acreate_native(value zh,
+                       value path,
+                       value val,
+                       value acl,
+                       value flags,
+                       value completion,
+                       value data)
+{
+  CAMLparam5(zh, path, val, acl, flags);
+  CAMLxparam2(completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_CREATE, path,
+                                 caml_string_length(val));
+
+  struct ACL_vector local_acl;
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  const char *local_val = String_val(val);
+  size_t local_val_len = caml_string_length(val);
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  if (r == 0) {
+    local_acl = ZOO_OPEN_ACL_UNSAFE;
+  }
+  int local_flags = zkocaml_enum_create_flag_ml2c(flags);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_CREATE, span,
+                                   local_path, local_val_len, completion, data);
+
+  int rc = zoo_acreate(zhandle->handle,
+                       local_path,
+                       local_val,
+                       local_val_len,
+                       (const struct ACL_vector *)&local_acl,
+                       local_flags,
+                       string_completion_dispatch,
+                       local_data);
+  if (r != 0) deallocate_ACL_vector(&local_acl);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_acreate_bytecode(value *argv, int argn)
+{
+  return zkocaml_acreate_native(argv[0], argv[1], argv[2], argv[3],
+                                argv[4], argv[5], argv[6]);
+}
+
+/**
+ * Delete a node in zookeeper.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @version the expected version of the node. The function will fail if the
+ * actual version of the node does not match the expected version.
+ * If -1 is used the version check will not take place.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
+ *   ZNOTEMPTY children are present; node cannot be deleted.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_adelete(value zh,
+                value path,
+                value version,
+                value completion,
+                value data)
+{
+  CAMLparam5(zh, path, version, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_DELETE, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_version = Int_val(version);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_DELETE, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_adelete(zhandle->handle,
+                       local_path,
+                       local_version,
+                       void_completion_dispatch,
+                       local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks the existence of a node in zookeeper.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify the
+ * client if the node changes. The watch will be set even if the node does not
+ * exist. This allows clients to watch for nodes to appear.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aexists(value zh,
+                value path,
+                value watch,
+                value completion,
+                value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_EXISTS, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aexists(zhandle->handle,
+                       local_path,
+                       local_watch,
+                       stat_completion_dispatch,
+                       local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks the existence of a node in zookeeper.
+ *
+ * This function is similar to zoo_axists except it allows one specify
+ * a watcher object - a function pointer and associated context. The function
+ * will be called once the watch has fired. The associated context data will be
+ * passed to the function as the watcher context parameter.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null a watch will set on the specified znode on the server.
+ * The watch will be set even if the node does not exist. This allows clients
+ * to watch for nodes to appear.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awexists_native(value zh,
+                        value path,
+                        value watcher_callback,
+                        value watcher_ctx,
+                        value completion,
+                        value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_DATA,
+                        watcher_callback, watcher_ctx, 1);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_EXISTS, span,
+                                   local_path, 0, completion, data);
+  int rc;
+
+  local_data->payload = sub;
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (sub != NULL && sub->arming) {
+    rc = zoo_awexists(zhandle->handle,
+                      local_path,
+                      watch_fanout_dispatch,
+                      sub->slot,
+                      stat_completion_dispatch,
+                      local_data);
+  } else {
+    rc = zoo_aexists(zhandle->handle, local_path, 0,
+                     stat_completion_dispatch, local_data);
+  }
+  if (rc != ZOK) {
+    zkocaml_completion_settle_watch(local_data, rc);
+    zkocaml_completion_context_abort(local_data, rc);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awexists_bytecode(value *argv, int argn)
+{
+  return zkocaml_awexists_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Gets the data associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget(value zh,
+             value path,
+             value watch,
+             value completion,
+             value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aget(zhandle->handle,
+                    local_path,
+                    local_watch,
+                    data_completion_dispatch,
+                    local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Gets the data associated with a node.
+ *
+ * This function is similar to zoo_aget except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awget_native(value zh,
+                     value path,
+                     value watcher_callback,
+                     value watcher_ctx,
+                     value completion,
+                     value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_DATA,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET, span,
+                                   local_path, 0, completion, data);
+  int rc;
+
+  local_data->payload = sub;
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (sub != NULL && sub->arming) {
+    rc = zoo_awget(zhandle->handle,
+                   local_path,
+                   watch_fanout_dispatch,
+                   sub->slot,
+                   data_completion_dispatch,
+                   local_data);
+  } else {
+    rc = zoo_aget(zhandle->handle, local_path, 0,
+                  data_completion_dispatch, local_data);
+  }
+  if (rc != ZOK) {
+    zkocaml_completion_settle_watch(local_data, rc);
+    zkocaml_completion_context_abort(local_data, rc);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awget_bytecode(value *argv, int argn)
+{
+  return zkocaml_awget_native(argv[0], argv[1], argv[2],
+                              argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Sets the data associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @buffer the buffer holding data to be written to the node.
+ *
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place. * completion: If null,
+ * the function will execute synchronously. Otherwise, the function will return
+ * immediately and invoke the completion routine when the request completes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aset_native(value zh,
+                    value path,
+                    value buffer,
+                    value version,
+                    value completion,
+                    value data)
+{
+  CAMLparam5(zh, path, buffer, version, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET, path,
+                                 caml_string_length(buffer));
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  const char *local_buffer = String_val(buffer);
+  size_t buffer_len = caml_string_length(buffer);
+  int local_version = Int_val(version);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_SET, span,
+                                   local_path, buffer_len, completion, data);
+
+  int rc = zoo_aset(zhandle->handle,
+                    local_path,
+                    local_buffer,
+                    buffer_len,
+                    local_version,
+                    stat_completion_dispatch,
+                    local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_aset_bytecode(value *argv, int argn)
+{
+  return zkocaml_aset_native(argv[0], argv[1], argv[2],
+                             argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Lists the children of a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget_children(value zh,
+                      value path,
+                      value watch,
+                      value completion,
+                      value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET_CHILDREN, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aget_children(zhandle->handle,
+                             local_path,
+                             local_watch,
+                             strings_completion_dispatch,
+                             local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Lists the children of a node.
+ *
+ * This function is similar to zoo_aget_children except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awget_children_native(value zh,
+                              value path,
+                              value watcher_callback,
+                              value watcher_ctx,
+                              value completion,
+                              value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_CHILD,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET_CHILDREN, span,
+                                   local_path, 0, completion, data);
+  int rc;
+
+  local_data->payload = sub;
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (sub != NULL && sub->arming) {
+    rc = zoo_awget_children(zhandle->handle,
+                            local_path,
+                            watch_fanout_dispatch,
+                            sub->slot,
+                            strings_completion_dispatch,
+                            local_data);
+  } else {
+    rc = zoo_aget_children(zhandle->handle, local_path, 0,
+                           strings_completion_dispatch, local_data);
+  }
+  if (rc != ZOK) {
+    zkocaml_completion_settle_watch(local_data, rc);
+    zkocaml_completion_context_abort(local_data, rc);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awget_children_bytecode(value *argv, int argn)
+{
+  return zkocaml_awget_children_native(argv[0], argv[1], argv[2],
+                                       argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Lists the children of a node, and get the parent stat.
+ *
+ * This function is new in version 3.3.0
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watch if nonzero, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget_children2(value zh,
+                       value path,
+                       value watch,
+                       value completion,
+                       value data)
+{
+  CAMLparam5(zh, path, watch, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_watch = Int_val(watch);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET_CHILDREN, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aget_children2(zhandle->handle,
+                              local_path,
+                              local_watch,
+                              strings_stat_completion_dispatch,
+                              local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Lists the children of a node, and get the parent stat.
+ *
+ * This function is similar to zoo_aget_children2 except it allows one specify
+ * a watcher object rather than a boolean watch flag.
+ *
+ * This function is new in version 3.3.0
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @watcher if non-null, a watch will be set at the server to notify
+ * the client if the node changes.
+ *
+ * @watcher_ctx user specific data, will be passed to the watcher callback.
+ * Unlike the global context set by zookeeper_init, this watcher context
+ * is associated with the given instance of the watcher only.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_awget_children2_native(value zh,
+                               value path,
+                               value watcher_callback,
+                               value watcher_ctx,
+                               value completion,
+                               value data)
+{
+  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_CHILD,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET_CHILDREN, span,
+                                   local_path, 0, completion, data);
+  int rc;
+
+  local_data->payload = sub;
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (sub != NULL && sub->arming) {
+    rc = zoo_awget_children2(zhandle->handle,
+                             local_path,
+                             watch_fanout_dispatch,
+                             sub->slot,
+                             strings_stat_completion_dispatch,
+                             local_data);
+  } else {
+    rc = zoo_aget_children2(zhandle->handle, local_path, 0,
+                            strings_stat_completion_dispatch, local_data);
+  }
+  if (rc != ZOK) {
+    zkocaml_completion_settle_watch(local_data, rc);
+    zkocaml_completion_context_abort(local_data, rc);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_awget_children2_bytecode(value *argv, int argn)
+{
+  return zkocaml_awget_children2_native(argv[0], argv[1], argv[2],
+                                        argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Flush leader channel.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_async(value zh, value path, value completion, value data)
+{
+  CAMLparam4(zh, path, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SYNC, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_SYNC, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_async(zhandle->handle,
+                     local_path,
+                     string_completion_dispatch,
+                     local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Gets the acl associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aget_acl(value zh, value path, value completion, value data)
+{
+  CAMLparam4(zh, path, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_ACL, path, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_GET_ACL, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aget_acl(zhandle->handle,
+                        local_path,
+                        acl_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Sets the acl associated with a node.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @buffer the buffer holding the acls to be written to the node.
+ *
+ * @completion the routine to invoke when the request completes. The completion
+ * will be triggered with one of the following codes passed in as the rc argument:
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZINVALIDACL invalid ACL specified
+ *   ZBADVERSION expected version does not match actual version.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+CAMLprim value
+zkocaml_aset_acl_native(value zh,
+                 value path,
+                 value version,
+                 value acl,
+                 value completion,
+                 value data)
+{
+  CAMLparam5(zh, path, version, acl, completion);
+  CAMLxparam1(data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET_ACL, path, 0);
+
+  struct ACL_vector local_acl;
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_path = String_val(path);
+  int local_version = Int_val(version);
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  if (r == 0) {
+    local_acl = ZOO_OPEN_ACL_UNSAFE;
+  }
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_SET_ACL, span,
+                                   local_path, 0, completion, data);
+
+  int rc = zoo_aset_acl(zhandle->handle,
+                        local_path,
+                        local_version,
+                        (struct ACL_vector *)&local_acl,
+                        void_completion_dispatch,
+                        local_data);
+  if (r != 0) deallocate_ACL_vector(&local_acl);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_aset_acl_bytecode(value *argv, int argn)
+{
+  return zkocaml_aset_acl_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
+}
+
+/**
+ * Atomically commits multiple zookeeper operations.
+ *
+ * Either every op is applied or none is. The ops are built with the
+ * Create_op, Delete_op, Set_op and Check_op constructors.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @ops an array of ops to commit
+ *
+ * @completion the routine to invoke when the request completes. It is
+ * passed the return code of the whole transaction and one op_result per
+ * op, in order. If the transaction failed, the op that caused it carries
+ * the real error and the others ZRUNTIMEINCONSISTENCY.
+ *
+ * @data the data that will be passed to the completion routine when
+ * the function completes.
+ *
+ * @return the return code for the function call. This can be any of the
+ * values that can be returned by the ops supported by a multi op (see
+ * acreate, adelete, aset and the check op).
+ */
+CAMLprim value
+zkocaml_amulti(value zh, value ops, value completion, value data)
+{
+  CAMLparam4(zh, ops, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_MULTI, Val_unit, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  zkocaml_multi_t *multi = zkocaml_parse_multi_ops(ops);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_MULTI, span,
+                                   NULL, 0, completion, data);
+  local_data->payload = multi;
+
+  int rc = zoo_amulti(zhandle->handle,
+                      multi->count,
+                      multi->ops,
+                      multi->results,
+                      multi_completion_dispatch,
+                      local_data);
+  if (rc != ZOK) {
+    zkocaml_multi_free(multi);
+    zkocaml_completion_context_abort(local_data, rc);
+  }
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Return an error string.
+ *
+ * @rc return code.
+ * @return string corresponding to the return code
+ */
+CAMLprim value
+zkocaml_zerror(value rc)
+{
+  CAMLparam1(rc);
+  CAMLlocal1(result);
+
+  const char *errstr = zerror(Int_val(rc));
+  result = caml_copy_string(errstr);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Specify application credentials.
+ *
+ * The application calls this function to specify its credentials for purposes
+ * of authentication. The server will use the security provider specified by
+ * the scheme parameter to authenticate the client connection. If the
+ * authentication request has failed:
+ * - the server connection is dropped
+ * - the watcher is called with the ZOO_AUTH_FAILED_STATE value as the state
+ * parameter.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @scheme the id of authentication scheme. Natively supported:
+ * "digest" password-based authentication
+ *
+ * @cert application credentials. The actual value depends on the scheme.
+ *
+ * @completion the routine to invoke when the request completes. One of
+ * the following result codes may be passed into the completion callback:
+ *   ZOK operation completed successfully
+ *   ZAUTHFAILED authentication failed
+ *
+ * @data the data that will be passed to the completion routine when the
+ * function completes.
+ *
+ * @return ZOK on success or one of the following errcodes on failure:
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ *   ZSYSTEMERROR - a system error occured
+ */
+CAMLprim value
+zkocaml_add_auth(value zh,
+                 value scheme,
+                 value cert,
+                 value completion,
+                 value data)
+{
+  CAMLparam5(zh, scheme, cert, completion, data);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_AUTH, Val_unit,
+                                 caml_string_length(cert));
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  const char *local_scheme = String_val(scheme);
+  const char *local_cert = String_val(cert);
+  size_t cert_len = caml_string_length(cert);
+  zkocaml_completion_context_t *local_data =
+    zkocaml_completion_context_new(ZKOCAML_OP_TYPE_AUTH, span,
+                                   NULL, cert_len, completion, data);
+
+  int rc = zoo_add_auth(zhandle->handle,
+                        local_scheme,
+                        local_cert,
+                        cert_len,
+                        void_completion_dispatch,
+                        local_data);
+  if (rc != ZOK) zkocaml_completion_context_abort(local_data, rc);
+  result = zkocaml_enum_error_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Checks if the current zookeeper connection state can't be recovered.
+ *
+ *  The application must close the zhandle and try to reconnect.
+ *
+ * @zh the zookeeper handle (see zookeeper_init)
+ * @return ZINVALIDSTATE if connection is unrecoverable
+ */
+CAMLprim value
+zkocaml_is_unrecoverable(value zh)
+{
+  CAMLparam1(zh);
+  CAMLlocal1(result);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  int rc = is_unrecoverable(zhandle->handle);
+  result = zkocaml_enum_event_c2ml(rc);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Sets the debugging level for the library
+ */
+CAMLprim value
+zkocaml_set_debug_level(value log_level)
+{
+  CAMLparam1(log_level);
+
+  ZooLogLevel level = zkocaml_enum_loglevel_ml2c(log_level);
+  switch(level) {
+  case ZOO_LOG_LEVEL_ERROR:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    break;
+  case ZOO_LOG_LEVEL_WARN:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+    break;
+  case ZOO_LOG_LEVEL_INFO:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
+    break;
+  case ZOO_LOG_LEVEL_DEBUG:
+    zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
+    break;
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Sets the stream to be used by the library for logging
+ *
+ * The zookeeper library uses stderr as its default log stream. Application
+ * must make sure the stream is writable. Passing in NULL resets the stream
+ * to its default value (stderr).
+ */
+CAMLprim value
+zkocaml_set_log_stream(value log_stream)
+{
+  CAMLparam1(log_stream);
+
+  const char *stream_name = String_val(log_stream);
+  zkocaml_log_stream = fopen(stream_name, "w+");
+  if (zkocaml_log_stream == NULL) CAMLreturn(Val_unit);
+  zoo_set_log_stream(zkocaml_log_stream);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Enable/disable quorum endpoint order randomization
+ *
+ * Note: typically this method should NOT be used outside of testing.
+ *
+ * If passed a non-zero value, will make the client connect to quorum peers
+ * in the order as specified in the zookeeper_init() call.
+ * A zero value causes zookeeper_init() to permute the peer endpoints
+ * which is good for more even client connection distribution among the
+ * quorum peers.
+ */
+CAMLprim value
+zkocaml_deterministic_conn_order(value yes_or_no)
+{
+  CAMLparam1(yes_or_no);
+
+  int decision = Bool_val(yes_or_no);
+  zoo_deterministic_conn_order(decision);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Returns the occupancy of the asynchronous completion context pool:
+ * the number of requests currently in flight, the highest number seen
+ * since the process started and the number of contexts allocated so far.
+ */
+CAMLprim value
+zkocaml_completion_context_stats(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+
+  pthread_mutex_lock(&zkocaml_completion_pool_lock);
+  long in_flight = zkocaml_completion_in_flight;
+  long peak_in_flight = zkocaml_completion_peak_in_flight;
+  long pooled = zkocaml_completion_pooled;
+  pthread_mutex_unlock(&zkocaml_completion_pool_lock);
+
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, Val_long(in_flight));
+  Store_field(result, 1, Val_long(peak_in_flight));
+  Store_field(result, 2, Val_long(pooled));
+
+  CAMLreturn(result);
+}
+/**
+ * Quantile q (between 0 and 1) of a histogram snapshot: the largest value
+ * of the bucket holding the value of that rank, capped by the maximum.
+ */
+static unsigned long
+zkocaml_hist_quantile(const unsigned long *buckets,
+                      unsigned long count,
+                      unsigned long max,
+                      double q)
+{
+  unsigned long rank = (unsigned long)(q * count + 0.999999);
+  unsigned long seen = 0, v = 0;
+  int i = 0;
+
+  if (count == 0) return 0;
+  if (rank == 0) rank = 1;
+  for (; i < ZKOCAML_HIST_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) break;
+  }
+  v = zkocaml_hist_bucket_max(i < ZKOCAML_HIST_BUCKETS ? i : i - 1);
+
+  return v < max ? v : max;
+}
+
+/**
+ * Build a latency_histogram record from a histogram. The buckets are read
+ * once, and the count and quantiles are derived from that copy so that
+ * they agree with each other.
+ */
+static value
+zkocaml_build_histogram(const zkocaml_histogram_t *hist)
+{
+  CAMLparam0();
+  CAMLlocal3(result, buckets, bucket);
+
+  unsigned long counts[ZKOCAML_HIST_BUCKETS];
+  unsigned long count = 0;
+  unsigned long sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+  unsigned long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  int i = 0, used = 0;
+
+  for (; i < ZKOCAML_HIST_BUCKETS; i++) {
+    counts[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    count += counts[i];
+    if (counts[i] != 0) used++;
+  }
+
+  buckets = caml_alloc(used, 0);
+  for (i = 0, used = 0; i < ZKOCAML_HIST_BUCKETS; i++) {
+    if (counts[i] == 0) continue;
+    bucket = caml_alloc(2, 0);
+    Store_field(bucket, 0, Val_long(zkocaml_hist_bucket_max(i)));
+    Store_field(bucket, 1, Val_long(counts[i]));
+    Store_field(buckets, used++, bucket);
+  }
+
+  result = caml_alloc(8, 0);
+  Store_field(result, 0, Val_long(count));
+  Store_field(result, 1, Val_long(sum));
+  Store_field(result, 2, Val_long(max));
+  Store_field(result, 3,
+              Val_long(zkocaml_hist_quantile(counts, count, max, 0.5)));
+  Store_field(result, 4,
+              Val_long(zkocaml_hist_quantile(counts, count, max, 0.9)));
+  Store_field(result, 5,
+              Val_long(zkocaml_hist_quantile(counts, count, max, 0.99)));
+  Store_field(result, 6,
+              Val_long(zkocaml_hist_quantile(counts, count, max, 0.999)));
+  Store_field(result, 7, buckets);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Returns a snapshot of the per-operation accounting, one op_metrics
+ * record per operation type, without stopping the traffic.
+ */
+CAMLprim value
+zkocaml_op_metrics(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal5(result, metrics, errors, error, field);
+
+  int op = 0, i = 0, used = 0;
+
+  result = caml_alloc(ZKOCAML_OP_TYPES, 0);
+  for (; op < ZKOCAML_OP_TYPES; op++) {
+    const zkocaml_op_metrics_t *m = &zkocaml_ops[op];
+    unsigned long counts[zkocaml_table_len(ZOO_ERRORS_TABLE)];
+
+    for (i = 0, used = 0; i < zkocaml_table_len(ZOO_ERRORS_TABLE); i++) {
+      int code = -ZOO_ERRORS_TABLE[i];
+      counts[i] = code >= 0 && code < ZKOCAML_ERROR_CODES
+        ? __atomic_load_n(&m->errors[code], __ATOMIC_RELAXED) : 0;
+      if (counts[i] != 0) used++;
+    }
+    errors = caml_alloc(used, 0);
+    for (i = 0, used = 0; i < zkocaml_table_len(ZOO_ERRORS_TABLE); i++) {
+      if (counts[i] == 0) continue;
+      error = caml_alloc(2, 0);
+      Store_field(error, 0, Val_int(i));
+      Store_field(error, 1, Val_long(counts[i]));
+      Store_field(errors, used++, error);
+    }
+
+    metrics = caml_alloc(6, 0);
+    Store_field(metrics, 0, Val_int(op));
+    Store_field(metrics, 1,
+                Val_long(__atomic_load_n(&m->submitted, __ATOMIC_RELAXED)));
+    Store_field(metrics, 2,
+                Val_long(__atomic_load_n(&m->completed, __ATOMIC_RELAXED)));
+    Store_field(metrics, 3, errors);
+    field = zkocaml_build_histogram(&m->service);
+    Store_field(metrics, 4, field);
+    field = zkocaml_build_histogram(&m->callback);
+    Store_field(metrics, 5, field);
+    Store_field(result, op, metrics);
+  }
+
+  CAMLreturn(result);
+}
+
+
+/**
+ * Installs the tracing hooks (Some of a trace_hooks record) or removes
+ * them (None), see zkocaml_trace_start. Requests already in flight when
+ * the hooks are removed close no span.
+ */
+CAMLprim value
+zkocaml_set_trace_hooks(value hooks)
+{
+  CAMLparam1(hooks);
+
+  static int registered = 0;
+  value local_hooks = Is_block(hooks) ? Field(hooks, 0) : Val_unit;
+
+  if (!registered) {
+    zkocaml_trace_hooks = local_hooks;
+    caml_register_generational_global_root(&zkocaml_trace_hooks);
+    registered = 1;
+  } else {
+    caml_modify_generational_global_root(&zkocaml_trace_hooks, local_hooks);
+  }
+  zkocaml_trace_enabled = Is_block(hooks);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Sets the slow-operation log threshold of an op type, in microseconds of
+ * service latency; 0 stops logging that op type.
+ */
+CAMLprim value
+zkocaml_set_slow_op_threshold(value op, value threshold_us)
+{
+  CAMLparam2(op, threshold_us);
+
+  int i = 0, enabled = 0;
+  int64_t threshold = Long_val(threshold_us);
+
+  if (threshold < 0) caml_invalid_argument("Zookeeper.set_slow_op_threshold");
+  __atomic_store_n(&zkocaml_slow_thresholds[Int_val(op)], threshold,
+                   __ATOMIC_RELAXED);
+  for (; i < ZKOCAML_OP_TYPES; i++) {
+    if (zkocaml_slow_thresholds[i] > 0) enabled = 1;
+  }
+  zkocaml_slow_enabled = enabled;
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Returns the requests held by the slow-operation log, oldest first.
+ */
+CAMLprim value
+zkocaml_slow_ops(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal3(result, entry, field);
+
+  int i = 0;
+  zkocaml_slow_op_t *entries = (zkocaml_slow_op_t *)
+    malloc(ZKOCAML_SLOW_LOG_SIZE * sizeof(zkocaml_slow_op_t));
+  int count = zkocaml_slow_snapshot(entries);
+
+  result = caml_alloc(count, 0);
+  for (; i < count; i++) {
+    entry = caml_alloc(6, 0);
+    Store_field(entry, 0, Val_int(entries[i].op));
+    field = caml_copy_string(entries[i].path);
+    Store_field(entry, 1, field);
+    Store_field(entry, 2, Val_long(entries[i].size));
+    field = zkocaml_enum_error_c2ml(entries[i].rc);
+    Store_field(entry, 3, field);
+    field = caml_copy_double((double)entries[i].started_us / 1e6);
+    Store_field(entry, 4, field);
+    Store_field(entry, 5, Val_long(entries[i].service_us));
+    Store_field(result, i, entry);
+  }
+  free(entries);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Writes the requests held by the slow-operation log, oldest first, to
+ * the stream set by set_log_stream, or to stderr.
+ */
+CAMLprim value
+zkocaml_dump_slow_ops(value unit)
+{
+  CAMLparam1(unit);
+
+  static const char *names[ZKOCAML_OP_TYPES] = {
+    "create", "delete", "exists", "get", "set", "get_children",
+    "get_acl", "set_acl", "sync", "multi", "auth"
+  };
+  int i = 0;
+  FILE *stream = zkocaml_log_stream != NULL ? zkocaml_log_stream : stderr;
+  zkocaml_slow_op_t *entries = (zkocaml_slow_op_t *)
+    malloc(ZKOCAML_SLOW_LOG_SIZE * sizeof(zkocaml_slow_op_t));
+  int count = zkocaml_slow_snapshot(entries);
+
+  caml_enter_blocking_section();
+  for (; i < count; i++) {
+    char date[32];
+    struct tm tm;
+    time_t seconds = (time_t)(entries[i].started_us / 1000000);
+
+    localtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(stream,
+            "%s,%03d:ZKOCAML_SLOW@%s: path=%s size=%ld rc=%d (%s)"
+            " service=%ldus\n",
+            date, (int)(entries[i].started_us / 1000 % 1000),
+            names[entries[i].op], entries[i].path, entries[i].size,
+            entries[i].rc, zerror(entries[i].rc),
+            (long)entries[i].service_us);
+  }
+  fflush(stream);
+  caml_leave_blocking_section();
+  free(entries);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Turns hot-path tracking on or off. Counts are kept while it is off.
+ */
+CAMLprim value
+zkocaml_set_hot_path_tracking(value enabled)
+{
+  CAMLparam1(enabled);
+
+  zkocaml_hot_enabled = Bool_val(enabled);
+
+  CAMLreturn(Val_unit);
+}
+
+static int
+zkocaml_hot_compare(const void *a, const void *b)
+{
+  unsigned long x = ((const zkocaml_hot_entry_t *)a)->count;
+  unsigned long y = ((const zkocaml_hot_entry_t *)b)->count;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static value
+zkocaml_build_hot_paths(zkocaml_hot_tracker_t *tracker)
+{
+  CAMLparam0();
+  CAMLlocal3(result, entry, path);
+
+  int i = 0, size = 0;
+  zkocaml_hot_entry_t top[ZKOCAML_HOT_TOP];
+
+  pthread_mutex_lock(&tracker->lock);
+  size = tracker->size;
+  memcpy(top, tracker->top, size * sizeof(zkocaml_hot_entry_t));
+  pthread_mutex_unlock(&tracker->lock);
+  qsort(top, size, sizeof(zkocaml_hot_entry_t), zkocaml_hot_compare);
+
+  result = caml_alloc(size, 0);
+  for (; i < size; i++) {
+    path = caml_copy_string(top[i].path);
+    entry = caml_alloc(2, 0);
+    Store_field(entry, 0, path);
+    Store_field(entry, 1, Val_long(top[i].count));
+    Store_field(result, i, entry);
+  }
+
+  CAMLreturn(result);
+}
+
+/**
+ * Returns the most read and most written paths, hottest first, with their
+ * estimated number of requests.
+ */
+CAMLprim value
+zkocaml_hot_paths(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal2(result, field);
+
+  result = caml_alloc(2, 0);
+  field = zkocaml_build_hot_paths(&zkocaml_hot[ZKOCAML_HOT_READS]);
+  Store_field(result, 0, field);
+  field = zkocaml_build_hot_paths(&zkocaml_hot[ZKOCAML_HOT_WRITES]);
+  Store_field(result, 1, field);
+
+  CAMLreturn(result);
+}
+
+/**
+ * Forgets every count of hot-path tracking. Requests counted while the
+ * reset is in progress may survive it in part.
+ */
+CAMLprim value
+zkocaml_reset_hot_paths(value unit)
+{
+  CAMLparam1(unit);
+
+  int t = 0, d = 0, i = 0;
+
+  for (; t < 2; t++) {
+    zkocaml_hot_tracker_t *tracker = &zkocaml_hot[t];
+
+    pthread_mutex_lock(&tracker->lock);
+    for (d = 0; d < ZKOCAML_HOT_DEPTH; d++) {
+      for (i = 0; i < ZKOCAML_HOT_WIDTH; i++) {
+        __atomic_store_n(&tracker->sketch[d][i], 0, __ATOMIC_RELAXED);
+      }
+    }
+    tracker->size = 0;
+    __atomic_store_n(&tracker->floor, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tracker->lock);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Selects how completions and watch events reach OCaml, see
+ * ZKOCAML_DELIVERY_QUEUED. Events already queued stay queued when
+ * switching back to direct delivery until zkocaml_drain_completions
+ * is called.
+ */
+CAMLprim value
+zkocaml_set_delivery_mode(value mode)
+{
+  CAMLparam1(mode);
+
+  if (Int_val(mode) == ZKOCAML_DELIVERY_QUEUED) {
+    pthread_once(&zkocaml_delivery_once, zkocaml_delivery_init);
+  }
+  __atomic_store_n(&zkocaml_delivery_mode, Int_val(mode), __ATOMIC_SEQ_CST);
+
+  CAMLreturn(Val_unit);
+}
+
+/**
+ * Returns the fd that becomes readable whenever queued events are
+ * waiting to be drained.
+ */
+CAMLprim value
+zkocaml_delivery_fd(value unit)
+{
+  CAMLparam1(unit);
+
+  pthread_once(&zkocaml_delivery_once, zkocaml_delivery_init);
+
+  CAMLreturn(Val_int(zkocaml_delivery_fds[0]));
+}
+
+/**
+ * Converts and dispatches up to max_events queued events (all of them
+ * when max_events <= 0) on the calling thread, which already holds the
+ * runtime lock, and returns how many were delivered. If events are left
+ * over the delivery fd is signalled again.
+ *
+ * An exception raised by a callback stops the drain and is raised from
+ * here, once its event is freed and the fd signalled again for the events
+ * still queued.
+ */
+CAMLprim value
+zkocaml_drain_completions(value max_events)
+{
+  CAMLparam1(max_events);
+
+  long limit = Long_val(max_events);
+  long delivered = 0;
+  zkocaml_event_t *event = NULL;
+  value result;
+
+  pthread_once(&zkocaml_delivery_once, zkocaml_delivery_init);
+  zkocaml_delivery_clear();
+  while (limit <= 0 || delivered < limit) {
+    event = zkocaml_ring_pop();
+    if (event == NULL) break;
+    delivered++;
+    result = zkocaml_event_deliver(event);
+    zkocaml_event_free(event);
+    if (Is_exception_result(result)) {
+      if (zkocaml_ring_pending()) zkocaml_delivery_signal();
+      zkocaml_reraise(result);
+    }
+  }
+  if (limit > 0 && delivered == limit) zkocaml_delivery_signal();
+
+  CAMLreturn(Val_long(delivered));
+}
+
+/**
+ * Returns the descriptor, events and timeout the single-threaded client
+ * wants the application's event loop to wait for.
+ *
+ * The fd may change after a reconnect, so call this before every wait.
+ * The returned timeout, in milliseconds, is when zookeeper_process must
+ * be called at the latest even if the fd never becomes ready, so that
+ * pings are sent and the session stays alive.
+ *
+ * Only available in the single-threaded build; the multi-threaded client
+ * drives its own IO thread.
+ */
+CAMLprim value
+zkocaml_interest(value zh)
 {
   CAMLparam1(zh);
-  CAMLlocal1(state);
+  CAMLlocal1(result);
+
+#if defined(ZKOCAML_SINGLE_THREADED)
+  CAMLlocal2(error, interest);
 
+  int fd = -1;
+  int events = 0;
+  struct timeval tv = { 0, 0 };
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  state = zoo_state(zhandle->handle);
 
-  CAMLreturn(state);
+  int rc = zookeeper_interest(zhandle->handle, &fd, &events, &tv);
+
+  error = zkocaml_enum_error_c2ml(rc);
+  interest = caml_alloc(4, 0);
+  Store_field(interest, 0, Val_int(fd));
+  Store_field(interest, 1, Val_bool(events & ZOOKEEPER_READ));
+  Store_field(interest, 2, Val_bool(events & ZOOKEEPER_WRITE));
+  Store_field(interest, 3, Val_long(tv.tv_sec * 1000 + tv.tv_usec / 1000));
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, interest);
+#else
+  caml_failwith("Zookeeper.interest: only available in zookeeper_st");
+#endif
+
+  CAMLreturn(result);
 }
 
 /**
- * Create a node.
+ * Lets the single-threaded client perform the IO the fd is ready for,
+ * then runs every completion and watcher callback that became ready, on
+ * the calling thread.
+ *
+ * @readable whether the fd returned by zkocaml_interest is readable.
+ *
+ * @writable whether the fd returned by zkocaml_interest is writable.
+ *
+ * @return ZOK, ZNOTHING when there was nothing to process, or an error
+ * such as ZCONNECTIONLOSS after which the client reconnects on its own.
+ */
+CAMLprim value
+zkocaml_process(value zh, value readable, value writable)
+{
+  CAMLparam3(zh, readable, writable);
+  CAMLlocal1(result);
+
+#if defined(ZKOCAML_SINGLE_THREADED)
+  int events = 0;
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  if (Bool_val(readable)) events |= ZOOKEEPER_READ;
+  if (Bool_val(writable)) events |= ZOOKEEPER_WRITE;
+
+  int rc = zookeeper_process(zhandle->handle, events);
+  result = zkocaml_enum_error_c2ml(rc);
+#else
+  caml_failwith("Zookeeper.process: only available in zookeeper_st");
+#endif
+
+  CAMLreturn(result);
+}
+
+#if !defined(ZKOCAML_SINGLE_THREADED)
+
+/**
+ * Create a node synchronously.
  *
  * This method will create a node in ZooKeeper. A node can only be created if
  * it does not already exists. The Create Flags affect the creation of nodes.
  * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
  * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
- * monotonically increasing sequence number is appended to the path name. The
- * sequence number is always fixed length of 10 digits, 0 padded.
+ * monotonically increasing sequence number is appended to the path name.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to zookeeper_init.
  *
  * @path The name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @value The data to be stored in the node.
+ * @val The data to be stored in the node.
  *
  * @acl The initial ACL of the node. The ACL must not be null or empty.
  *
  * @flags this parameter can be set to 0 for normal create or an OR
  * of the Create Flags
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @path_buffer Buffer which will be filled with the path of the
+ * new node (this might be different than the supplied path
+ * because of the ZOO_SEQUENCE flag).  The path string will always be
+ * null-terminated. This parameter may be NULL if path_buffer_len = 0.
+ *
+ * @path_buffer_len Size of path buffer; if the path of the new
+ * node (including space for the null terminator) exceeds the buffer size,
+ * the path string will be truncated to fit.  The actual path of the
+ * new node in the server will not be affected by the truncation.
+ * The path string will always be null-terminated.
+ *
+ * @return one of the following codes are returned:
  *   ZOK operation completed successfully
  *   ZNONODE the parent node does not exist.
  *   ZNODEEXISTS the node already exists
  *   ZNOAUTH the client does not have permission.
  *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
- *
- * @data The data that will be passed to the completion routine when the
- * function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_acreate_native(value zh,
-                       value path,
-                       value val,
-                       value acl,
-                       value flags,
-                       value completion,
-                       value data)
+zkocaml_create(value zh,
+                      value path,
+                      value val,
+                      value acl,
+                      value flags)
 {
   CAMLparam5(zh, path, val, acl, flags);
-  CAMLxparam2(completion, data);
-  CAMLlocal1(result);
+  CAMLlocal3(result, error, buffer);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_CREATE, path,
+                                 caml_string_length(val));
 
   struct ACL_vector local_acl;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  const char *local_val = String_val(val);
-  size_t local_val_len = strlen(local_val);
+  char *path_buffer = (char *)malloc(
+                      sizeof(char) * ZKOCAML_MAX_PATH_BUFFER_SIZE);
+  memset(path_buffer, 0, ZKOCAML_MAX_PATH_BUFFER_SIZE);
+  char *local_path = zkocaml_copy_string_val(path);
+  char *local_val = zkocaml_copy_string_val(val);
+  int local_val_len = caml_string_length(val);
   int r = zkocaml_parse_acls(acl, &local_acl);
   if (r == 0) {
     local_acl = ZOO_OPEN_ACL_UNSAFE;
   }
   int local_flags = zkocaml_enum_create_flag_ml2c(flags);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_acreate(zhandle->handle,
-                       local_path,
-                       local_val,
-                       local_val_len,
-                       (const struct ACL_vector *)&local_acl,
-                       local_flags,
-                       string_completion_dispatch,
-                       local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_CREATE);
+  caml_enter_blocking_section();
+  int rc = zoo_create(zhandle->handle,
+                      local_path,
+                      local_val,
+                      local_val_len,
+                      (const struct ACL_vector *)&local_acl,
+                      local_flags,
+                      path_buffer,
+                      ZKOCAML_MAX_PATH_BUFFER_SIZE
+                      );
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_CREATE, started, rc,
+                 local_path, local_val_len);
 
-  CAMLreturn(result);
-}
+  free(local_path);
+  free(local_val);
+  if (r != 0) deallocate_ACL_vector(&local_acl);
 
-CAMLprim value
-zkocaml_acreate_bytecode(value *argv, int argn)
-{
-  return zkocaml_acreate_native(argv[0], argv[1], argv[2], argv[3],
-                                argv[4], argv[5], argv[6]);
+  error = zkocaml_enum_error_c2ml(rc);
+  buffer = caml_copy_string(path_buffer);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, buffer);
+  free(path_buffer);
+  zkocaml_trace_end(span, rc, NULL, 0);
+
+  CAMLreturn(result);
 }
 
 /**
- * Delete a node in zookeeper.
+ * Delete a node in zookeeper synchronously.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
@@ -1130,52 +6155,43 @@ zkocaml_acreate_bytecode(value *argv, int argn)
  * actual version of the node does not match the expected version.
  * If -1 is used the version check will not take place.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @return one of the following values is returned.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADVERSION expected version does not match actual version.
  *   ZNOTEMPTY children are present; node cannot be deleted.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_adelete(value zh,
-                value path,
-                value version,
-                value completion,
-                value data)
+zkocaml_delete(value zh, value path, value version)
 {
-  CAMLparam5(zh, path, version, completion, data);
+  CAMLparam3(zh, path, version);
   CAMLlocal1(result);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_DELETE, path, 0);
+
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_version = Int_val(version);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_adelete(zhandle->handle,
-                       local_path,
-                       local_version,
-                       void_completion_dispatch,
-                       local_data);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_DELETE);
+  caml_enter_blocking_section();
+  int rc = zoo_delete(zhandle->handle, local_path, local_version);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_DELETE, started, rc, local_path, 0);
+
+  free(local_path);
   result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_trace_end(span, rc, NULL, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper.
+ * Checks the existence of a node in zookeeper synchronously.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
@@ -1186,55 +6202,54 @@ zkocaml_adelete(value zh,
  * client if the node changes. The watch will be set even if the node does not
  * exist. This allows clients to watch for nodes to appear.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @stat the returned stat value of the node.
+ *
+ * @return return code of the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when the
- * function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aexists(value zh,
-                value path,
-                value watch,
-                value completion,
-                value data)
+zkocaml_exists(value zh, value path, value watch)
 {
-  CAMLparam5(zh, path, watch, completion, data);
-  CAMLlocal1(result);
+  CAMLparam3(zh, path, watch);
+  CAMLlocal3(result, error, stat);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
 
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_watch = Int_val(watch);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aexists(zhandle->handle,
-                       local_path,
-                       local_watch,
-                       stat_completion_dispatch,
-                       local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_EXISTS);
+  caml_enter_blocking_section();
+  int rc = zoo_exists(zhandle->handle,
+                      local_path,
+                      local_watch,
+                      (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_EXISTS, started, rc, local_path, 0);
+
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Checks the existence of a node in zookeeper.
+ * Checks the existence of a node in zookeeper synchronously.
  *
- * This function is similar to zoo_axists except it allows one specify
- * a watcher object - a function pointer and associated context. The function
- * will be called once the watch has fired. The associated context data will be
- * passed to the function as the watcher context parameter.
+ * This function is similar to zoo_exists except it allows one specify
+ * a watcher object rather than a boolean watch flag.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
@@ -1249,63 +6264,68 @@ zkocaml_aexists(value zh,
  * Unlike the global context set by zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @stat the return stat value of the node.
+ *
+ * @return return code of the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when the
- * function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_awexists_native(value zh,
-                        value path,
-                        value watcher_callback,
-                        value watcher_ctx,
-                        value completion,
-                        value data)
+zkocaml_wexists(value zh,
+                value path,
+                value watcher_callback,
+                value watcher_ctx)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal3(result, error, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
+
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+  char *local_path = zkocaml_copy_string_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_DATA,
+                        watcher_callback, watcher_ctx, 1);
+  zkocaml_watch_slot_t *slot = sub != NULL && sub->arming ? sub->slot : NULL;
+  int rc;
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_EXISTS);
+  caml_enter_blocking_section();
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (slot != NULL) {
+    rc = zoo_wexists(zhandle->handle,
+                     local_path,
+                     watch_fanout_dispatch,
+                     slot,
+                     (struct Stat *)&local_stat);
+  } else {
+    rc = zoo_exists(zhandle->handle, local_path, 0,
+                    (struct Stat *)&local_stat);
+  }
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_EXISTS, started, rc, local_path, 0);
 
-  int rc = zoo_awexists(zhandle->handle,
-                        local_path,
-                        watcher_dispatch,
-                        local_ctx,
-                        stat_completion_dispatch,
-                        local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_watch_settle(sub, rc);
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
   CAMLreturn(result);
-}
 
-CAMLprim value
-zkocaml_awexists_bytecode(value *argv, int argn)
-{
-  return zkocaml_awexists_native(argv[0], argv[1], argv[2],
-                                 argv[3], argv[4], argv[5]);
 }
 
 /**
- * Gets the data associated with a node.
+ * Gets the data associated with a node synchronously.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
@@ -1315,55 +6335,72 @@ zkocaml_awexists_bytecode(value *argv, int argn)
  * @watch if nonzero, a watch will be set at the server to notify
  * the client if the node changes.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @buffer the buffer holding the node data returned by the server. It is
+ * sized from the node's stat.dataLength and returned byte for byte, so
+ * values of any length and values containing NUL bytes come back intact.
+ *
+ * @stat if not NULL, will hold the value of stat for the path on return.
+ *
+ * @return return value of the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget(value zh,
-             value path,
-             value watch,
-             value completion,
-             value data)
+zkocaml_get(value zh,
+            value path,
+            value watch)
 {
-  CAMLparam5(zh, path, watch, completion, data);
-  CAMLlocal1(result);
+  CAMLparam3(zh, path, watch);
+  CAMLlocal4(result, error, buffer, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
+
+  char *data_buffer = NULL;
+  int data_buffer_len = 0;
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_watch = Int_val(watch);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aget(zhandle->handle,
-                    local_path,
-                    local_watch,
-                    data_completion_dispatch,
-                    local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET);
+  caml_enter_blocking_section();
+  int rc = zkocaml_get_sized(zhandle->handle,
+                             local_path,
+                             local_watch,
+                             NULL,
+                             NULL,
+                             &data_buffer,
+                             &data_buffer_len,
+                             (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET, started, rc, local_path, data_buffer_len);
+
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  buffer = zkocaml_copy_buffer(rc == ZOK ? data_buffer : NULL,
+                               data_buffer_len);
+  zkocaml_release_get_buffer(data_buffer);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, buffer);
+  Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, data_buffer_len);
 
   CAMLreturn(result);
 }
 
 /**
- * Gets the data associated with a node.
+ * Gets the data associated with a node synchronously.
  *
- * This function is similar to zoo_aget except it allows one specify
+ * This function is similar to zoo_get except it allows one specify
  * a watcher object rather than a boolean watch flag.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -1372,68 +6409,139 @@ zkocaml_aget(value zh,
  * the client if the node changes.
  *
  * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
+ * Unlike the global context set by \ref zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @buffer the buffer holding the node data returned by the server. It is
+ * sized from the node's stat.dataLength and returned byte for byte, so
+ * values of any length and values containing NUL bytes come back intact.
+ *
+ * @stat if not NULL, will hold the value of stat for the path on return.
+ *
+ * @return return value of the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_awget_native(value zh,
-                     value path,
-                     value watcher_callback,
-                     value watcher_ctx,
-                     value completion,
-                     value data)
+zkocaml_wget(value zh,
+             value path,
+             value watcher_callback,
+             value watcher_ctx)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal4(result, error, buffer, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
+
+  char *data_buffer = NULL;
+  int data_buffer_len = 0;
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+  char *local_path = zkocaml_copy_string_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_DATA,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_watch_slot_t *slot = sub != NULL && sub->arming ? sub->slot : NULL;
+  int rc = ZINVALIDSTATE;
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET);
+  caml_enter_blocking_section();
+  if (zhandle->handle != NULL) {
+    rc = zkocaml_get_sized(zhandle->handle,
+                           local_path,
+                           0,
+                           slot != NULL ? watch_fanout_dispatch : NULL,
+                           slot,
+                           &data_buffer,
+                           &data_buffer_len,
+                           (struct Stat *)&local_stat);
+  }
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET, started, rc, local_path, data_buffer_len);
 
-  int rc = zoo_awget(zhandle->handle,
-                     local_path,
-                     watcher_dispatch,
-                     local_ctx,
-                     data_completion_dispatch,
-                     local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_watch_settle(sub, rc);
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  buffer = zkocaml_copy_buffer(rc == ZOK ? data_buffer : NULL,
+                               data_buffer_len);
+  zkocaml_release_get_buffer(data_buffer);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, buffer);
+  Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, data_buffer_len);
 
   CAMLreturn(result);
 }
 
+/**
+ * Sets the data associated with a node. See zoo_set2 function if
+ * you require access to the stat information associated with the znode.
+ *
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ *
+ * @path the name of the node. Expressed as a file name with slashes
+ * separating ancestors of the node.
+ *
+ * @buffer the buffer holding data to be written to the node.
+ *
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place.
+ *
+ * @return the return code for the function call.
+ *   ZOK operation completed successfully
+ *   ZNONODE the node does not exist.
+ *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
+ *   ZBADARGUMENTS - invalid input parameters
+ *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
 CAMLprim value
-zkocaml_awget_bytecode(value *argv, int argn)
+zkocaml_set(value zh, value path, value buffer, value version)
 {
-  return zkocaml_awget_native(argv[0], argv[1], argv[2],
-                              argv[3], argv[4], argv[5]);
+  CAMLparam4(zh, path, buffer, version);
+  CAMLlocal1(result);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET, path,
+                                 caml_string_length(buffer));
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  char *local_path = zkocaml_copy_string_val(path);
+  char *local_buffer = zkocaml_copy_string_val(buffer);
+  int buffer_len = caml_string_length(buffer);
+  int local_version = Int_val(version);
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_SET);
+  caml_enter_blocking_section();
+  int rc = zoo_set(zhandle->handle,
+                   local_path,
+                   local_buffer,
+                   buffer_len,
+                   local_version);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_SET, started, rc, local_path, buffer_len);
+
+  free(local_path);
+  free(local_buffer);
+  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_trace_end(span, rc, NULL, 0);
+
+  CAMLreturn(result);
 }
 
 /**
- * Sets the data associated with a node.
+ * Sets the data associated with a node. This function is the same
+ * as zoo_set except that it also provides access to stat information
+ * associated with the znode.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -1442,70 +6550,62 @@ zkocaml_awget_bytecode(value *argv, int argn)
  *
  * @version the expected version of the node. The function will fail if
  * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place. * completion: If null,
- * the function will execute synchronously. Otherwise, the function will return
- * immediately and invoke the completion routine when the request completes.
+ * used the version check will not take place.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @stat if not NULL, will hold the value of stat for the path on return.
+ *
+ * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADVERSION expected version does not match actual version.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aset_native(value zh,
-                    value path,
-                    value buffer,
-                    value version,
-                    value completion,
-                    value data)
+zkocaml_set2(value zh, value path, value buffer, value version)
 {
-  CAMLparam5(zh, path, buffer, version, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, buffer, version);
+  CAMLlocal3(result, error, stat);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET, path,
+                                 caml_string_length(buffer));
 
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  const char *local_buffer = String_val(buffer);
-  size_t buffer_len = strlen(local_buffer);
+  char *local_path = zkocaml_copy_string_val(path);
+  char *local_buffer = zkocaml_copy_string_val(buffer);
+  int buffer_len = caml_string_length(buffer);
   int local_version = Int_val(version);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aset(zhandle->handle,
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_SET);
+  caml_enter_blocking_section();
+  int rc = zoo_set2(zhandle->handle,
                     local_path,
                     local_buffer,
                     buffer_len,
                     local_version,
-                    stat_completion_dispatch,
-                    local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+                    (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_SET, started, rc, local_path, buffer_len);
 
-  CAMLreturn(result);
-}
+  free(local_path);
+  free(local_buffer);
+  error = zkocaml_enum_error_c2ml(rc);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
-CAMLprim value
-zkocaml_aset_bytecode(value *argv, int argn)
-{
-  return zkocaml_aset_native(argv[0], argv[1], argv[2],
-                             argv[3], argv[4], argv[5]);
+  CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node.
+ * Lists the children of a node synchronously.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -1513,52 +6613,54 @@ zkocaml_aset_bytecode(value *argv, int argn)
  * @watch if nonzero, a watch will be set at the server to notify
  * the client if the node changes.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @strings return value of children paths.
+ *
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget_children(value zh,
-                      value path,
-                      value watch,
-                      value completion,
-                      value data)
+zkocaml_get_children(value zh, value path, value watch)
 {
-  CAMLparam5(zh, path, watch, completion, data);
-  CAMLlocal1(result);
+  CAMLparam3(zh, path, watch);
+  CAMLlocal3(result, error, strs);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
 
+  struct String_vector local_strings = { 0, NULL };
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_watch = Int_val(watch);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aget_children(zhandle->handle,
-                             local_path,
-                             local_watch,
-                             strings_completion_dispatch,
-                             local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_CHILDREN);
+  caml_enter_blocking_section();
+  int rc = zoo_get_children(zhandle->handle,
+                      local_path,
+                      local_watch,
+                      (struct String_vector *)&local_strings);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_CHILDREN, started, rc, local_path, 0);
+
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  strs = zkocaml_build_strings_struct(&local_strings);
+  deallocate_String_vector(&local_strings);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, strs);
+  zkocaml_trace_end(span, rc, NULL, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node.
+ * Lists the children of a node synchronously.
  *
- * This function is similar to zoo_aget_children except it allows one specify
+ * This function is similar to zoo_get_children except it allows one specify
  * a watcher object rather than a boolean watch flag.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
@@ -1570,70 +6672,75 @@ zkocaml_aget_children(value zh,
  * the client if the node changes.
  *
  * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
+ * Unlike the global context set by \ref zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @strings return value of children paths.
+ *
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_awget_children_native(value zh,
-                              value path,
-                              value watcher_callback,
-                              value watcher_ctx,
-                              value completion,
-                              value data)
+zkocaml_wget_children(value zh,
+                      value path,
+                      value watcher_callback,
+                      value watcher_ctx)
 {
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal3(result, error, strs);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
 
+  struct String_vector local_strings = { 0, NULL };
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+  char *local_path = zkocaml_copy_string_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_CHILD,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_watch_slot_t *slot = sub != NULL && sub->arming ? sub->slot : NULL;
+  int rc;
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_CHILDREN);
+  caml_enter_blocking_section();
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (slot != NULL) {
+    rc = zoo_wget_children(zhandle->handle,
+                           local_path,
+                           watch_fanout_dispatch,
+                           slot,
+                           (struct String_vector *)&local_strings);
+  } else {
+    rc = zoo_get_children(zhandle->handle, local_path, 0,
+                          (struct String_vector *)&local_strings);
+  }
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_CHILDREN, started, rc, local_path, 0);
 
-  int rc = zoo_awget_children(zhandle->handle,
-                              local_path,
-                              watcher_dispatch,
-                              local_ctx,
-                              strings_completion_dispatch,
-                              local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_watch_settle(sub, rc);
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  strs = zkocaml_build_strings_struct(&local_strings);
+  deallocate_String_vector(&local_strings);
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, strs);
+  zkocaml_trace_end(span, rc, NULL, 0);
 
   CAMLreturn(result);
 }
 
-CAMLprim value
-zkocaml_awget_children_bytecode(value *argv, int argn)
-{
-  return zkocaml_awget_children_native(argv[0], argv[1], argv[2],
-                                       argv[3], argv[4], argv[5]);
-}
-
 /**
- * Lists the children of a node, and get the parent stat.
+ * Lists the children of a node and get its stat synchronously.
  *
  * This function is new in version 3.3.0
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -1641,57 +6748,67 @@ zkocaml_awget_children_bytecode(value *argv, int argn)
  * @watch if nonzero, a watch will be set at the server to notify
  * the client if the node changes.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @strings return value of children paths.
+ *
+ * @stat return value of node stat.
+ *
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget_children2(value zh,
-                       value path,
-                       value watch,
-                       value completion,
-                       value data)
+zkocaml_get_children2(value zh,
+                      value path,
+                      value watch)
 {
-  CAMLparam5(zh, path, watch, completion, data);
-  CAMLlocal1(result);
+  CAMLparam3(zh, path, watch);
+  CAMLlocal4(result, error, strs, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  struct String_vector local_strings = { 0, NULL };
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_watch = Int_val(watch);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aget_children2(zhandle->handle,
-                              local_path,
-                              local_watch,
-                              strings_stat_completion_dispatch,
-                              local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_CHILDREN);
+  caml_enter_blocking_section();
+  int rc = zoo_get_children2(zhandle->handle,
+                      local_path,
+                      local_watch,
+                      (struct String_vector *)&local_strings,
+                      (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_CHILDREN, started, rc, local_path, 0);
+
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  strs = zkocaml_build_strings_struct(&local_strings);
+  deallocate_String_vector(&local_strings);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, strs);
+  Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node, and get the parent stat.
+ * Lists the children of a node and get its stat synchronously.
  *
- * This function is similar to zoo_aget_children2 except it allows one specify
+ * This function is similar to \ref zoo_get_children except it allows one specify
  * a watcher object rather than a boolean watch flag.
  *
  * This function is new in version 3.3.0
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
@@ -1700,1175 +6817,1858 @@ zkocaml_aget_children2(value zh,
  * the client if the node changes.
  *
  * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
+ * Unlike the global context set by \ref zookeeper_init, this watcher context
  * is associated with the given instance of the watcher only.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
- */
-CAMLprim value
-zkocaml_awget_children2_native(value zh,
-                               value path,
-                               value watcher_callback,
-                               value watcher_ctx,
-                               value completion,
-                               value data)
-{
-  CAMLparam5(zh, path, watcher_callback, watcher_ctx, completion);
-  CAMLxparam1(data);
-  CAMLlocal1(result);
-
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
-
-  int rc = zoo_awget_children2(zhandle->handle,
-                               local_path,
-                               watcher_dispatch,
-                               local_ctx,
-                               strings_stat_completion_dispatch,
-                               local_data);
-  result = zkocaml_enum_error_c2ml(rc);
-
-  CAMLreturn(result);
-}
-
-CAMLprim value
-zkocaml_awget_children2_bytecode(value *argv, int argn)
-{
-  return zkocaml_awget_children2_native(argv[0], argv[1], argv[2],
-                                        argv[3], argv[4], argv[5]);
-}
-
-/**
- * Flush leader channel.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @strings return value of children paths.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
+ * @stat return value of node stat.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @return the return code of the function.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_async(value zh, value path, value completion, value data)
+zkocaml_wget_children2(value zh,
+                              value path,
+                              value watcher_callback,
+                              value watcher_ctx)
 {
-  CAMLparam4(zh, path, completion, data);
-  CAMLlocal1(result);
+  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLlocal4(result, error, strs, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_CHILDREN, path, 0);
+
+  struct String_vector local_strings = { 0, NULL };
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+  char *local_path = zkocaml_copy_string_val(path);
+  zkocaml_watch_subscriber_t *sub =
+    zkocaml_watch_begin(zhandle, local_path, ZKOCAML_WATCH_CHILD,
+                        watcher_callback, watcher_ctx, 0);
+  zkocaml_watch_slot_t *slot = sub != NULL && sub->arming ? sub->slot : NULL;
+  int rc;
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_CHILDREN);
+  caml_enter_blocking_section();
+  if (zhandle->handle == NULL) {
+    rc = ZINVALIDSTATE;
+  } else if (slot != NULL) {
+    rc = zoo_wget_children2(zhandle->handle,
+                            local_path,
+                            watch_fanout_dispatch,
+                            slot,
+                            (struct String_vector *)&local_strings,
+                            (struct Stat *)&local_stat);
+  } else {
+    rc = zoo_get_children2(zhandle->handle, local_path, 0,
+                           (struct String_vector *)&local_strings,
+                           (struct Stat *)&local_stat);
+  }
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_CHILDREN, started, rc, local_path, 0);
 
-  int rc = zoo_async(zhandle->handle,
-                     local_path,
-                     string_completion_dispatch,
-                     local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_watch_settle(sub, rc);
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  strs = zkocaml_build_strings_struct(&local_strings);
+  deallocate_String_vector(&local_strings);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, strs);
+  Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Gets the acl associated with a node.
+ * Gets the acl associated with a node synchronously.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @acl the return value of acls on the path.
+ *
+ * @stat returns the stat of the path specified.
+ *
+ * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aget_acl(value zh, value path, value completion, value data)
+zkocaml_get_acl(value zh, value path)
 {
-  CAMLparam4(zh, path, completion, data);
-  CAMLlocal1(result);
+  CAMLparam2(zh, path);
+  CAMLlocal4(result, error, acls, stat);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET_ACL, path, 0);
+
+  struct ACL_vector local_acl = { 0, NULL };
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+  char *local_path = zkocaml_copy_string_val(path);
 
-  int rc = zoo_aget_acl(zhandle->handle,
-                        local_path,
-                        acl_completion_dispatch,
-                        local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_ACL);
+  caml_enter_blocking_section();
+  int rc = zoo_get_acl(zhandle->handle,
+                      local_path,
+                      (struct ACL_vector*)&local_acl,
+                      (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_ACL, started, rc, local_path, 0);
+
+  free(local_path);
+  error = zkocaml_enum_error_c2ml(rc);
+  acls = zkocaml_build_acls_struct(&local_acl);
+  deallocate_ACL_vector(&local_acl);
+  stat = zkocaml_build_stat_struct(&local_stat);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, acls);
+  Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the acl associated with a node.
+ * Sets the acl associated with a node synchronously.
  *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
+ * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @buffer the buffer holding the acls to be written to the node.
+ * @version the expected version of the path.
  *
- * @completion the routine to invoke when the request completes. The completion
- * will be triggered with one of the following codes passed in as the rc argument:
+ * @acl the acl to be set on the path.
+ *
+ * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZINVALIDACL invalid ACL specified
  *   ZBADVERSION expected version does not match actual version.
- *
- * @data the data that will be passed to the completion routine when
- * the function completes.
- *
- * @return ZOK on success or one of the following errcodes on failure:
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_aset_acl_native(value zh,
-                 value path,
-                 value version,
-                 value acl,
-                 value completion,
-                 value data)
+zkocaml_set_acl(value zh, value path, value version, value acl)
 {
-  CAMLparam5(zh, path, version, acl, completion);
-  CAMLxparam1(data);
+  CAMLparam4(zh, path, version, acl);
   CAMLlocal1(result);
 
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET_ACL, path, 0);
+
   struct ACL_vector local_acl;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_version = Int_val(version);
   int r = zkocaml_parse_acls(acl, &local_acl);
   if (r == 0) {
     local_acl = ZOO_OPEN_ACL_UNSAFE;
   }
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
 
-  int rc = zoo_aset_acl(zhandle->handle,
-                        local_path,
-                        local_version,
-                        (struct ACL_vector *)&local_acl,
-                        void_completion_dispatch,
-                        local_data);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_SET_ACL);
+  caml_enter_blocking_section();
+  int rc = zoo_set_acl(zhandle->handle,
+                       local_path,
+                       local_version,
+                       (const struct ACL_vector *)&local_acl);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_SET_ACL, started, rc, local_path, 0);
+
+  free(local_path);
+  if (r != 0) deallocate_ACL_vector(&local_acl);
   result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_trace_end(span, rc, NULL, 0);
 
   CAMLreturn(result);
 }
 
+
+/**
+ * Atomically commits multiple zookeeper operations synchronously.
+ *
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @ops an array of ops to commit
+ *
+ * @return the return code of the whole transaction together with one
+ * op_result per op, in order. The created path of a Create_op and the
+ * stat of a Set_op are only meaningful when that op's error is ZOK.
+ */
 CAMLprim value
-zkocaml_aset_acl_bytecode(value *argv, int argn)
+zkocaml_multi(value zh, value ops)
 {
-  return zkocaml_aset_acl_native(argv[0], argv[1], argv[2],
-                                 argv[3], argv[4], argv[5]);
+  CAMLparam2(zh, ops);
+  CAMLlocal3(result, error, results);
+
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_MULTI, Val_unit, 0);
+
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  zkocaml_multi_t *multi = zkocaml_parse_multi_ops(ops);
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_MULTI);
+  caml_enter_blocking_section();
+  int rc = zoo_multi(zhandle->handle,
+                     multi->count,
+                     multi->ops,
+                     multi->results);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_MULTI, started, rc, NULL, 0);
+
+  error = zkocaml_enum_error_c2ml(rc);
+  results = zkocaml_build_multi_results(multi, rc);
+  zkocaml_multi_free(multi);
+
+  result = caml_alloc(2, 0);
+  Store_field(result, 0, error);
+  Store_field(result, 1, results);
+  zkocaml_trace_end(span, rc, NULL, 0);
+
+  CAMLreturn(result);
 }
 
 /**
- * Return an error string.
- *
- * @rc return code.
- * @return string corresponding to the return code
+ * Bulk reads submit one asynchronous request per path back to back and
+ * collect every reply in C, so N reads cost one pipelined burst instead
+ * of N round trips. The completions below run on the C client thread and
+ * never touch the OCaml runtime; the calling thread waits for the whole
+ * batch with the runtime lock released and converts the results in one
+ * go once it has it back.
  */
-CAMLprim value
-zkocaml_zerror(value rc)
+#define ZKOCAML_BULK_GET          0
+#define ZKOCAML_BULK_EXISTS       1
+#define ZKOCAML_BULK_GET_CHILDREN 2
+
+typedef struct zkocaml_batch_s_ {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int pending;
+} zkocaml_batch_t;
+
+typedef struct zkocaml_batch_entry_s_ {
+  zkocaml_batch_t *batch;
+  char *path;
+  zkocaml_op_type_t op;
+  int64_t started;
+  int rc;
+  char *val;
+  int val_len;
+  struct Stat stat;
+  struct String_vector strings;
+} zkocaml_batch_entry_t;
+
+static void
+zkocaml_batch_entry_done(zkocaml_batch_entry_t *entry, int rc)
 {
-  CAMLparam1(rc);
-  CAMLlocal1(result);
+  zkocaml_batch_t *batch = entry->batch;
 
-  const char *errstr = zerror(Int_val(rc));
-  result = caml_copy_string(errstr);
+  zkocaml_op_end(entry->op, entry->started, rc, entry->path, entry->val_len);
+  entry->rc = rc;
+  pthread_mutex_lock(&batch->lock);
+  if (--batch->pending == 0) pthread_cond_signal(&batch->done);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+static void
+batch_data_completion(int rc,
+                      const char *val,
+                      int val_len,
+                      const struct Stat *stat,
+                      const void *data)
+{
+  zkocaml_batch_entry_t *entry = (zkocaml_batch_entry_t *)data;
+
+  if (rc == ZOK && val != NULL && val_len > 0) {
+    entry->val = (char *)malloc(val_len);
+    memcpy(entry->val, val, val_len);
+    entry->val_len = val_len;
+  }
+  if (stat != NULL) entry->stat = *stat;
+  zkocaml_batch_entry_done(entry, rc);
+}
+
+static void
+batch_stat_completion(int rc, const struct Stat *stat, const void *data)
+{
+  zkocaml_batch_entry_t *entry = (zkocaml_batch_entry_t *)data;
+
+  if (stat != NULL) entry->stat = *stat;
+  zkocaml_batch_entry_done(entry, rc);
+}
+
+static void
+batch_strings_completion(int rc,
+                         const struct String_vector *strings,
+                         const void *data)
+{
+  zkocaml_batch_entry_t *entry = (zkocaml_batch_entry_t *)data;
+
+  if (rc == ZOK) zkocaml_copy_string_vector(&entry->strings, strings);
+  zkocaml_batch_entry_done(entry, rc);
+}
+
+/**
+ * Submit one request of the given kind per entry and wait until all of
+ * them have completed. Requests the C client refuses to submit complete
+ * immediately with the refusal code. Must be called with the runtime lock
+ * released.
+ */
+static void
+zkocaml_bulk_run(zhandle_t *zh,
+                 int kind,
+                 zkocaml_batch_entry_t *entries,
+                 int count)
+{
+  int i = 0;
+  zkocaml_batch_t batch;
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.done, NULL);
+  batch.pending = count;
+
+  for (; i < count; i++) {
+    int rc = ZOK;
+    entries[i].batch = &batch;
+    entries[i].op = kind == ZKOCAML_BULK_GET ? ZKOCAML_OP_TYPE_GET
+      : kind == ZKOCAML_BULK_EXISTS ? ZKOCAML_OP_TYPE_EXISTS
+      : ZKOCAML_OP_TYPE_GET_CHILDREN;
+    entries[i].started = zkocaml_op_begin(entries[i].op);
+    switch (kind) {
+    case ZKOCAML_BULK_GET:
+      rc = zoo_aget(zh, entries[i].path, 0,
+                    batch_data_completion, &entries[i]);
+      break;
+    case ZKOCAML_BULK_EXISTS:
+      rc = zoo_aexists(zh, entries[i].path, 0,
+                       batch_stat_completion, &entries[i]);
+      break;
+    case ZKOCAML_BULK_GET_CHILDREN:
+      rc = zoo_aget_children(zh, entries[i].path, 0,
+                             batch_strings_completion, &entries[i]);
+      break;
+    }
+    if (rc != ZOK) zkocaml_batch_entry_done(&entries[i], rc);
+  }
+
+  pthread_mutex_lock(&batch.lock);
+  while (batch.pending > 0) pthread_cond_wait(&batch.done, &batch.lock);
+  pthread_mutex_unlock(&batch.lock);
+
+  pthread_cond_destroy(&batch.done);
+  pthread_mutex_destroy(&batch.lock);
+}
+
+/**
+ * Run a bulk read of the given kind over an OCaml string array and build
+ * the OCaml result array: (error, data, stat) tuples for
+ * ZKOCAML_BULK_GET, (error, stat) for ZKOCAML_BULK_EXISTS and
+ * (error, strings) for ZKOCAML_BULK_GET_CHILDREN.
+ */
+static value
+zkocaml_bulk(value zh, value paths, int kind)
+{
+  CAMLparam2(zh, paths);
+  CAMLlocal3(result, item, field);
+
+  int i = 0, count = Wosize_val(paths);
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  zkocaml_batch_entry_t *entries = (zkocaml_batch_entry_t *)
+    calloc(count > 0 ? count : 1, sizeof(zkocaml_batch_entry_t));
+  for (; i < count; i++) {
+    entries[i].path = zkocaml_copy_string_val(Field(paths, i));
+  }
+
+  caml_enter_blocking_section();
+  zkocaml_bulk_run(zhandle->handle, kind, entries, count);
+  caml_leave_blocking_section();
+
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    item = caml_alloc(kind == ZKOCAML_BULK_GET ? 3 : 2, 0);
+    field = zkocaml_enum_error_c2ml(entries[i].rc);
+    Store_field(item, 0, field);
+    switch (kind) {
+    case ZKOCAML_BULK_GET:
+      field = zkocaml_copy_buffer(entries[i].val, entries[i].val_len);
+      Store_field(item, 1, field);
+      field = zkocaml_build_stat_struct(&entries[i].stat);
+      Store_field(item, 2, field);
+      break;
+    case ZKOCAML_BULK_EXISTS:
+      field = zkocaml_build_stat_struct(&entries[i].stat);
+      Store_field(item, 1, field);
+      break;
+    case ZKOCAML_BULK_GET_CHILDREN:
+      field = zkocaml_build_strings_struct(&entries[i].strings);
+      Store_field(item, 1, field);
+      break;
+    }
+    Store_field(result, i, item);
+
+    free(entries[i].path);
+    free(entries[i].val);
+    deallocate_String_vector(&entries[i].strings);
+  }
+  free(entries);
 
   CAMLreturn(result);
 }
 
 /**
- * Specify application credentials.
- *
- * The application calls this function to specify its credentials for purposes
- * of authentication. The server will use the security provider specified by
- * the scheme parameter to authenticate the client connection. If the
- * authentication request has failed:
- * - the server connection is dropped
- * - the watcher is called with the ZOO_AUTH_FAILED_STATE value as the state
- * parameter.
+ * Gets the data of many nodes in one pipelined burst.
  *
  * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @scheme the id of authentication scheme. Natively supported:
- * "digest" password-based authentication
- *
- * @cert application credentials. The actual value depends on the scheme.
+ * @paths the names of the nodes.
  *
- * @completion the routine to invoke when the request completes. One of
- * the following result codes may be passed into the completion callback:
- *   ZOK operation completed successfully
- *   ZAUTHFAILED authentication failed
+ * @return one (error, data, stat) tuple per path, in order. The error is
+ * that of the individual read, e.g. ZNONODE for a missing node.
+ */
+CAMLprim value
+zkocaml_bulk_get(value zh, value paths)
+{
+  return zkocaml_bulk(zh, paths, ZKOCAML_BULK_GET);
+}
+
+/**
+ * Checks the existence of many nodes in one pipelined burst.
  *
- * @data the data that will be passed to the completion routine when the
- * function completes.
+ * @return one (error, stat) tuple per path, in order.
+ */
+CAMLprim value
+zkocaml_bulk_exists(value zh, value paths)
+{
+  return zkocaml_bulk(zh, paths, ZKOCAML_BULK_EXISTS);
+}
+
+/**
+ * Lists the children of many nodes in one pipelined burst.
  *
- * @return ZOK on success or one of the following errcodes on failure:
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
- *   ZSYSTEMERROR - a system error occured
+ * @return one (error, children) tuple per path, in order.
  */
 CAMLprim value
-zkocaml_add_auth(value zh,
-                 value scheme,
-                 value cert,
-                 value completion,
-                 value data)
+zkocaml_bulk_get_children(value zh, value paths)
 {
-  CAMLparam5(zh, scheme, cert, completion, data);
-  CAMLlocal1(result);
+  return zkocaml_bulk(zh, paths, ZKOCAML_BULK_GET_CHILDREN);
+}
 
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_scheme = String_val(scheme);
-  const char *local_cert = String_val(cert);
-  size_t cert_len = strlen(local_cert);
-  zkocaml_completion_context_t *local_data =
-    (zkocaml_completion_context_t *)malloc(sizeof(zkocaml_completion_context_t));
-  local_data->data = strdup(String_val(data));
-  local_data->completion_callback = completion;
+/**
+ * A subtree fetched by zkocaml_get_tree. Nodes are appended as the
+ * children of earlier nodes arrive, so a parent always precedes its
+ * children, and every node records the index of its parent, so the array
+ * alone describes the tree. Two requests (aget and aget_children) are
+ * issued per node, only aget_children when with_data is off; the node
+ * pointers double as completion data and stay put when the pointer array
+ * grows.
+ */
+typedef struct zkocaml_tree_node_s_ {
+  struct zkocaml_tree_s_ *tree;
+  char *path;
+  int index;
+  int parent;
+  int depth;
+  int rc;
+  char *val;
+  int val_len;
+  struct Stat stat;
+} zkocaml_tree_node_t;
+
+typedef struct zkocaml_tree_s_ {
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+  zkocaml_tree_node_t **nodes;
+  int count;
+  int capacity;
+  int in_flight;
+  int with_data;
+} zkocaml_tree_t;
 
-  int rc = zoo_add_auth(zhandle->handle,
-                        local_scheme,
-                        local_cert,
-                        cert_len,
-                        void_completion_dispatch,
-                        local_data);
-  result = zkocaml_enum_error_c2ml(rc);
+/**
+ * Append a node to the tree. The path is taken over by the tree.
+ * Must be called with tree->lock held, or before the walk starts.
+ */
+static void
+zkocaml_tree_append(zkocaml_tree_t *tree, char *path, int parent)
+{
+  zkocaml_tree_node_t *node = (zkocaml_tree_node_t *)
+    calloc(1, sizeof(zkocaml_tree_node_t));
+  node->tree = tree;
+  node->path = path;
+  node->index = tree->count;
+  node->parent = parent;
+  node->depth = parent < 0 ? 0 : tree->nodes[parent]->depth + 1;
+  node->rc = ZOK;
+
+  if (tree->count == tree->capacity) {
+    tree->capacity = tree->capacity > 0 ? tree->capacity * 2 : 64;
+    tree->nodes = (zkocaml_tree_node_t **)
+      realloc(tree->nodes, tree->capacity * sizeof(zkocaml_tree_node_t *));
+  }
+  tree->nodes[tree->count++] = node;
+}
 
-  CAMLreturn(result);
+static void
+zkocaml_tree_free(zkocaml_tree_t *tree)
+{
+  int i = 0;
+
+  for (; i < tree->count; i++) {
+    free(tree->nodes[i]->path);
+    free(tree->nodes[i]->val);
+    free(tree->nodes[i]);
+  }
+  free(tree->nodes);
+  pthread_cond_destroy(&tree->progress);
+  pthread_mutex_destroy(&tree->lock);
+}
+
+static void
+tree_data_completion(int rc,
+                     const char *val,
+                     int val_len,
+                     const struct Stat *stat,
+                     const void *data)
+{
+  zkocaml_tree_node_t *node = (zkocaml_tree_node_t *)data;
+  zkocaml_tree_t *tree = node->tree;
+
+  pthread_mutex_lock(&tree->lock);
+  if (rc == ZOK) {
+    if (val != NULL && val_len > 0) {
+      node->val = (char *)malloc(val_len);
+      memcpy(node->val, val, val_len);
+      node->val_len = val_len;
+    }
+    if (stat != NULL) node->stat = *stat;
+  } else if (node->rc == ZOK) {
+    node->rc = rc;
+  }
+  tree->in_flight--;
+  pthread_cond_signal(&tree->progress);
+  pthread_mutex_unlock(&tree->lock);
+}
+
+static void
+tree_children_completion(int rc,
+                         const struct String_vector *strings,
+                         const void *data)
+{
+  int i = 0;
+  zkocaml_tree_node_t *node = (zkocaml_tree_node_t *)data;
+  zkocaml_tree_t *tree = node->tree;
+
+  pthread_mutex_lock(&tree->lock);
+  if (rc == ZOK && strings != NULL) {
+    size_t parent_len = strlen(node->path);
+    int is_root = parent_len == 1 && node->path[0] == '/';
+    for (; i < strings->count; i++) {
+      size_t child_len = strlen(strings->data[i]);
+      char *path = (char *)malloc(parent_len + child_len + 2);
+      size_t off = is_root ? 0 : parent_len;
+      memcpy(path, node->path, off);
+      path[off] = '/';
+      memcpy(path + off + 1, strings->data[i], child_len + 1);
+      zkocaml_tree_append(tree, path, node->index);
+    }
+  } else if (rc != ZOK && node->rc == ZOK) {
+    node->rc = rc;
+  }
+  tree->in_flight--;
+  pthread_cond_signal(&tree->progress);
+  pthread_mutex_unlock(&tree->lock);
 }
 
 /**
- * Checks if the current zookeeper connection state can't be recovered.
+ * Walk the tree breadth-first, keeping at most max_in_flight requests
+ * outstanding, until every discovered node has been fetched. Must be
+ * called with the runtime lock released.
+ */
+static void
+zkocaml_tree_walk(zhandle_t *zh, zkocaml_tree_t *tree, int max_in_flight)
+{
+  int next = 0, rc = ZOK;
+
+  pthread_mutex_lock(&tree->lock);
+  while (next < tree->count || tree->in_flight > 0) {
+    while (next < tree->count && tree->in_flight + 2 <= max_in_flight) {
+      zkocaml_tree_node_t *node = tree->nodes[next++];
+      if (tree->with_data) {
+        tree->in_flight++;
+        rc = zoo_aget(zh, node->path, 0, tree_data_completion, node);
+        if (rc != ZOK) {
+          node->rc = rc;
+          tree->in_flight--;
+        }
+      }
+      tree->in_flight++;
+      rc = zoo_aget_children(zh, node->path, 0,
+                             tree_children_completion, node);
+      if (rc != ZOK) {
+        if (node->rc == ZOK) node->rc = rc;
+        tree->in_flight--;
+      }
+    }
+    if (tree->in_flight > 0) {
+      pthread_cond_wait(&tree->progress, &tree->lock);
+    }
+  }
+  pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Fetches a whole subtree, data and stat included.
  *
- *  The application must close the zhandle and try to reconnect.
+ * The hierarchy is walked breadth-first with up to max_in_flight
+ * aget/aget_children requests outstanding, so the time to load a large
+ * subtree is bounded by bandwidth rather than by round trips. The walk is
+ * not atomic: nodes created or deleted meanwhile may or may not appear,
+ * and a node deleted between being listed and being read is reported
+ * with ZNONODE.
  *
- * @zh the zookeeper handle (see zookeeper_init)
- * @return ZINVALIDSTATE if connection is unrecoverable
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
+ *
+ * @root the path of the subtree root.
+ *
+ * @max_in_flight the number of requests kept outstanding; zero or less
+ * selects ZKOCAML_TREE_DEFAULT_IN_FLIGHT.
+ *
+ * @return an array of tree_node records in discovery order: the root
+ * first and every parent before its children. Each records its path, the
+ * index of its parent (-1 for the root), the error of its own reads, its
+ * data and its stat.
  */
 CAMLprim value
-zkocaml_is_unrecoverable(value zh)
+zkocaml_get_tree(value zh, value root, value max_in_flight)
 {
-  CAMLparam1(zh);
-  CAMLlocal1(result);
+  CAMLparam3(zh, root, max_in_flight);
+  CAMLlocal3(result, item, field);
 
+  int i = 0;
+  int local_max_in_flight = Int_val(max_in_flight);
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  int rc = is_unrecoverable(zhandle->handle);
-  result = zkocaml_enum_event_c2ml(rc);
+  zkocaml_tree_t tree;
+
+  if (local_max_in_flight <= 0) {
+    local_max_in_flight = ZKOCAML_TREE_DEFAULT_IN_FLIGHT;
+  } else if (local_max_in_flight < 2) {
+    local_max_in_flight = 2;
+  }
+  memset(&tree, 0, sizeof(tree));
+  pthread_mutex_init(&tree.lock, NULL);
+  pthread_cond_init(&tree.progress, NULL);
+  tree.with_data = 1;
+  zkocaml_tree_append(&tree, zkocaml_copy_string_val(root), -1);
+
+  caml_enter_blocking_section();
+  zkocaml_tree_walk(zhandle->handle, &tree, local_max_in_flight);
+  caml_leave_blocking_section();
+
+  result = caml_alloc(tree.count, 0);
+  for (; i < tree.count; i++) {
+    zkocaml_tree_node_t *node = tree.nodes[i];
+    item = caml_alloc(5, 0);
+    field = caml_copy_string(node->path);
+    Store_field(item, 0, field);
+    Store_field(item, 1, Val_int(node->parent));
+    field = zkocaml_enum_error_c2ml(node->rc);
+    Store_field(item, 2, field);
+    field = zkocaml_copy_buffer(node->val, node->val_len);
+    Store_field(item, 3, field);
+    field = zkocaml_build_stat_struct(&node->stat);
+    Store_field(item, 4, field);
+    Store_field(result, i, item);
+  }
+  zkocaml_tree_free(&tree);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the debugging level for the library
+ * Deletions of a level are first packed into multi batches of up to
+ * ZKOCAML_RMR_BATCH_SIZE nodes. The nodes of a batch that fails are
+ * marked ZKOCAML_RMR_RETRY and deleted one by one afterwards, so that
+ * every failure is reported against the node that caused it.
  */
-CAMLprim value
-zkocaml_set_debug_level(value log_level)
-{
-  CAMLparam1(log_level);
-
-  ZooLogLevel level = zkocaml_enum_loglevel_ml2c(log_level);
-  switch(level) {
-  case ZOO_LOG_LEVEL_ERROR:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-    break;
-  case ZOO_LOG_LEVEL_WARN:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
-    break;
-  case ZOO_LOG_LEVEL_INFO:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
-    break;
-  case ZOO_LOG_LEVEL_DEBUG:
-    zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
-    break;
+#define ZKOCAML_RMR_RETRY INT_MIN
+
+typedef struct zkocaml_rmr_batch_s_ {
+  zkocaml_tree_t *tree;
+  int count;
+  zkocaml_tree_node_t *nodes[ZKOCAML_RMR_BATCH_SIZE];
+  zoo_op_t ops[ZKOCAML_RMR_BATCH_SIZE];
+  zoo_op_result_t results[ZKOCAML_RMR_BATCH_SIZE];
+} zkocaml_rmr_batch_t;
+
+static void
+rmr_multi_completion(int rc, const void *data)
+{
+  int i = 0;
+  zkocaml_rmr_batch_t *batch = (zkocaml_rmr_batch_t *)data;
+  zkocaml_tree_t *tree = batch->tree;
+
+  pthread_mutex_lock(&tree->lock);
+  for (; i < batch->count; i++) {
+    batch->nodes[i]->rc = rc == ZOK ? ZOK : ZKOCAML_RMR_RETRY;
   }
+  tree->in_flight--;
+  pthread_cond_signal(&tree->progress);
+  pthread_mutex_unlock(&tree->lock);
+  free(batch);
+}
 
-  CAMLreturn(Val_unit);
+static void
+rmr_delete_completion(int rc, const void *data)
+{
+  zkocaml_tree_node_t *node = (zkocaml_tree_node_t *)data;
+  zkocaml_tree_t *tree = node->tree;
+
+  pthread_mutex_lock(&tree->lock);
+  node->rc = rc;
+  tree->in_flight--;
+  pthread_cond_signal(&tree->progress);
+  pthread_mutex_unlock(&tree->lock);
 }
 
 /**
- * Sets the stream to be used by the library for logging
- *
- * The zookeeper library uses stderr as its default log stream. Application
- * must make sure the stream is writable. Passing in NULL resets the stream
- * to its default value (stderr).
+ * Wait until fewer than limit requests are outstanding.
+ * Must be called with tree->lock held.
  */
-CAMLprim value
-zkocaml_set_log_stream(value log_stream)
+static void
+zkocaml_tree_wait(zkocaml_tree_t *tree, int limit)
 {
-  CAMLparam1(log_stream);
-
-  const char *stream_name = String_val(log_stream);
-  zkocaml_log_stream = fopen(stream_name, "w+");
-  if (zkocaml_log_stream == NULL) CAMLreturn(Val_unit);
-  zoo_set_log_stream(zkocaml_log_stream);
+  while (tree->in_flight >= limit) {
+    pthread_cond_wait(&tree->progress, &tree->lock);
+  }
+}
 
-  CAMLreturn(Val_unit);
+static void
+zkocaml_rmr_flush(zhandle_t *zh, zkocaml_rmr_batch_t *batch)
+{
+  int i = 0;
+  zkocaml_tree_t *tree = batch->tree;
+
+  tree->in_flight++;
+  int rc = zoo_amulti(zh, batch->count, batch->ops, batch->results,
+                      rmr_multi_completion, batch);
+  if (rc != ZOK) {
+    for (; i < batch->count; i++) batch->nodes[i]->rc = ZKOCAML_RMR_RETRY;
+    tree->in_flight--;
+    free(batch);
+  }
 }
 
 /**
- * Enable/disable quorum endpoint order randomization
- *
- * Note: typically this method should NOT be used outside of testing.
- *
- * If passed a non-zero value, will make the client connect to quorum peers
- * in the order as specified in the zookeeper_init() call.
- * A zero value causes zookeeper_init() to permute the peer endpoints
- * which is good for more even client connection distribution among the
- * quorum peers.
+ * Delete every node of a discovered tree, deepest level first, keeping
+ * up to max_in_flight requests outstanding within a level. Nodes are
+ * grouped by depth first, since pipelined discovery does not append them
+ * strictly level by level. Nodes the walk already found missing are
+ * skipped. Must be called with the runtime lock released.
  */
-CAMLprim value
-zkocaml_deterministic_conn_order(value yes_or_no)
+static void
+zkocaml_rmr_run(zhandle_t *zh, zkocaml_tree_t *tree, int max_in_flight)
 {
-  CAMLparam1(yes_or_no);
+  int i = 0, depth = 0, max_depth = 0;
+  int *order = (int *)calloc(tree->count, sizeof(int));
+  int *level_start = NULL;
 
-  int decision = Bool_val(yes_or_no);
-  zoo_deterministic_conn_order(decision);
+  for (; i < tree->count; i++) {
+    if (tree->nodes[i]->depth > max_depth) max_depth = tree->nodes[i]->depth;
+  }
+  /* Counting sort by depth: level d occupies order[level_start[d] ..
+   * level_start[d + 1]). */
+  level_start = (int *)calloc(max_depth + 2, sizeof(int));
+  for (i = 0; i < tree->count; i++) level_start[tree->nodes[i]->depth + 1]++;
+  for (depth = 0; depth <= max_depth; depth++) {
+    level_start[depth + 1] += level_start[depth];
+  }
+  for (i = 0; i < tree->count; i++) {
+    order[level_start[tree->nodes[i]->depth]++] = i;
+  }
+  for (depth = max_depth; depth > 0; depth--) {
+    level_start[depth] = level_start[depth - 1];
+  }
+  level_start[0] = 0;
+
+  pthread_mutex_lock(&tree->lock);
+  for (depth = max_depth; depth >= 0; depth--) {
+    zkocaml_rmr_batch_t *batch = NULL;
+    int begin = level_start[depth], end = level_start[depth + 1];
+
+    for (i = begin; i < end; i++) {
+      zkocaml_tree_node_t *node = tree->nodes[order[i]];
+      if (node->rc == ZNONODE) continue;
+      if (batch == NULL) {
+        batch = (zkocaml_rmr_batch_t *)calloc(1, sizeof(zkocaml_rmr_batch_t));
+        batch->tree = tree;
+      }
+      batch->nodes[batch->count] = node;
+      zoo_delete_op_init(&batch->ops[batch->count], node->path, -1);
+      if (++batch->count == ZKOCAML_RMR_BATCH_SIZE) {
+        zkocaml_tree_wait(tree, max_in_flight);
+        zkocaml_rmr_flush(zh, batch);
+        batch = NULL;
+      }
+    }
+    if (batch != NULL) {
+      zkocaml_tree_wait(tree, max_in_flight);
+      zkocaml_rmr_flush(zh, batch);
+    }
+    zkocaml_tree_wait(tree, 1);
+
+    for (i = begin; i < end; i++) {
+      zkocaml_tree_node_t *node = tree->nodes[order[i]];
+      if (node->rc != ZKOCAML_RMR_RETRY) continue;
+      zkocaml_tree_wait(tree, max_in_flight);
+      tree->in_flight++;
+      int rc = zoo_adelete(zh, node->path, -1, rmr_delete_completion, node);
+      if (rc != ZOK) {
+        node->rc = rc;
+        tree->in_flight--;
+      }
+    }
+    zkocaml_tree_wait(tree, 1);
+  }
+  pthread_mutex_unlock(&tree->lock);
 
-  CAMLreturn(Val_unit);
+  free(level_start);
+  free(order);
 }
 
 /**
- * Create a node synchronously.
- *
- * This method will create a node in ZooKeeper. A node can only be created if
- * it does not already exists. The Create Flags affect the creation of nodes.
- * If ZOO_EPHEMERAL flag is set, the node will automatically get removed if the
- * client session goes away. If the ZOO_SEQUENCE flag is set, a unique
- * monotonically increasing sequence number is appended to the path name.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init.
+ * Deletes a node and its whole subtree.
  *
- * @path The name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @val The data to be stored in the node.
+ * The subtree is discovered with pipelined aget_children requests and
+ * then deleted bottom-up, one level at a time, with siblings packed into
+ * multi batches and many requests in flight per level. A node that
+ * cannot be deleted does not stop the operation: it is reported, and so
+ * is each of its ancestors, which then fail with ZNOTEMPTY. Nodes that
+ * disappear on their own meanwhile are not reported.
  *
- * @acl The initial ACL of the node. The ACL must not be null or empty.
- *
- * @flags this parameter can be set to 0 for normal create or an OR
- * of the Create Flags
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @path_buffer Buffer which will be filled with the path of the
- * new node (this might be different than the supplied path
- * because of the ZOO_SEQUENCE flag).  The path string will always be
- * null-terminated. This parameter may be NULL if path_buffer_len = 0.
+ * @root the path of the subtree root.
  *
- * @path_buffer_len Size of path buffer; if the path of the new
- * node (including space for the null terminator) exceeds the buffer size,
- * the path string will be truncated to fit.  The actual path of the
- * new node in the server will not be affected by the truncation.
- * The path string will always be null-terminated.
+ * @max_in_flight the number of requests kept outstanding; zero or less
+ * selects ZKOCAML_TREE_DEFAULT_IN_FLIGHT.
  *
- * @return one of the following codes are returned:
- *   ZOK operation completed successfully
- *   ZNONODE the parent node does not exist.
- *   ZNODEEXISTS the node already exists
- *   ZNOAUTH the client does not have permission.
- *   ZNOCHILDRENFOREPHEMERALS cannot create children of ephemeral nodes.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the (path, error) pairs of the nodes that could not be
+ * deleted, children before their parents; an empty array on success.
  */
 CAMLprim value
-zkocaml_create(value zh,
-                      value path,
-                      value val,
-                      value acl,
-                      value flags)
+zkocaml_rmr(value zh, value root, value max_in_flight)
 {
-  CAMLparam5(zh, path, val, acl, flags);
-  CAMLlocal3(result, error, buffer);
+  CAMLparam3(zh, root, max_in_flight);
+  CAMLlocal3(result, item, field);
 
-  struct ACL_vector local_acl;
+  int i = 0, failed = 0;
+  int local_max_in_flight = Int_val(max_in_flight);
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  char *path_buffer = (char *)malloc(
-                      sizeof(char) * ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  memset(path_buffer, 0, ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  const char *local_path = String_val(path);
-  const char *local_val = String_val(val);
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
-  }
-  int local_flags = zkocaml_enum_create_flag_ml2c(flags);
-
-  int rc = zoo_create(zhandle->handle,
-                      local_path,
-                      local_val,
-                      strlen(local_val),
-                      (const struct ACL_vector *)&local_acl,
-                      local_flags,
-                      path_buffer,
-                      ZKOCAML_MAX_PATH_BUFFER_SIZE
-                      );
+  zkocaml_tree_t tree;
 
-  error = zkocaml_enum_error_c2ml(rc);
-  buffer = caml_copy_string(path_buffer);
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, buffer);
-  free(path_buffer);
+  if (local_max_in_flight <= 0) {
+    local_max_in_flight = ZKOCAML_TREE_DEFAULT_IN_FLIGHT;
+  } else if (local_max_in_flight < 2) {
+    local_max_in_flight = 2;
+  }
+  memset(&tree, 0, sizeof(tree));
+  pthread_mutex_init(&tree.lock, NULL);
+  pthread_cond_init(&tree.progress, NULL);
+  zkocaml_tree_append(&tree, zkocaml_copy_string_val(root), -1);
+
+  caml_enter_blocking_section();
+  zkocaml_tree_walk(zhandle->handle, &tree, local_max_in_flight);
+  zkocaml_rmr_run(zhandle->handle, &tree, local_max_in_flight);
+  caml_leave_blocking_section();
+
+  for (i = 0; i < tree.count; i++) {
+    if (tree.nodes[i]->rc != ZOK && tree.nodes[i]->rc != ZNONODE) failed++;
+  }
+  result = caml_alloc(failed, 0);
+  failed = 0;
+  for (i = tree.count - 1; i >= 0; i--) {
+    zkocaml_tree_node_t *node = tree.nodes[i];
+    if (node->rc == ZOK || node->rc == ZNONODE) continue;
+    item = caml_alloc(2, 0);
+    field = caml_copy_string(node->path);
+    Store_field(item, 0, field);
+    field = zkocaml_enum_error_c2ml(node->rc);
+    Store_field(item, 1, field);
+    Store_field(result, failed++, item);
+  }
+  zkocaml_tree_free(&tree);
 
   CAMLreturn(result);
 }
 
 /**
- * Delete a node in zookeeper synchronously.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @version the expected version of the node. The function will fail if the
- * actual version of the node does not match the expected version.
- * If -1 is used the version check will not take place.
- *
- * @return one of the following values is returned.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
- *   ZNOTEMPTY children are present; node cannot be deleted.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Client-side data cache.
+ *
+ * The first read of a path does a wget and keeps the resulting
+ * (error, data, stat) tuple as a generational global root, so later hits
+ * return that very value without allocating. The watch belongs to an
+ * internal C watcher that runs on the C client thread: a ZOO_CHANGED_EVENT
+ * or ZOO_DELETED_EVENT (or an expired session) only marks the entry
+ * invalid, and the next read refetches it and re-arms the watch. Entries
+ * are keyed by the raw bytes of the path and chained in a hash table;
+ * everything is protected by zkocaml_cache_lock.
+ *
+ * An entry whose watch is still armed when its cache is finalized cannot
+ * be freed yet, since the C client still holds a pointer to it: it is
+ * detached instead and freed by the watcher when the watch fires. fired
+ * counts the watch events of an entry, so that a read can tell whether
+ * the watch it set has already fired; generation also moves on explicit
+ * invalidations. A read of an entry whose watch is still armed, which
+ * only an explicit invalidation leaves behind, sets no watch of its own.
  */
-CAMLprim value
-zkocaml_delete(value zh, value path, value version)
+#define ZKOCAML_CACHE_INITIAL_BUCKETS 64
+
+typedef struct zkocaml_cache_entry_s_ {
+  struct zkocaml_cache_s_ *cache;
+  struct zkocaml_cache_entry_s_ *next;
+  char *path;
+  size_t path_len;
+  uint32_t hash;
+  int valid;
+  int armed;
+  unsigned long fired;
+  unsigned long generation;
+  int has_result;
+  value result;
+} zkocaml_cache_entry_t;
+
+typedef struct zkocaml_cache_s_ {
+  value zh_value;
+  zkocaml_cache_entry_t **buckets;
+  size_t bucket_count;
+  size_t count;
+  long hits;
+  long misses;
+  long invalidations;
+} zkocaml_cache_t;
+
+static pthread_mutex_t zkocaml_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define zkocaml_cache_val(v) \
+  (*(zkocaml_cache_t **)Data_custom_val(v))
+
+/* FNV-1a over the path bytes. */
+static uint32_t
+zkocaml_cache_hash(const char *path, size_t len)
 {
-  CAMLparam3(zh, path, version);
-  CAMLlocal1(result);
+  uint32_t hash = 2166136261u;
+  size_t i = 0;
 
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
+  for (; i < len; i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-  int rc = zoo_delete(zhandle->handle, local_path, local_version);
-  result = zkocaml_enum_error_c2ml(rc);
+/**
+ * Look up the entry for a path. Must be called with zkocaml_cache_lock
+ * held; does not allocate.
+ */
+static zkocaml_cache_entry_t *
+zkocaml_cache_lookup(zkocaml_cache_t *cache,
+                     const char *path,
+                     size_t len,
+                     uint32_t hash)
+{
+  zkocaml_cache_entry_t *entry =
+    cache->buckets[hash & (cache->bucket_count - 1)];
 
-  CAMLreturn(result);
+  for (; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && entry->path_len == len &&
+        memcmp(entry->path, path, len) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
 }
 
 /**
- * Checks the existence of a node in zookeeper synchronously.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify the
- * client if the node changes. The watch will be set even if the node does not
- * exist. This allows clients to watch for nodes to appear.
- *
- * @stat the returned stat value of the node.
- *
- * @return return code of the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Insert a new, invalid entry for a path, doubling the table when it gets
+ * as full as it has buckets. Must be called with zkocaml_cache_lock held.
  */
-CAMLprim value
-zkocaml_exists(value zh, value path, value watch)
+static zkocaml_cache_entry_t *
+zkocaml_cache_insert(zkocaml_cache_t *cache,
+                     const char *path,
+                     size_t len,
+                     uint32_t hash)
 {
-  CAMLparam3(zh, path, watch);
-  CAMLlocal3(result, error, stat);
-
-  struct Stat local_stat;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
+  size_t i = 0;
+  zkocaml_cache_entry_t *entry = (zkocaml_cache_entry_t *)
+    calloc(1, sizeof(zkocaml_cache_entry_t));
+
+  entry->cache = cache;
+  entry->path = (char *)malloc(len + 1);
+  memcpy(entry->path, path, len);
+  entry->path[len] = '\0';
+  entry->path_len = len;
+  entry->hash = hash;
+  entry->result = Val_unit;
+
+  if (cache->count >= cache->bucket_count) {
+    size_t bucket_count = cache->bucket_count * 2;
+    zkocaml_cache_entry_t **buckets = (zkocaml_cache_entry_t **)
+      calloc(bucket_count, sizeof(zkocaml_cache_entry_t *));
+    for (; i < cache->bucket_count; i++) {
+      zkocaml_cache_entry_t *e = cache->buckets[i], *next = NULL;
+      for (; e != NULL; e = next) {
+        next = e->next;
+        e->next = buckets[e->hash & (bucket_count - 1)];
+        buckets[e->hash & (bucket_count - 1)] = e;
+      }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+  }
 
-  int rc = zoo_exists(zhandle->handle,
-                      local_path,
-                      local_watch,
-                      (struct Stat *)&local_stat);
+  entry->next = cache->buckets[hash & (cache->bucket_count - 1)];
+  cache->buckets[hash & (cache->bucket_count - 1)] = entry;
+  cache->count++;
 
-  error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  return entry;
+}
 
-  CAMLreturn(result);
+static void
+zkocaml_cache_entry_free(zkocaml_cache_entry_t *entry)
+{
+  free(entry->path);
+  free(entry);
 }
 
 /**
- * Checks the existence of a node in zookeeper synchronously.
- *
- * This function is similar to zoo_exists except it allows one specify
- * a watcher object rather than a boolean watch flag.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watcher if non-null a watch will set on the specified znode on the server.
- * The watch will be set even if the node does not exist. This allows clients
- * to watch for nodes to appear.
- *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
- *
- * @stat the return stat value of the node.
- *
- * @return return code of the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Watcher of every cached path. Runs on the C client thread and never
+ * touches the OCaml runtime.
  */
-CAMLprim value
-zkocaml_wexists(value zh,
-                value path,
-                value watcher_callback,
-                value watcher_ctx)
+static void
+cache_watcher(zhandle_t *zh,
+              int type,
+              int state,
+              const char *path,
+              void *watcher_ctx)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal3(result, error, stat);
-
-  struct Stat local_stat;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
+  zkocaml_cache_entry_t *entry = (zkocaml_cache_entry_t *)watcher_ctx;
 
-  int rc = zoo_wexists(zhandle->handle,
-                       local_path,
-                       watcher_dispatch,
-                       local_ctx,
-                       (struct Stat *)&local_stat);
+  if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+    return;
+  }
 
-  error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  entry->armed = 0;
+  entry->fired++;
+  entry->generation++;
+  if (entry->cache == NULL) {
+    zkocaml_cache_entry_free(entry);
+  } else if (entry->valid) {
+    entry->valid = 0;
+    entry->cache->invalidations++;
+  }
+  pthread_mutex_unlock(&zkocaml_cache_lock);
+}
 
-  CAMLreturn(result);
+static void
+zkocaml_cache_finalize(value v)
+{
+  size_t i = 0;
+  zkocaml_cache_t *cache = zkocaml_cache_val(v);
+
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  for (; i < cache->bucket_count; i++) {
+    zkocaml_cache_entry_t *entry = cache->buckets[i], *next = NULL;
+    for (; entry != NULL; entry = next) {
+      next = entry->next;
+      if (entry->has_result) {
+        caml_remove_generational_global_root(&entry->result);
+      }
+      if (entry->armed) {
+        entry->cache = NULL;
+      } else {
+        zkocaml_cache_entry_free(entry);
+      }
+    }
+  }
+  pthread_mutex_unlock(&zkocaml_cache_lock);
 
+  caml_remove_generational_global_root(&cache->zh_value);
+  free(cache->buckets);
+  free(cache);
 }
 
+static struct custom_operations zkocaml_cache_ops = {
+  "org.apache.zookeeper.cache",
+  zkocaml_cache_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
 /**
- * Gets the data associated with a node synchronously.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @buffer the buffer holding the node data returned by the server
+ * Creates a data cache over a zookeeper handle.
  *
- * @stat if not NULL, will hold the value of stat for the path on return.
+ * @zh the zookeeper handle obtained by a call to zookeeper_init. The
+ * cache keeps it alive.
  *
- * @return return value of the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the cache.
  */
 CAMLprim value
-zkocaml_get(value zh,
-            value path,
-            value watch)
+zkocaml_cache_create(value zh)
 {
-  CAMLparam3(zh, path, watch);
-  CAMLlocal4(result, error, buffer, stat);
-
-  int path_buffer_size;
-  struct Stat local_stat;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  char *path_buffer = (char *)malloc(
-                      sizeof(char) * ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  memset(path_buffer, 0, ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
+  CAMLparam1(zh);
+  CAMLlocal1(result);
 
-  int rc = zoo_get(zhandle->handle,
-                   local_path,
-                   local_watch,
-                   path_buffer,
-                   &path_buffer_size,
-                   (struct Stat *)&local_stat);
+  zkocaml_cache_t *cache = (zkocaml_cache_t *)
+    calloc(1, sizeof(zkocaml_cache_t));
+  cache->zh_value = zh;
+  caml_register_generational_global_root(&cache->zh_value);
+  cache->bucket_count = ZKOCAML_CACHE_INITIAL_BUCKETS;
+  cache->buckets = (zkocaml_cache_entry_t **)
+    calloc(cache->bucket_count, sizeof(zkocaml_cache_entry_t *));
 
-  error = zkocaml_enum_error_c2ml(rc);
-  buffer = caml_copy_string(path_buffer);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(3, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, buffer);
-  Store_field(result, 2, stat);
-  free(path_buffer);
+  result = caml_alloc_custom(&zkocaml_cache_ops,
+                             sizeof(zkocaml_cache_t *), 0, 1);
+  zkocaml_cache_val(result) = cache;
 
   CAMLreturn(result);
 }
 
 /**
- * Gets the data associated with a node synchronously.
- *
- * This function is similar to zoo_get except it allows one specify
- * a watcher object rather than a boolean watch flag.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
+ * Gets the data of a node through the cache.
  *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by \ref zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * A hit returns the tuple stored by the read that filled the entry,
+ * without allocating. A miss reads the node, with a watch like wget
+ * unless the entry's watch is still armed, and caches the result if it is ZOK and no change was reported meanwhile.
+ * Failed reads are returned but not cached, and a miss once the handle
+ * has been closed returns ZINVALIDSTATE.
  *
- * @buffer the buffer holding the node data returned by the server
+ * @cache the cache obtained by a call to cache_create.
  *
- * @stat if not NULL, will hold the value of stat for the path on return.
+ * @path the name of the node.
  *
- * @return return value of the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the same (error, data, stat) tuple as get.
  */
 CAMLprim value
-zkocaml_wget(value zh,
-             value path,
-             value watcher_callback,
-             value watcher_ctx)
+zkocaml_cache_get(value cache_value, value path)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
+  CAMLparam2(cache_value, path);
   CAMLlocal4(result, error, buffer, stat);
 
-  int path_buffer_size;
+  zkocaml_cache_t *cache = zkocaml_cache_val(cache_value);
+  size_t len = caml_string_length(path);
+  uint32_t hash = zkocaml_cache_hash(String_val(path), len);
+  zkocaml_cache_entry_t *entry = NULL;
+  unsigned long generation = 0, fired = 0;
+  int watch = 0;
+
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  entry = zkocaml_cache_lookup(cache, String_val(path), len, hash);
+  if (entry != NULL && entry->valid) {
+    cache->hits++;
+    result = entry->result;
+    pthread_mutex_unlock(&zkocaml_cache_lock);
+    CAMLreturn(result);
+  }
+  if (entry == NULL) {
+    entry = zkocaml_cache_insert(cache, String_val(path), len, hash);
+  }
+  cache->misses++;
+  generation = entry->generation;
+  fired = entry->fired;
+  watch = !entry->armed;
+  pthread_mutex_unlock(&zkocaml_cache_lock);
+
+  char *data_buffer = NULL;
+  int data_buffer_len = 0;
   struct Stat local_stat;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  char *path_buffer = (char *)malloc(
-                      sizeof(char) * ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  memset(path_buffer, 0, ZKOCAML_MAX_PATH_BUFFER_SIZE);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-
-  int rc = zoo_wget(zhandle->handle,
-                    local_path,
-                    watcher_dispatch,
-                    local_ctx,
-                    path_buffer,
-                    &path_buffer_size,
-                    (struct Stat *)&local_stat);
+  zhandle_t *zh = zkocaml_handle_struct_val(cache->zh_value)->handle;
+  int rc = ZINVALIDSTATE;
+
+  memset(&local_stat, 0, sizeof(local_stat));
+  if (zh != NULL) {
+    int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET);
+    caml_enter_blocking_section();
+    rc = zkocaml_get_sized(zh,
+                           entry->path,
+                           0,
+                           watch ? cache_watcher : NULL,
+                           entry,
+                           &data_buffer,
+                           &data_buffer_len,
+                           (struct Stat *)&local_stat);
+    caml_leave_blocking_section();
+    zkocaml_op_end(ZKOCAML_OP_TYPE_GET, started, rc,
+                   entry->path, data_buffer_len);
+  }
 
   error = zkocaml_enum_error_c2ml(rc);
-  buffer = caml_copy_string(path_buffer);
+  buffer = zkocaml_copy_buffer(rc == ZOK ? data_buffer : NULL,
+                               data_buffer_len);
+  zkocaml_release_get_buffer(data_buffer);
   stat = zkocaml_build_stat_struct(&local_stat);
   result = caml_alloc(3, 0);
   Store_field(result, 0, error);
   Store_field(result, 1, buffer);
   Store_field(result, 2, stat);
-  free(path_buffer);
+
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  if (rc == ZOK) {
+    if (watch && entry->fired == fired) entry->armed = 1;
+    if (entry->generation == generation) {
+      if (entry->has_result) {
+        caml_modify_generational_global_root(&entry->result, result);
+      } else {
+        entry->result = result;
+        caml_register_generational_global_root(&entry->result);
+        entry->has_result = 1;
+      }
+      entry->valid = 1;
+    }
+  }
+  pthread_mutex_unlock(&zkocaml_cache_lock);
 
   CAMLreturn(result);
 }
 
 /**
- * Sets the data associated with a node. See zoo_set2 function if
- * you require access to the stat information associated with the znode.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @buffer the buffer holding data to be written to the node.
- *
- * @version the expected version of the node. The function will fail if
- * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place.
- *
- * @return the return code for the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Drops the cached data of a node, so that the next read goes to the
+ * server. The watch, if armed, stays in place.
  */
 CAMLprim value
-zkocaml_set(value zh, value path, value buffer, value version)
+zkocaml_cache_invalidate(value cache_value, value path)
 {
-  CAMLparam4(zh, path, buffer, version);
-  CAMLlocal1(result);
-
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  const char *local_buffer = String_val(path);
-  size_t buffer_len = strlen(local_buffer);
-  int local_version = Int_val(version);
-
-  int rc = zoo_set(zhandle->handle,
-                   local_path,
-                   local_buffer,
-                   buffer_len,
-                   local_version);
-  result = zkocaml_enum_error_c2ml(rc);
+  CAMLparam2(cache_value, path);
+
+  zkocaml_cache_t *cache = zkocaml_cache_val(cache_value);
+  size_t len = caml_string_length(path);
+  uint32_t hash = zkocaml_cache_hash(String_val(path), len);
+
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  zkocaml_cache_entry_t *entry =
+    zkocaml_cache_lookup(cache, String_val(path), len, hash);
+  if (entry != NULL) {
+    entry->generation++;
+    if (entry->valid) {
+      entry->valid = 0;
+      cache->invalidations++;
+    }
+  }
+  pthread_mutex_unlock(&zkocaml_cache_lock);
 
-  CAMLreturn(result);
+  CAMLreturn(Val_unit);
 }
 
 /**
- * Sets the data associated with a node. This function is the same
- * as zoo_set except that it also provides access to stat information
- * associated with the znode.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @buffer the buffer holding data to be written to the node.
- *
- * @version the expected version of the node. The function will fail if
- * the actual version of the node does not match the expected version. If -1 is
- * used the version check will not take place.
- *
- * @stat if not NULL, will hold the value of stat for the path on return.
- *
- * @return the return code for the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADVERSION expected version does not match actual version.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Returns the hit, miss and invalidation counters of a cache, along with
+ * the number of paths it tracks.
  */
 CAMLprim value
-zkocaml_set2(value zh, value path, value buffer, value version)
+zkocaml_cache_stats(value cache_value)
 {
-  CAMLparam4(zh, path, buffer, version);
-  CAMLlocal3(result, error, stat);
+  CAMLparam1(cache_value);
+  CAMLlocal1(result);
 
-  int path_buffer_size;
-  struct Stat local_stat;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  const char *local_buffer = String_val(buffer);
-  int local_version = Int_val(version);
+  zkocaml_cache_t *cache = zkocaml_cache_val(cache_value);
+  long hits, misses, invalidations, entries;
 
-  int rc = zoo_set2(zhandle->handle,
-                    local_path,
-                    local_buffer,
-                    strlen(local_buffer),
-                    local_version,
-                    (struct Stat *)&local_stat);
+  pthread_mutex_lock(&zkocaml_cache_lock);
+  hits = cache->hits;
+  misses = cache->misses;
+  invalidations = cache->invalidations;
+  entries = cache->count;
+  pthread_mutex_unlock(&zkocaml_cache_lock);
 
-  error = zkocaml_enum_error_c2ml(rc);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, stat);
+  result = caml_alloc(4, 0);
+  Store_field(result, 0, Val_long(hits));
+  Store_field(result, 1, Val_long(misses));
+  Store_field(result, 2, Val_long(invalidations));
+  Store_field(result, 3, Val_long(entries));
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node synchronously.
+ * Starts following the children of a node.
  *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * The current list is read synchronously, with the set's watch. From then
+ * on callback is run with a snapshot of the new list and the names added
+ * and removed every time the list changes, until children_close or until
+ * the set itself is garbage collected.
  *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
+ * @zh the zookeeper handle obtained by a call to zookeeper_init
  *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
+ * @path the name of the node.
  *
- * @strings return value of children paths.
+ * @callback the subscriber, run through the usual delivery path.
  *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * @return the error of the initial read and the set. If the read failed
+ * the set is empty and already closed.
  */
 CAMLprim value
-zkocaml_get_children(value zh, value path, value watch)
+zkocaml_children_watch(value zh, value path, value callback)
 {
-  CAMLparam3(zh, path, watch);
-  CAMLlocal3(result, error, strs);
+  CAMLparam3(zh, path, callback);
+  CAMLlocal3(result, error, set_value);
 
-  struct String_vector local_strings;
+  struct String_vector local_strings = { 0, NULL };
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  int local_watch = Int_val(watch);
-
-  int rc = zoo_get_children(zhandle->handle,
-                      local_path,
-                      local_watch,
-                      (struct String_vector *)&local_strings);
+  zkocaml_children_set_t *set = (zkocaml_children_set_t *)
+    calloc(1, sizeof(zkocaml_children_set_t));
+
+  pthread_mutex_init(&set->lock, NULL);
+  set->refs = 2;
+  set->zh = zhandle->handle;
+  set->path = zkocaml_copy_string_val(path);
+  set->callback = callback;
+  caml_register_generational_global_root(&set->callback);
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET_CHILDREN);
+  caml_enter_blocking_section();
+  int rc = zoo_wget_children(set->zh,
+                             set->path,
+                             children_watcher,
+                             set,
+                             &local_strings);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET_CHILDREN, started, rc, set->path, 0);
+
+  set->current = zkocaml_children_snapshot_new(&local_strings);
+  deallocate_String_vector(&local_strings);
+  set_value = caml_alloc_custom(&zkocaml_children_set_ops,
+                                sizeof(zkocaml_children_set_t *), 0, 1);
+  zkocaml_children_set_val(set_value) = set;
+  if (rc != ZOK) {
+    zkocaml_children_set_close(set);
+    zkocaml_children_set_unref(set);
+  }
 
   error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
   result = caml_alloc(2, 0);
   Store_field(result, 0, error);
-  Store_field(result, 1, strs);
+  Store_field(result, 1, set_value);
 
   CAMLreturn(result);
 }
 
 /**
- * Lists the children of a node synchronously.
- *
- * This function is similar to zoo_get_children except it allows one specify
- * a watcher object rather than a boolean watch flag.
- *
- * @zh the zookeeper handle obtained by a call to zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watcher if non-null, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by \ref zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
- *
- * @strings return value of children paths.
+ * Flat stats.
  *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * A flat stat is an int64 Bigarray of at least ZKOCAML_FLAT_STAT_FIELDS
+ * elements holding every stat field unboxed, in the field order of the
+ * stat record. Filling one allocates nothing on the OCaml heap, which
+ * suits high-rate polling; the accessors live on the OCaml side.
  */
-CAMLprim value
-zkocaml_wget_children(value zh,
-                      value path,
-                      value watcher_callback,
-                      value watcher_ctx)
+#define ZKOCAML_FLAT_STAT_FIELDS 11
+
+static void
+zkocaml_check_flat_stat(value flat, const char *caller)
+{
+  if (Caml_ba_array_val(flat)->dim[0] < ZKOCAML_FLAT_STAT_FIELDS) {
+    caml_invalid_argument(caller);
+  }
+}
+
+static void
+zkocaml_store_flat_stat(value flat, const struct Stat *stat)
+{
+  int64_t *fields = (int64_t *)Caml_ba_data_val(flat);
+
+  fields[0] = stat->czxid;
+  fields[1] = stat->mzxid;
+  fields[2] = stat->ctime;
+  fields[3] = stat->mtime;
+  fields[4] = stat->version;
+  fields[5] = stat->cversion;
+  fields[6] = stat->aversion;
+  fields[7] = stat->ephemeralOwner;
+  fields[8] = stat->dataLength;
+  fields[9] = stat->numChildren;
+  fields[10] = stat->pzxid;
+}
+
+/**
+ * Checks the existence of a node synchronously, writing its stat into a
+ * flat stat instead of allocating a stat record.
+ *
+ * @flat the flat stat to fill; left untouched unless the result is ZOK.
+ *
+ * @return the same codes as exists.
+ */
+CAMLprim value
+zkocaml_exists_flat(value zh, value path, value watch, value flat)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal3(result, error, strs);
+  CAMLparam4(zh, path, watch, flat);
+
+  zkocaml_check_flat_stat(flat, "Zookeeper.exists_flat");
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
 
-  struct String_vector local_strings;
+  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
+  char *local_path = zkocaml_copy_string_val(path);
+  int local_watch = Int_val(watch);
 
-  int rc = zoo_wget_children(zhandle->handle,
-                             local_path,
-                             watcher_dispatch,
-                             local_ctx,
-                             (struct String_vector *)&local_strings);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_EXISTS);
+  caml_enter_blocking_section();
+  int rc = zoo_exists(zhandle->handle,
+                      local_path,
+                      local_watch,
+                      (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_EXISTS, started, rc, local_path, 0);
 
-  error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  result = caml_alloc(2, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, strs);
+  free(local_path);
+  if (rc == ZOK) zkocaml_store_flat_stat(flat, &local_stat);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
 
-  CAMLreturn(result);
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
 }
 
 /**
- * Lists the children of a node and get its stat synchronously.
- *
- * This function is new in version 3.3.0
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @watch if nonzero, a watch will be set at the server to notify
- * the client if the node changes.
- *
- * @strings return value of children paths.
- *
- * @stat return value of node stat.
- *
- * @return the return code of the function.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * Checks the existence of a node synchronously, for callers that only
+ * need the return code.
  */
 CAMLprim value
-zkocaml_get_children2(value zh,
-                      value path,
-                      value watch)
+zkocaml_exists_nostat(value zh, value path, value watch)
 {
   CAMLparam3(zh, path, watch);
-  CAMLlocal4(result, error, strs, stat);
 
-  struct String_vector local_strings;
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_EXISTS, path, 0);
+
   struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  char *local_path = zkocaml_copy_string_val(path);
   int local_watch = Int_val(watch);
 
-  int rc = zoo_get_children2(zhandle->handle,
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_EXISTS);
+  caml_enter_blocking_section();
+  int rc = zoo_exists(zhandle->handle,
                       local_path,
                       local_watch,
-                      (struct String_vector *)&local_strings,
                       (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_EXISTS, started, rc, local_path, 0);
+
+  free(local_path);
+  zkocaml_trace_end(span, rc, &local_stat, 0);
+
+  CAMLreturn(zkocaml_enum_error_c2ml(rc));
+}
+
+/**
+ * Gets the data of a node synchronously without building a stat record.
+ * When has_flat is set and the read succeeds, the stat is written into
+ * flat instead.
+ *
+ * @return the return code and the data, as with get.
+ */
+static value
+zkocaml_get_flat_common(value zh,
+                        value path,
+                        value watch,
+                        value flat,
+                        int has_flat)
+{
+  CAMLparam4(zh, path, watch, flat);
+  CAMLlocal3(result, error, buffer);
 
+  if (has_flat) zkocaml_check_flat_stat(flat, "Zookeeper.get_flat");
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
+
+  char *data_buffer = NULL;
+  int data_buffer_len = 0;
+  struct Stat local_stat;
+  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
+  char *local_path = zkocaml_copy_string_val(path);
+  int local_watch = Int_val(watch);
+
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET);
+  caml_enter_blocking_section();
+  int rc = zkocaml_get_sized(zhandle->handle,
+                             local_path,
+                             local_watch,
+                             NULL,
+                             NULL,
+                             &data_buffer,
+                             &data_buffer_len,
+                             (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET, started, rc, local_path, data_buffer_len);
+
+  free(local_path);
   error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(3, 0);
+  buffer = zkocaml_copy_buffer(rc == ZOK ? data_buffer : NULL,
+                               data_buffer_len);
+  zkocaml_release_get_buffer(data_buffer);
+  if (rc == ZOK && has_flat) zkocaml_store_flat_stat(flat, &local_stat);
+  result = caml_alloc(2, 0);
   Store_field(result, 0, error);
-  Store_field(result, 1, strs);
-  Store_field(result, 2, stat);
+  Store_field(result, 1, buffer);
+  zkocaml_trace_end(span, rc, &local_stat, data_buffer_len);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_get_flat(value zh, value path, value watch, value flat)
+{
+  return zkocaml_get_flat_common(zh, path, watch, flat, 1);
+}
+
+CAMLprim value
+zkocaml_get_nostat(value zh, value path, value watch)
+{
+  return zkocaml_get_flat_common(zh, path, watch, Val_unit, 0);
+}
+
 /**
- * Lists the children of a node and get its stat synchronously.
- *
- * This function is similar to \ref zoo_get_children except it allows one specify
- * a watcher object rather than a boolean watch flag.
+ * Checks that [offset, offset + length) lies within the Bigarray buffer
+ * and returns a pointer to its first byte.
+ */
+static char *
+zkocaml_bigarray_slice(value buffer, value offset, value length,
+                       const char *caller)
+{
+  intnat dim = Caml_ba_array_val(buffer)->dim[0];
+  intnat off = Long_val(offset);
+  intnat len = Long_val(length);
+
+  if (off < 0 || len < 0 || off > dim || len > dim - off) {
+    caml_invalid_argument(caller);
+  }
+
+  return (char *)Caml_ba_data_val(buffer) + off;
+}
+
+/**
+ * Gets the data associated with a node synchronously, straight into
+ * caller owned memory.
  *
- * This function is new in version 3.3.0
+ * The C client copies the node data directly into the Bigarray, so no
+ * intermediate buffer and no OCaml string is allocated for the payload.
  *
  * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @watcher if non-null, a watch will be set at the server to notify
+ * @watch if nonzero, a watch will be set at the server to notify
  * the client if the node changes.
  *
- * @watcher_ctx user specific data, will be passed to the watcher callback.
- * Unlike the global context set by \ref zookeeper_init, this watcher context
- * is associated with the given instance of the watcher only.
+ * @buffer the Bigarray receiving the node data.
  *
- * @strings return value of children paths.
+ * @offset the position in buffer where the data is written.
  *
- * @stat return value of node stat.
+ * @length the maximum number of bytes written. If the node holds more
+ * data than this it is truncated; compare the returned length against
+ * stat.data_length to detect it.
  *
- * @return the return code of the function.
+ * @return the return code of the function call, the number of bytes
+ * written into buffer and the stat of the node.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
  *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ *   ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_wget_children2(value zh,
-                              value path,
-                              value watcher_callback,
-                              value watcher_ctx)
+zkocaml_get_into_native(value zh,
+                        value path,
+                        value watch,
+                        value buffer,
+                        value offset,
+                        value length)
 {
-  CAMLparam4(zh, path, watcher_callback, watcher_ctx);
-  CAMLlocal4(result, error, strs, stat);
+  CAMLparam5(zh, path, watch, buffer, offset);
+  CAMLxparam1(length);
+  CAMLlocal3(result, error, stat);
+
+  char *local_buffer = zkocaml_bigarray_slice(buffer, offset, length,
+                                              "Zookeeper.get_into");
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_GET, path, 0);
 
-  struct String_vector local_strings;
   struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  zkocaml_watcher_context_t *local_ctx = (zkocaml_watcher_context_t *)
-      malloc(sizeof(zkocaml_watcher_context_t));
-  local_ctx->watcher_ctx = String_val(watcher_ctx);
-  local_ctx->watcher_callback = watcher_callback;
-  const char *local_path = String_val(path);
+  int local_buffer_len = Long_val(length);
+  char *local_path = zkocaml_copy_string_val(path);
+  int local_watch = Int_val(watch);
 
-  int rc = zoo_wget_children2(zhandle->handle,
-                      local_path,
-                      watcher_dispatch,
-                      local_ctx,
-                      (struct String_vector *)&local_strings,
-                      (struct Stat *)&local_stat);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_GET);
+  caml_enter_blocking_section();
+  int rc = zoo_get(zhandle->handle,
+                   local_path,
+                   local_watch,
+                   local_buffer,
+                   &local_buffer_len,
+                   (struct Stat *)&local_stat);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_GET, started, rc,
+                 local_path, local_buffer_len);
 
+  free(local_path);
+  if (rc != ZOK || local_buffer_len < 0) local_buffer_len = 0;
   error = zkocaml_enum_error_c2ml(rc);
-  strs = zkocaml_build_strings_struct(&local_strings);
   stat = zkocaml_build_stat_struct(&local_stat);
   result = caml_alloc(3, 0);
   Store_field(result, 0, error);
-  Store_field(result, 1, strs);
+  Store_field(result, 1, Val_int(local_buffer_len));
   Store_field(result, 2, stat);
+  zkocaml_trace_end(span, rc, &local_stat, local_buffer_len);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_get_into_bytecode(value *argv, int argn)
+{
+  return zkocaml_get_into_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
+}
+
 /**
- * Gets the acl associated with a node synchronously.
+ * Sets the data associated with a node synchronously, straight from
+ * caller owned memory.
+ *
+ * The C client serializes the request directly from the Bigarray, so
+ * the payload is never copied into the OCaml heap.
  *
  * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
  *
  * @path the name of the node. Expressed as a file name with slashes
  * separating ancestors of the node.
  *
- * @acl the return value of acls on the path.
+ * @buffer the Bigarray holding the data to be written to the node.
  *
- * @stat returns the stat of the path specified.
+ * @offset the position in buffer of the first byte to write.
+ *
+ * @length the number of bytes to write.
+ *
+ * @version the expected version of the node. The function will fail if
+ * the actual version of the node does not match the expected version. If -1 is
+ * used the version check will not take place.
  *
  * @return the return code for the function call.
  *   ZOK operation completed successfully
  *   ZNONODE the node does not exist.
  *   ZNOAUTH the client does not have permission.
+ *   ZBADVERSION expected version does not match actual version.
  *   ZBADARGUMENTS - invalid input parameters
  *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
  *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
  */
 CAMLprim value
-zkocaml_get_acl(value zh, value path)
+zkocaml_set_from_native(value zh,
+                        value path,
+                        value buffer,
+                        value offset,
+                        value length,
+                        value version)
 {
-  CAMLparam2(zh, path);
-  CAMLlocal4(result, error, acls, stat);
+  CAMLparam5(zh, path, buffer, offset, length);
+  CAMLxparam1(version);
+  CAMLlocal1(result);
+
+  const char *local_buffer = zkocaml_bigarray_slice(buffer, offset, length,
+                                                    "Zookeeper.set_from");
+  long span = zkocaml_trace_start(ZKOCAML_OP_TYPE_SET, path, Long_val(length));
 
-  struct ACL_vector local_acl;
-  struct Stat local_stat;
   zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
+  int local_buffer_len = Long_val(length);
+  char *local_path = zkocaml_copy_string_val(path);
+  int local_version = Int_val(version);
 
-  int rc = zoo_get_acl(zhandle->handle,
-                      local_path,
-                      (struct ACL_vector*)&local_acl,
-                      (struct Stat *)&local_stat);
+  int64_t started = zkocaml_op_begin(ZKOCAML_OP_TYPE_SET);
+  caml_enter_blocking_section();
+  int rc = zoo_set(zhandle->handle,
+                   local_path,
+                   local_buffer,
+                   local_buffer_len,
+                   local_version);
+  caml_leave_blocking_section();
+  zkocaml_op_end(ZKOCAML_OP_TYPE_SET, started, rc,
+                 local_path, local_buffer_len);
 
-  error = zkocaml_enum_error_c2ml(rc);
-  acls = zkocaml_build_acls_struct(&local_acl);
-  stat = zkocaml_build_stat_struct(&local_stat);
-  result = caml_alloc(3, 0);
-  Store_field(result, 0, error);
-  Store_field(result, 1, acls);
-  Store_field(result, 2, stat);
+  free(local_path);
+  result = zkocaml_enum_error_c2ml(rc);
+  zkocaml_trace_end(span, rc, NULL, 0);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_set_from_bytecode(value *argv, int argn)
+{
+  return zkocaml_set_from_native(argv[0], argv[1], argv[2],
+                                 argv[3], argv[4], argv[5]);
+}
+
+#else /* ZKOCAML_SINGLE_THREADED */
+
 /**
- * Sets the acl associated with a node synchronously.
- *
- * @zh the zookeeper handle obtained by a call to \ref zookeeper_init
- *
- * @path the name of the node. Expressed as a file name with slashes
- * separating ancestors of the node.
- *
- * @version the expected version of the path.
- *
- * @acl the acl to be set on the path.
- *
- * @return the return code for the function call.
- *   ZOK operation completed successfully
- *   ZNONODE the node does not exist.
- *   ZNOAUTH the client does not have permission.
- *   ZINVALIDACL invalid ACL specified
- *   ZBADVERSION expected version does not match actual version.
- *   ZBADARGUMENTS - invalid input parameters
- *   ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
- *   ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ * The single-threaded C client has no synchronous API: a request only
+ * makes progress inside zookeeper_process, so a blocking call could never
+ * return. The synchronous entry points fail instead.
+ */
+#define ZKOCAML_SYNC_UNAVAILABLE(name) \
+  CAMLprim value \
+  name() \
+  { \
+    caml_failwith(#name ": not available in the single-threaded build"); \
+  }
+
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_create)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_delete)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_exists)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_wexists)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_wget)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_set)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_set2)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_children)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_wget_children)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_children2)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_wget_children2)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_acl)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_set_acl)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_multi)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_bulk_get)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_bulk_exists)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_bulk_get_children)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_tree)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_rmr)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_cache_create)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_cache_get)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_cache_invalidate)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_cache_stats)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_children_watch)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_exists_flat)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_exists_nostat)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_flat)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_nostat)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_into_native)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_get_into_bytecode)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_set_from_native)
+ZKOCAML_SYNC_UNAVAILABLE(zkocaml_set_from_bytecode)
+
+#endif /* ZKOCAML_SINGLE_THREADED */
+
+#if defined(ZKOCAML_BENCH)
+
+/**
+ * Entry points for the microbenchmarks in bench/, compiled only with
+ * -DZKOCAML_BENCH. Each one runs a single conversion between the C
+ * client's structures and OCaml values, so that the harness can time it
+ * and count the words it allocates per call.
  */
+
 CAMLprim value
-zkocaml_set_acl(value zh, value path, value version, value acl)
+zkocaml_bench_build_stat(value unit)
 {
-  CAMLparam4(zh, path, version, acl);
+  CAMLparam1(unit);
   CAMLlocal1(result);
 
-  struct ACL_vector local_acl;
-  zkocaml_handle_t *zhandle = zkocaml_handle_struct_val(zh);
-  const char *local_path = String_val(path);
-  int local_version = Int_val(version);
-  int r = zkocaml_parse_acls(acl, &local_acl);
-  if (r == 0) {
-    local_acl = ZOO_OPEN_ACL_UNSAFE;
+  static const struct Stat stat = {
+    0x100000002LL, 0x100000007LL, 1400000000000LL, 1400000001000LL,
+    5, 3, 0, 0x14f1e2d3c4b5a697LL, 128, 3, 0x100000009LL
+  };
+
+  result = zkocaml_build_stat_struct(&stat);
+
+  CAMLreturn(result);
+}
+
+CAMLprim value
+zkocaml_bench_build_strings(value count)
+{
+  CAMLparam1(count);
+  CAMLlocal1(result);
+
+  /* Children named like sequential nodes, rebuilt when the count changes. */
+  static struct String_vector strings;
+  int i, n = Int_val(count);
+
+  if (n < 0) n = 0;
+  if (n != strings.count) {
+    for (i = 0; i < strings.count; i++) free(strings.data[i]);
+    free(strings.data);
+    strings.data = (char **)calloc(n > 0 ? n : 1, sizeof(char *));
+    strings.count = n;
+    for (i = 0; i < n; i++) {
+      strings.data[i] = (char *)malloc(32);
+      snprintf(strings.data[i], 32, "child-%010d", i);
+    }
   }
 
-  int rc = zoo_set_acl(zhandle->handle,
-                       local_path,
-                       local_version,
-                       (const struct ACL_vector *)&local_acl);
-  result = zkocaml_enum_error_c2ml(rc);
+  result = zkocaml_build_strings_struct(&strings);
 
   CAMLreturn(result);
 }
 
+CAMLprim value
+zkocaml_bench_parse_acls(value acl)
+{
+  CAMLparam1(acl);
+
+  struct ACL_vector local_acl = { 0, NULL };
+  int r = zkocaml_parse_acls(acl, &local_acl);
+  int count = local_acl.count;
+  if (r != 0) deallocate_ACL_vector(&local_acl);
+
+  CAMLreturn(Val_int(count));
+}
+
+CAMLprim value
+zkocaml_bench_error_c2ml(value rc)
+{
+  CAMLparam1(rc);
+  CAMLreturn(zkocaml_enum_error_c2ml(Int_val(rc)));
+}
+
+CAMLprim value
+zkocaml_bench_error_ml2c(value error)
+{
+  CAMLparam1(error);
+  CAMLreturn(Val_int(zkocaml_enum_error_ml2c(error)));
+}
+
+CAMLprim value
+zkocaml_bench_event_c2ml(value event)
+{
+  CAMLparam1(event);
+  CAMLreturn(zkocaml_enum_event_c2ml(Int_val(event)));
+}
+
+CAMLprim value
+zkocaml_bench_state_c2ml(value state)
+{
+  CAMLparam1(state);
+  CAMLreturn(zkocaml_enum_state_c2ml(Int_val(state)));
+}
+
+CAMLprim value
+zkocaml_bench_perm_ml2c(value perm)
+{
+  CAMLparam1(perm);
+  CAMLreturn(Val_int(zkocaml_enum_perm_ml2c(perm)));
+}
+
+#endif /* ZKOCAML_BENCH */
@@ -30,28 +30,79 @@
 
 #include <zookeeper/zookeeper.h>
 
+/**
+ * The zkocaml_watcher_context_t wraps a zookeeper watcher context.
+ *
+ * connects counts the ZOO_CONNECTED_STATE session events of the handle,
+ * so that every one after the first can be counted as a reconnect. id is
+ * the id of the handle.
+ */
+typedef struct zkocaml_watcher_context_s_ {
+  void *watcher_ctx;
+  value watcher_callback;
+  unsigned long connects;
+  unsigned long id;
+} zkocaml_watcher_context_t;
+
 /**
  * The zkocaml_handle_t wraps a zookeeper connection handle
  * which indicates a zookeeper session that corresponds to that handle.
+ *
+ * Every open handle has exactly one OCaml value, self, kept as a
+ * generational global root from init until close so that watcher events
+ * can hand it back without allocating. watcher is the global watcher
+ * context given to zookeeper_init, owned by the handle. watches is the
+ * trie through which the path watches of the handle are multiplexed.
+ * handle is cleared at close. id is never reused and outlives the close:
+ * the OCaml value compares and hashes on it, and the events of the C
+ * client find their handle through it.
  */
 typedef struct zkocaml_handle_s_ {
   zhandle_t *handle;
+  unsigned long id;
+  value self;
+  zkocaml_watcher_context_t *watcher;
+  struct zkocaml_watch_node_s_ *watches;
+  struct zkocaml_handle_s_ *next;
 } zkocaml_handle_t;
 
 /**
- * The zkocaml_watcher_context_t wraps a zookeeper watcher context.
+ * User data strings up to this length are stored inside the completion
+ * context itself instead of being copied to the C heap.
  */
-typedef struct zkocaml_watcher_context_s_ {
-  void *watcher_ctx;
-  value watcher_callback;
-} zkocaml_watcher_context_t;
+#define ZKOCAML_COMPLETION_INLINE_DATA_SIZE 48
+
+/**
+ * Paths recorded by the slow-operation log and hot-path tracking are
+ * truncated to one byte less than this.
+ */
+#define ZKOCAML_SLOW_PATH_SIZE 128
 
 /**
  * The zkocaml_completion_context_t wraps a zookeeper completion data.
+ *
+ * Contexts are handed out from a pooled free list and returned to it once
+ * their completion has been dispatched, see zkocaml_completion_context_new.
+ * payload carries request state that must survive until the completion,
+ * such as the result buffers of a multi request. op, started and
+ * dispatched time the request for the per-operation accounting, span is
+ * its tracing span, 0 when tracing is off, and path and size (the number
+ * of data bytes sent) describe it to the slow-operation log and hot-path
+ * tracking, path being empty while both are off.
  */
 typedef struct zkocaml_completion_context_s_ {
   void *data;
   value completion_callback;
+  size_t data_len;
+  char inline_data[ZKOCAML_COMPLETION_INLINE_DATA_SIZE];
+  void *payload;
+  int op;
+  int64_t started;
+  int64_t dispatched;
+  long span;
+  long size;
+  char path[ZKOCAML_SLOW_PATH_SIZE];
+  struct zkocaml_completion_context_s_ *next;
 } zkocaml_completion_context_t;
 
 /**
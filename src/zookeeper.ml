@@ -43,6 +43,15 @@ type acls = acl array
 
 type strings = string array
 
+(**
+ * Caller owned byte buffer.
+ *
+ * Used by get_into and set_from to move node data between the C client
+ * and OCaml without copying it through the OCaml heap.
+ **)
+type buffer =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
 type stat = {
   czxid: int64;
   mzxid: int64;
@@ -54,9 +63,17 @@ type stat = {
   ephemeral_owner: int64;
   data_length: int;
   num_children: int;
-  pzxid: int
+  pzxid: int64
 }
 
+(**
+ * Stat stored flat, unboxed: an int64 Bigarray of 11 elements holding
+ * the stat fields in record order. See flat_stat_create and the
+ * flat_stat_* accessors.
+ **)
+type flat_stat =
+  (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t
+
 type error =
   ZOK (*!< Everything is OK *)
 
@@ -178,6 +195,33 @@ type create_flag =
   ZOO_EPHEMERAL
   | ZOO_SEQUENCE
 
+(**
+ * Completion delivery modes.
+ *
+ * With DELIVERY_DIRECT (the default) the C client thread runs every
+ * completion and watcher callback itself, acquiring the runtime lock once
+ * per reply. With DELIVERY_QUEUED it only queues the raw results and
+ * signals delivery_fd; callbacks then run on whichever OCaml thread calls
+ * drain_completions, in batches.
+ **)
+type delivery_mode =
+  DELIVERY_DIRECT
+  | DELIVERY_QUEUED
+
+(**
+ * What the single-threaded client waits for.
+ *
+ * Returned by interest: wait until fd is readable (interest_read) and/or
+ * writable (interest_write), or at most interest_timeout milliseconds,
+ * then call process.
+ **)
+type interest = {
+  interest_fd: Unix.file_descr;
+  interest_read: bool;
+  interest_write: bool;
+  interest_timeout: int
+}
+
 (* Debug levels *)
 type log_level =
   ZOO_LOG_LEVEL_ERROR
@@ -398,6 +442,278 @@ type string_completion_callback = error -> string -> string -> unit
  *)
 type acl_completion_callback = error -> acls -> stat -> string -> unit
 
+(**
+ * A node of a subtree fetched by get_tree.
+ *
+ * @node_parent index of the parent node in the array returned by
+ * get_tree, -1 for the subtree root.
+ * @node_error error of the node's own reads; data and stat are empty
+ * unless it is ZOK.
+ **)
+type tree_node = {
+  node_path: string;
+  node_parent: int;
+  node_error: error;
+  node_data: string;
+  node_stat: stat
+}
+
+(**
+ * Client-side data cache over a handle, see cache_create.
+ **)
+type cache
+
+(**
+ * Counters of a data cache.
+ *
+ * @cache_hits reads answered from the cache.
+ * @cache_misses reads that went to the server.
+ * @cache_invalidations entries dropped by a watch event or cache_invalidate.
+ * @cache_entries paths tracked by the cache.
+ **)
+type cache_stats = {
+  cache_hits: int;
+  cache_misses: int;
+  cache_invalidations: int;
+  cache_entries: int
+}
+
+(**
+ * A maintained set of the children of one node, see children_watch.
+ **)
+type children_set
+
+(**
+ * An immutable, sorted list of children shared with the C side. Use the
+ * children_snapshot_* functions to read it without copying it whole.
+ **)
+type children_snapshot
+
+(**
+ * Signature of a children set subscriber.
+ *
+ * @snapshot the whole child list after the change.
+ *
+ * @added the children that appeared since the previous delivery.
+ *
+ * @removed the children that went away since the previous delivery.
+ *)
+type children_diff_callback = children_snapshot -> strings -> strings -> unit
+
+(**
+ * The two kinds of path watch: WATCH_DATA fires on creation, deletion
+ * and data changes of a node, WATCH_CHILDREN on changes to its children.
+ **)
+type watch_kind =
+  | WATCH_DATA
+  | WATCH_CHILDREN
+
+(**
+ * Modes of add_watch. A ZOO_ADD_WATCH_PERSISTENT watch reports the data
+ * and children changes of one node; a ZOO_ADD_WATCH_PERSISTENT_RECURSIVE
+ * watch reports the creation, deletion and data changes of a node and
+ * all its descendants. Neither is removed when it fires.
+ **)
+type add_watch_mode =
+  | ZOO_ADD_WATCH_PERSISTENT
+  | ZOO_ADD_WATCH_PERSISTENT_RECURSIVE
+
+(**
+ * A watcher subscribed with watch_subscribe or add_watch.
+ **)
+type watch_subscription
+
+(**
+ * Counters of the watch multiplexer of a handle.
+ *
+ * @watch_paths paths that have been watched through the handle.
+ * @watch_armed watches currently set at the server.
+ * @watch_subscribers local watchers waiting for an event.
+ **)
+type watch_stats = {
+  watch_paths: int;
+  watch_armed: int;
+  watch_subscribers: int
+}
+
+(**
+ * Operations of a multi request.
+ *
+ * Create_op (path, value, acl, flag) creates a node, Delete_op (path,
+ * version) and Set_op (path, value, version) delete a node or set its
+ * data, and Check_op (path, version) only asserts the version of a node.
+ * A version of -1 disables the version check.
+ **)
+type op =
+  | Create_op of string * string * acls * create_flag
+  | Delete_op of string * int
+  | Set_op of string * string * int
+  | Check_op of string * int
+
+(**
+ * Results of a multi request, one per op and in the same order.
+ *
+ * If the request failed, the op that caused the failure carries the
+ * real error and every other op ZRUNTIMEINCONSISTENCY. The created path
+ * and the new stat are only meaningful when the op's error is ZOK.
+ **)
+type op_result =
+  | Create_result of error * string
+  | Delete_result of error
+  | Set_result of error * stat
+  | Check_result of error
+
+(**
+ * Signature of a completion function for a multi request.
+ *
+ * @rc the error code of the whole request.
+ *
+ * @results one op_result per submitted op.
+ *
+ * @param data the pointer that was passed by the caller when the function
+ * that this completion corresponds to was invoked.
+ *)
+type multi_completion_callback = error -> op_result array -> string -> unit
+
+(**
+ * Occupancy of the asynchronous completion context pool.
+ *
+ * @in_flight asynchronous requests submitted and not yet completed.
+ * @peak_in_flight highest value in_flight has reached.
+ * @pooled completion contexts allocated so far, in use or free.
+ *)
+type completion_stats = {
+  in_flight: int;
+  peak_in_flight: int;
+  pooled: int
+}
+
+(**
+ * Operation types of the per-operation accounting. The watching variants
+ * of a read, children2 and the bulk reads count as the plain read.
+ **)
+type op_type =
+  | OP_CREATE
+  | OP_DELETE
+  | OP_EXISTS
+  | OP_GET
+  | OP_SET
+  | OP_GET_CHILDREN
+  | OP_GET_ACL
+  | OP_SET_ACL
+  | OP_SYNC
+  | OP_MULTI
+  | OP_AUTH
+
+(**
+ * Snapshot of a latency histogram, in microseconds. Values are bucketed
+ * with a relative precision of 1/16th, and quantiles report the largest
+ * value of their bucket.
+ *
+ * @hist_count recorded values.
+ * @hist_sum_us sum of the recorded values.
+ * @hist_max_us largest recorded value.
+ * @hist_buckets (largest value of the bucket, count) of every non-empty
+ * bucket, in increasing order.
+ **)
+type latency_histogram = {
+  hist_count: int;
+  hist_sum_us: int;
+  hist_max_us: int;
+  hist_p50_us: int;
+  hist_p90_us: int;
+  hist_p99_us: int;
+  hist_p999_us: int;
+  hist_buckets: (int * int) array
+}
+
+(**
+ * Accounting of one operation type since the process started.
+ *
+ * @op_submitted requests submitted, synchronous and asynchronous.
+ * @op_completed requests completed, or refused at submission.
+ * @op_errors number of completions per error code, ZOK included; codes
+ * never seen are left out.
+ * @op_service latency from the call until the C client hands over the
+ * result: the server plus the C client's queues.
+ * @op_callback latency from the dispatch of an asynchronous completion
+ * until its callback returns: the wait for the runtime lock or in the
+ * delivery queue, plus the callback.
+ **)
+type op_metrics = {
+  op_type: op_type;
+  op_submitted: int;
+  op_completed: int;
+  op_errors: (error * int) array;
+  op_service: latency_histogram;
+  op_callback: latency_histogram
+}
+
+(**
+ * Client-wide counters since the process started.
+ *
+ * @client_handles handles currently open.
+ * @client_transitions session events seen by the global watchers, per
+ * state reached.
+ * @client_reconnects ZOO_CONNECTED_STATE events of a handle after its
+ * first one.
+ * @client_watches the watch_stats of all open handles, summed.
+ **)
+type client_metrics = {
+  client_handles: int;
+  client_transitions: (state * int) array;
+  client_reconnects: int;
+  client_watches: watch_stats
+}
+
+(**
+ * Tracing hooks, see set_trace_hooks.
+ *
+ * @trace_start span op path size: a request was submitted. span is a
+ * fresh id, path is empty for multi and auth, and size is the number of
+ * data bytes sent.
+ * @trace_end span rc zxid size: the request with that span id completed
+ * with rc. zxid is the mzxid of the returned stat, 0L when the request
+ * returns none or failed, and size the number of data bytes received.
+ **)
+type trace_hooks = {
+  trace_start: int -> op_type -> string -> int -> unit;
+  trace_end: int -> error -> int64 -> int -> unit
+}
+
+(**
+ * A request held by the slow-operation log, see set_slow_op_threshold.
+ *
+ * @slow_path path of the request, truncated to 127 bytes; empty for
+ * multi and auth.
+ * @slow_size number of data bytes sent or received.
+ * @slow_started wall-clock time the request was submitted, in seconds
+ * since the epoch.
+ * @slow_service_us latency from the call until the C client handed over
+ * the result.
+ **)
+type slow_op = {
+  slow_op_type: op_type;
+  slow_path: string;
+  slow_size: int;
+  slow_error: error;
+  slow_started: float;
+  slow_service_us: int
+}
+
+(**
+ * The hottest paths seen by hot-path tracking, hottest first, with their
+ * estimated number of requests. Estimates may exceed the true counts by
+ * a fraction of a percent of all the requests counted, never fall short.
+ *
+ * @hot_reads paths most read with get, exists and get_children.
+ * @hot_writes paths most written with set.
+ **)
+type hot_paths = {
+  hot_reads: (string * int) array;
+  hot_writes: (string * int) array
+}
+
 (*
 
 (** This ID represents anyone. *)
@@ -566,8 +882,6 @@ external async:
 external aget_acl:
      zhandle
   -> string
-  -> int
-  -> acls
   -> acl_completion_callback
   -> string
   -> error = "zkocaml_aget_acl"
@@ -575,10 +889,19 @@ external aget_acl:
 external aset_acl:
      zhandle
   -> string
-  -> acl_completion_callback
+  -> int
+  -> acls
+  -> void_completion_callback
   -> string
   -> error = "zkocaml_aset_acl_native" "zkocaml_aset_acl_bytecode"
 
+external amulti:
+     zhandle
+  -> op array
+  -> multi_completion_callback
+  -> string
+  -> error = "zkocaml_amulti"
+
 external zerror:
      int
   -> string = "zkocaml_zerror"
@@ -607,6 +930,150 @@ external deterministic_conn_order:
      bool
   -> unit = "zkocaml_deterministic_conn_order"
 
+external children_snapshot:
+     children_set
+  -> children_snapshot = "zkocaml_children_snapshot"
+
+external children_snapshot_length:
+     children_snapshot
+  -> int = "zkocaml_children_snapshot_length"
+
+external children_snapshot_get:
+     children_snapshot
+  -> int
+  -> string = "zkocaml_children_snapshot_get"
+
+external children_snapshot_mem:
+     children_snapshot
+  -> string
+  -> bool = "zkocaml_children_snapshot_mem"
+
+external children_snapshot_to_array:
+     children_snapshot
+  -> strings = "zkocaml_children_snapshot_to_array"
+
+external watch_subscribe:
+     zhandle
+  -> string
+  -> watch_kind
+  -> watcher_callback
+  -> string
+  -> error * watch_subscription = "zkocaml_watch_subscribe"
+
+external add_watch:
+     zhandle
+  -> string
+  -> add_watch_mode
+  -> watcher_callback
+  -> string
+  -> error * watch_subscription = "zkocaml_add_watch"
+
+external remove_watches:
+     zhandle
+  -> string
+  -> error = "zkocaml_remove_watches"
+
+external watch_unsubscribe:
+     watch_subscription
+  -> unit = "zkocaml_watch_unsubscribe"
+
+external watch_stats:
+     zhandle
+  -> watch_stats = "zkocaml_watch_stats"
+
+external completion_context_stats:
+     unit
+  -> completion_stats = "zkocaml_completion_context_stats"
+
+external op_metrics:
+     unit
+  -> op_metrics array = "zkocaml_op_metrics"
+
+external client_metrics:
+     unit
+  -> client_metrics = "zkocaml_client_metrics"
+
+(**
+ * Installs tracing hooks, or removes them with None. trace_start runs in
+ * the calling thread when a request is submitted; trace_end when its
+ * completion is dispatched, before the completion callback, or when a
+ * synchronous call returns. Exceptions raised by the hooks are dropped.
+ * Without hooks, requests pay a single test per span.
+ **)
+external set_trace_hooks:
+     trace_hooks option
+  -> unit = "zkocaml_set_trace_hooks"
+
+(**
+ * Logs every request of the given op type whose service latency reaches
+ * threshold_us microseconds, 0 turning the log off for that op type,
+ * which is the default. The log keeps the last 256 slow requests of all
+ * op types and is filled without taking any lock.
+ **)
+external set_slow_op_threshold:
+     op_type
+  -> int
+  -> unit = "zkocaml_set_slow_op_threshold"
+
+(**
+ * Returns the requests held by the slow-operation log, oldest first.
+ **)
+external slow_ops:
+     unit
+  -> slow_op array = "zkocaml_slow_ops"
+
+(**
+ * Writes the requests held by the slow-operation log, oldest first, one
+ * line each, to the stream set by set_log_stream, or to stderr.
+ **)
+external dump_slow_ops:
+     unit
+  -> unit = "zkocaml_dump_slow_ops"
+
+(**
+ * Turns client-side hot-path tracking on or off; it is off by default.
+ * While on, every completed get, exists, get_children and set request is
+ * counted against its path in a count-min sketch, and the 16 hottest
+ * paths for reads and for writes are kept up to date. Counting takes a
+ * few atomic additions and never waits for a lock.
+ **)
+external set_hot_path_tracking:
+     bool
+  -> unit = "zkocaml_set_hot_path_tracking"
+
+external hot_paths:
+     unit
+  -> hot_paths = "zkocaml_hot_paths"
+
+(**
+ * Forgets everything counted by hot-path tracking so far.
+ **)
+external reset_hot_paths:
+     unit
+  -> unit = "zkocaml_reset_hot_paths"
+
+external set_delivery_mode:
+     delivery_mode
+  -> unit = "zkocaml_set_delivery_mode"
+
+external delivery_fd:
+     unit
+  -> Unix.file_descr = "zkocaml_delivery_fd"
+
+external drain_completions:
+     int
+  -> int = "zkocaml_drain_completions"
+
+external interest:
+     zhandle
+  -> error * interest = "zkocaml_interest"
+
+external process:
+     zhandle
+  -> bool
+  -> bool
+  -> error = "zkocaml_process"
+
 external create:
      zhandle
   -> string
@@ -698,3 +1165,140 @@ external set_acl:
   -> int
   -> acls
   -> error = "zkocaml_set_acl"
+
+external multi:
+     zhandle
+  -> op array
+  -> error * op_result array = "zkocaml_multi"
+
+external bulk_get:
+     zhandle
+  -> string array
+  -> (error * string * stat) array = "zkocaml_bulk_get"
+
+external bulk_exists:
+     zhandle
+  -> string array
+  -> (error * stat) array = "zkocaml_bulk_exists"
+
+external bulk_get_children:
+     zhandle
+  -> string array
+  -> (error * strings) array = "zkocaml_bulk_get_children"
+
+external get_tree:
+     zhandle
+  -> string
+  -> int
+  -> tree_node array = "zkocaml_get_tree"
+
+external rmr:
+     zhandle
+  -> string
+  -> int
+  -> (string * error) array = "zkocaml_rmr"
+
+external cache_create:
+     zhandle
+  -> cache = "zkocaml_cache_create"
+
+external cache_get:
+     cache
+  -> string
+  -> error * string * stat = "zkocaml_cache_get"
+
+external cache_invalidate:
+     cache
+  -> string
+  -> unit = "zkocaml_cache_invalidate"
+
+external cache_stats:
+     cache
+  -> cache_stats = "zkocaml_cache_stats"
+
+external children_watch:
+     zhandle
+  -> string
+  -> children_diff_callback
+  -> error * children_set = "zkocaml_children_watch"
+
+external children_close:
+     children_set
+  -> unit = "zkocaml_children_close"
+
+external exists_flat:
+     zhandle
+  -> string
+  -> int
+  -> flat_stat
+  -> error = "zkocaml_exists_flat"
+
+external exists_nostat:
+     zhandle
+  -> string
+  -> int
+  -> error = "zkocaml_exists_nostat"
+
+external get_flat:
+     zhandle
+  -> string
+  -> int
+  -> flat_stat
+  -> error * string = "zkocaml_get_flat"
+
+external get_nostat:
+     zhandle
+  -> string
+  -> int
+  -> error * string = "zkocaml_get_nostat"
+
+external get_into:
+     zhandle
+  -> string
+  -> int
+  -> buffer
+  -> int
+  -> int
+  -> error * int * stat = "zkocaml_get_into_bytecode" "zkocaml_get_into_native"
+
+external set_from:
+     zhandle
+  -> string
+  -> buffer
+  -> int
+  -> int
+  -> int
+  -> error = "zkocaml_set_from_bytecode" "zkocaml_set_from_native"
+
+let flat_stat_create () =
+  let s = Bigarray.Array1.create Bigarray.int64 Bigarray.c_layout 11 in
+  Bigarray.Array1.fill s 0L;
+  s
+
+let flat_stat_czxid (s : flat_stat) = Bigarray.Array1.get s 0
+let flat_stat_mzxid (s : flat_stat) = Bigarray.Array1.get s 1
+let flat_stat_ctime (s : flat_stat) = Bigarray.Array1.get s 2
+let flat_stat_mtime (s : flat_stat) = Bigarray.Array1.get s 3
+let flat_stat_version (s : flat_stat) = Int64.to_int (Bigarray.Array1.get s 4)
+let flat_stat_cversion (s : flat_stat) = Int64.to_int (Bigarray.Array1.get s 5)
+let flat_stat_aversion (s : flat_stat) = Int64.to_int (Bigarray.Array1.get s 6)
+let flat_stat_ephemeral_owner (s : flat_stat) = Bigarray.Array1.get s 7
+let flat_stat_data_length (s : flat_stat) =
+  Int64.to_int (Bigarray.Array1.get s 8)
+let flat_stat_num_children (s : flat_stat) =
+  Int64.to_int (Bigarray.Array1.get s 9)
+let flat_stat_pzxid (s : flat_stat) = Bigarray.Array1.get s 10
+
+let stat_of_flat_stat s = {
+  czxid = flat_stat_czxid s;
+  mzxid = flat_stat_mzxid s;
+  ctime = flat_stat_ctime s;
+  mtime = flat_stat_mtime s;
+  version = flat_stat_version s;
+  cversion = flat_stat_cversion s;
+  aversion = flat_stat_aversion s;
+  ephemeral_owner = flat_stat_ephemeral_owner s;
+  data_length = flat_stat_data_length s;
+  num_children = flat_stat_num_children s;
+  pzxid = flat_stat_pzxid s
+}
@@ -3,6 +3,8 @@ type client_id = { client_id : int64; passwd : string; }
 type acl = { perms : int; scheme : string; id : string; }
 type acls = acl array
 type strings = string array
+type buffer =
+    (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
 type stat = {
   czxid : int64;
   mzxid : int64;
@@ -14,8 +16,10 @@ type stat = {
   ephemeral_owner : int64;
   data_length : int;
   num_children : int;
-  pzxid : int;
+  pzxid : int64;
 }
+type flat_stat =
+    (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t
 type error =
     ZOK
   | ZSYSTEMERROR
@@ -62,6 +66,13 @@ type state =
   | ZOO_ASSOCIATING_STATE
   | ZOO_CONNECTED_STATE
 type create_flag = ZOO_EPHEMERAL | ZOO_SEQUENCE
+type delivery_mode = DELIVERY_DIRECT | DELIVERY_QUEUED
+type interest = {
+  interest_fd : Unix.file_descr;
+  interest_read : bool;
+  interest_write : bool;
+  interest_timeout : int;
+}
 type log_level =
     ZOO_LOG_LEVEL_ERROR
   | ZOO_LOG_LEVEL_WARN
@@ -77,6 +88,97 @@ type strings_stat_completion_callback =
     error -> strings -> stat -> string -> unit
 type string_completion_callback = error -> string -> string -> unit
 type acl_completion_callback = error -> acls -> stat -> string -> unit
+type tree_node = {
+  node_path : string;
+  node_parent : int;
+  node_error : error;
+  node_data : string;
+  node_stat : stat;
+}
+type cache
+type cache_stats = {
+  cache_hits : int;
+  cache_misses : int;
+  cache_invalidations : int;
+  cache_entries : int;
+}
+type children_set
+type children_snapshot
+type children_diff_callback = children_snapshot -> strings -> strings -> unit
+type watch_kind = WATCH_DATA | WATCH_CHILDREN
+type add_watch_mode =
+    ZOO_ADD_WATCH_PERSISTENT
+  | ZOO_ADD_WATCH_PERSISTENT_RECURSIVE
+type watch_subscription
+type watch_stats = {
+  watch_paths : int;
+  watch_armed : int;
+  watch_subscribers : int;
+}
+type op =
+    Create_op of string * string * acls * create_flag
+  | Delete_op of string * int
+  | Set_op of string * string * int
+  | Check_op of string * int
+type op_result =
+    Create_result of error * string
+  | Delete_result of error
+  | Set_result of error * stat
+  | Check_result of error
+type multi_completion_callback = error -> op_result array -> string -> unit
+type completion_stats = { in_flight : int; peak_in_flight : int; pooled : int; }
+type op_type =
+    OP_CREATE
+  | OP_DELETE
+  | OP_EXISTS
+  | OP_GET
+  | OP_SET
+  | OP_GET_CHILDREN
+  | OP_GET_ACL
+  | OP_SET_ACL
+  | OP_SYNC
+  | OP_MULTI
+  | OP_AUTH
+type latency_histogram = {
+  hist_count : int;
+  hist_sum_us : int;
+  hist_max_us : int;
+  hist_p50_us : int;
+  hist_p90_us : int;
+  hist_p99_us : int;
+  hist_p999_us : int;
+  hist_buckets : (int * int) array;
+}
+type op_metrics = {
+  op_type : op_type;
+  op_submitted : int;
+  op_completed : int;
+  op_errors : (error * int) array;
+  op_service : latency_histogram;
+  op_callback : latency_histogram;
+}
+type client_metrics = {
+  client_handles : int;
+  client_transitions : (state * int) array;
+  client_reconnects : int;
+  client_watches : watch_stats;
+}
+type trace_hooks = {
+  trace_start : int -> op_type -> string -> int -> unit;
+  trace_end : int -> error -> int64 -> int -> unit;
+}
+type slow_op = {
+  slow_op_type : op_type;
+  slow_path : string;
+  slow_size : int;
+  slow_error : error;
+  slow_started : float;
+  slow_service_us : int;
+}
+type hot_paths = {
+  hot_reads : (string * int) array;
+  hot_writes : (string * int) array;
+}
 external init :
   string -> watcher_callback -> int -> client_id -> string -> int -> zhandle
   = "zkocaml_init_bytecode" "zkocaml_init_native"
@@ -142,12 +244,15 @@ external async :
   zhandle -> string -> string_completion_callback -> string -> error
   = "zkocaml_async"
 external aget_acl :
-  zhandle ->
-  string -> int -> acls -> acl_completion_callback -> string -> error
+  zhandle -> string -> acl_completion_callback -> string -> error
   = "zkocaml_aget_acl"
 external aset_acl :
-  zhandle -> string -> acl_completion_callback -> string -> error
+  zhandle ->
+  string -> int -> acls -> void_completion_callback -> string -> error
   = "zkocaml_aset_acl_native" "zkocaml_aset_acl_bytecode"
+external amulti :
+  zhandle -> op array -> multi_completion_callback -> string -> error
+  = "zkocaml_amulti"
 external zerror : int -> string = "zkocaml_zerror"
 external add_auth :
   zhandle -> string -> string -> void_completion_callback -> string -> error
@@ -157,6 +262,51 @@ external set_log_stream : string -> unit = "zkocaml_set_log_stream"
 external is_unrecoverable : zhandle -> error = "zkocaml_is_unrecoverable"
 external deterministic_conn_order : bool -> unit
   = "zkocaml_deterministic_conn_order"
+external children_snapshot : children_set -> children_snapshot
+  = "zkocaml_children_snapshot"
+external children_snapshot_length : children_snapshot -> int
+  = "zkocaml_children_snapshot_length"
+external children_snapshot_get : children_snapshot -> int -> string
+  = "zkocaml_children_snapshot_get"
+external children_snapshot_mem : children_snapshot -> string -> bool
+  = "zkocaml_children_snapshot_mem"
+external children_snapshot_to_array : children_snapshot -> strings
+  = "zkocaml_children_snapshot_to_array"
+external watch_subscribe :
+  zhandle ->
+  string ->
+  watch_kind -> watcher_callback -> string -> error * watch_subscription
+  = "zkocaml_watch_subscribe"
+external add_watch :
+  zhandle ->
+  string ->
+  add_watch_mode -> watcher_callback -> string -> error * watch_subscription
+  = "zkocaml_add_watch"
+external remove_watches : zhandle -> string -> error
+  = "zkocaml_remove_watches"
+external watch_unsubscribe : watch_subscription -> unit
+  = "zkocaml_watch_unsubscribe"
+external watch_stats : zhandle -> watch_stats = "zkocaml_watch_stats"
+external completion_context_stats : unit -> completion_stats
+  = "zkocaml_completion_context_stats"
+external op_metrics : unit -> op_metrics array = "zkocaml_op_metrics"
+external client_metrics : unit -> client_metrics = "zkocaml_client_metrics"
+external set_trace_hooks : trace_hooks option -> unit
+  = "zkocaml_set_trace_hooks"
+external set_slow_op_threshold : op_type -> int -> unit
+  = "zkocaml_set_slow_op_threshold"
+external slow_ops : unit -> slow_op array = "zkocaml_slow_ops"
+external dump_slow_ops : unit -> unit = "zkocaml_dump_slow_ops"
+external set_hot_path_tracking : bool -> unit
+  = "zkocaml_set_hot_path_tracking"
+external hot_paths : unit -> hot_paths = "zkocaml_hot_paths"
+external reset_hot_paths : unit -> unit = "zkocaml_reset_hot_paths"
+external set_delivery_mode : delivery_mode -> unit
+  = "zkocaml_set_delivery_mode"
+external delivery_fd : unit -> Unix.file_descr = "zkocaml_delivery_fd"
+external drain_completions : int -> int = "zkocaml_drain_completions"
+external interest : zhandle -> error * interest = "zkocaml_interest"
+external process : zhandle -> bool -> bool -> error = "zkocaml_process"
 external create :
   zhandle -> string -> string -> acls -> create_flag -> error * string
   = "zkocaml_create"
@@ -187,3 +337,54 @@ external get_acl : zhandle -> string -> error * acls * stat
   = "zkocaml_get_acl"
 external set_acl : zhandle -> string -> int -> acls -> error
   = "zkocaml_set_acl"
+external multi : zhandle -> op array -> error * op_result array
+  = "zkocaml_multi"
+external bulk_get : zhandle -> string array -> (error * string * stat) array
+  = "zkocaml_bulk_get"
+external bulk_exists : zhandle -> string array -> (error * stat) array
+  = "zkocaml_bulk_exists"
+external bulk_get_children :
+  zhandle -> string array -> (error * strings) array
+  = "zkocaml_bulk_get_children"
+external get_tree : zhandle -> string -> int -> tree_node array
+  = "zkocaml_get_tree"
+external rmr : zhandle -> string -> int -> (string * error) array
+  = "zkocaml_rmr"
+external cache_create : zhandle -> cache = "zkocaml_cache_create"
+external cache_get : cache -> string -> error * string * stat
+  = "zkocaml_cache_get"
+external cache_invalidate : cache -> string -> unit
+  = "zkocaml_cache_invalidate"
+external cache_stats : cache -> cache_stats = "zkocaml_cache_stats"
+external children_watch :
+  zhandle -> string -> children_diff_callback -> error * children_set
+  = "zkocaml_children_watch"
+external children_close : children_set -> unit = "zkocaml_children_close"
+external exists_flat : zhandle -> string -> int -> flat_stat -> error
+  = "zkocaml_exists_flat"
+external exists_nostat : zhandle -> string -> int -> error
+  = "zkocaml_exists_nostat"
+external get_flat :
+  zhandle -> string -> int -> flat_stat -> error * string
+  = "zkocaml_get_flat"
+external get_nostat : zhandle -> string -> int -> error * string
+  = "zkocaml_get_nostat"
+external get_into :
+  zhandle -> string -> int -> buffer -> int -> int -> error * int * stat
+  = "zkocaml_get_into_bytecode" "zkocaml_get_into_native"
+external set_from :
+  zhandle -> string -> buffer -> int -> int -> int -> error
+  = "zkocaml_set_from_bytecode" "zkocaml_set_from_native"
+val flat_stat_create : unit -> flat_stat
+val flat_stat_czxid : flat_stat -> int64
+val flat_stat_mzxid : flat_stat -> int64
+val flat_stat_ctime : flat_stat -> int64
+val flat_stat_mtime : flat_stat -> int64
+val flat_stat_version : flat_stat -> int
+val flat_stat_cversion : flat_stat -> int
+val flat_stat_aversion : flat_stat -> int
+val flat_stat_ephemeral_owner : flat_stat -> int64
+val flat_stat_data_length : flat_stat -> int
+val flat_stat_num_children : flat_stat -> int
+val flat_stat_pzxid : flat_stat -> int64
+val stat_of_flat_stat : flat_stat -> stat